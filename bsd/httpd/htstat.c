@@ -0,0 +1,861 @@
+/*
+ * htstat.c - Offline analyzer for httpd access logs
+ *
+ *  Reads the text log written by httpd(8):
+ *
+ *    host [Sun Sep 16 01:03:52 1973] "GET /path HTTP/1.0" 200 1234
+ *
+ *  or, with -b, the compact binary log written when httpd is built
+ *  with -DBINLOG. Reports the status mix, the most requested paths,
+ *  bytes sent per host and the request rate per minute.
+ *
+ *  Usage:
+ *    htstat [-b] [-s] [-j workers] [-n top] [logfile]
+ *
+ *    -b    binary log format (default file /usr/adm/httpd.blog)
+ *    -s    streaming: read sequentially and print each minute's
+ *          count as soon as the next minute starts; use "-" as the
+ *          file to follow a pipe, e.g.  tail -f log | htstat -s -
+ *    -j    number of worker processes for a regular file (default 4)
+ *    -n    how many paths and hosts to list (default 10)
+ *
+ *  A regular file is mapped into memory and cut into one range per
+ *  worker, each range starting on a record boundary. Every worker
+ *  fills its own hash tables and hands them back to the parent over
+ *  a pipe, where they are merged. Build with -DNOMMAP on systems
+ *  without mmap(); the workers then read their ranges with read().
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifndef NOMMAP
+#include <sys/mman.h>
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef S_ISREG
+#define S_ISREG(m)  (((m) & S_IFMT) == S_IFREG)
+#endif
+
+#define LOGFILE     "/usr/adm/httpd.log"
+#define BINLOGFILE  "/usr/adm/httpd.blog"
+
+#define RDSIZE      65536   /* read() size when not mapping */
+#define MAXWORK     64
+#define NSTATUS     600     /* status codes 100-599; 0 is "none" */
+#define BLHDR       14      /* binary record header, see httpd.c */
+
+/* One hash table entry: a path or a host */
+struct ent {
+    char *key;
+    unsigned klen;
+    unsigned long hash;
+    long count;
+    long bytes;
+};
+
+struct tab {
+    struct ent *e;
+    unsigned size;          /* always a power of two */
+    unsigned used;
+    char *arena;            /* key storage */
+    unsigned aleft;
+};
+
+/* Requests per minute, keyed by minutes since 1970 (local time) */
+struct ment {
+    long min;
+    long count;
+};
+
+struct mtab {
+    struct ment *e;
+    unsigned size;
+    unsigned used;
+};
+
+struct stats {
+    long nreq;
+    long nbytes;
+    long nbad;
+    long status[NSTATUS];
+    struct tab paths;
+    struct tab hosts;
+    struct mtab mins;
+    /* streaming output */
+    int stream;
+    long curmin;
+    long curcnt;
+};
+
+int binfmt;
+long tzoff;                 /* seconds east of UTC, for -b */
+
+static char *monthnames = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+void *xalloc(n)
+unsigned n;
+{
+    void *p;
+
+    p = calloc(1, n);
+    if (!p) {
+        fprintf(stderr, "htstat: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* FNV-1a */
+unsigned long hashkey(p, n)
+char *p;
+unsigned n;
+{
+    unsigned long h = 2166136261UL;
+
+    while (n--) {
+        h ^= (unsigned char)*p++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+void tinit(t, size)
+struct tab *t;
+unsigned size;
+{
+    t->e = (struct ent *)xalloc(size * sizeof(struct ent));
+    t->size = size;
+    t->used = 0;
+    t->arena = 0;
+    t->aleft = 0;
+}
+
+void tgrow(t)
+struct tab *t;
+{
+    struct ent *old;
+    unsigned osize, i, j;
+
+    old = t->e;
+    osize = t->size;
+    t->size = osize * 2;
+    t->e = (struct ent *)xalloc(t->size * sizeof(struct ent));
+    for (i = 0; i < osize; i++) {
+        if (!old[i].key)
+            continue;
+        j = old[i].hash & (t->size - 1);
+        while (t->e[j].key)
+            j = (j + 1) & (t->size - 1);
+        t->e[j] = old[i];
+    }
+    free(old);
+}
+
+/* Find key in t, adding it with zero counts if it is new */
+struct ent *tget(t, key, klen)
+struct tab *t;
+char *key;
+unsigned klen;
+{
+    unsigned long h;
+    unsigned i;
+    struct ent *e;
+
+    h = hashkey(key, klen);
+    i = h & (t->size - 1);
+    for (;;) {
+        e = &t->e[i];
+        if (!e->key)
+            break;
+        if (e->hash == h && e->klen == klen && !memcmp(e->key, key, klen))
+            return e;
+        i = (i + 1) & (t->size - 1);
+    }
+
+    if (klen + 1 > t->aleft) {
+        t->aleft = klen + 1 > 32768 ? klen + 1 : 32768;
+        t->arena = (char *)xalloc(t->aleft);
+    }
+    e->key = t->arena;
+    bcopy(key, e->key, klen);
+    t->arena += klen + 1;
+    t->aleft -= klen + 1;
+    e->klen = klen;
+    e->hash = h;
+    if (++t->used * 2 > t->size) {
+        tgrow(t);
+        return tget(t, key, klen);
+    }
+    return e;
+}
+
+void minit(m, size)
+struct mtab *m;
+unsigned size;
+{
+    unsigned i;
+
+    m->e = (struct ment *)xalloc(size * sizeof(struct ment));
+    m->size = size;
+    m->used = 0;
+    for (i = 0; i < size; i++)
+        m->e[i].min = -1;
+}
+
+struct ment *mget(m, min)
+struct mtab *m;
+long min;
+{
+    struct ment *old;
+    unsigned i, j, osize;
+
+    i = (unsigned)(min * 2654435761UL) & (m->size - 1);
+    while (m->e[i].min != -1) {
+        if (m->e[i].min == min)
+            return &m->e[i];
+        i = (i + 1) & (m->size - 1);
+    }
+    if ((m->used + 1) * 2 > m->size) {
+        old = m->e;
+        osize = m->size;
+        minit(m, osize * 2);
+        for (j = 0; j < osize; j++)
+            if (old[j].min != -1)
+                *mget(m, old[j].min) = old[j];
+        free(old);
+        return mget(m, min);
+    }
+    m->used++;
+    m->e[i].min = min;
+    m->e[i].count = 0;
+    return &m->e[i];
+}
+
+void sinit(st)
+struct stats *st;
+{
+    bzero((char *)st, sizeof(*st));
+    tinit(&st->paths, 1024);
+    tinit(&st->hosts, 256);
+    minit(&st->mins, 1024);
+    st->curmin = -1;
+}
+
+/* Days since 1970-01-01 of a civil date (proleptic Gregorian) */
+long civdays(y, m, d)
+long y;
+int m, d;
+{
+    long era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+void civdate(days, yp, mp, dp)
+long days;
+int *yp, *mp, *dp;
+{
+    long era, doe, yoe, y, doy, mp0;
+
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    y = yoe + era * 400;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp0 = (5 * doy + 2) / 153;
+    *dp = doy - (153 * mp0 + 2) / 5 + 1;
+    *mp = mp0 < 10 ? mp0 + 3 : mp0 - 9;
+    *yp = y + (*mp <= 2);
+}
+
+void prmin(min, count)
+long min, count;
+{
+    int y, m, d;
+
+    civdate(min / 1440, &y, &m, &d);
+    printf("%04d-%02d-%02d %02ld:%02ld %ld\n", y, m, d,
+           (min % 1440) / 60, min % 60, count);
+}
+
+/* Account one parsed request */
+void record(st, host, hlen, path, plen, min, code, bytes)
+struct stats *st;
+char *host, *path;
+unsigned hlen, plen;
+long min;
+int code;
+long bytes;
+{
+    struct ent *e;
+    struct ment *m;
+
+    st->nreq++;
+    st->nbytes += bytes;
+    st->status[code > 0 && code < NSTATUS ? code : 0]++;
+
+    e = tget(&st->paths, path, plen);
+    e->count++;
+    e->bytes += bytes;
+
+    e = tget(&st->hosts, host, hlen);
+    e->count++;
+    e->bytes += bytes;
+
+    if (min < 0)
+        return;
+    if (st->stream) {
+        /* The log is in time order, so a new minute closes the last */
+        if (min != st->curmin) {
+            if (st->curmin >= 0) {
+                prmin(st->curmin, st->curcnt);
+                fflush(stdout);
+            }
+            st->curmin = min;
+            st->curcnt = 0;
+        }
+        st->curcnt++;
+    }
+    m = mget(&st->mins, min);
+    m->count++;
+}
+
+/*
+ * Parse one text log line in [p, e), no newline. The ctime() stamp
+ * is fixed width: "Sun Sep 16 01:03:52 1973".
+ */
+void scanline(st, p, e)
+struct stats *st;
+char *p, *e;
+{
+    char *host, *path, *q;
+    unsigned hlen, plen;
+    long min;
+    int code, mon;
+    long bytes;
+
+    host = p;
+    while (p < e && *p != ' ')
+        p++;
+    hlen = p - host;
+    if (p + 28 > e || p[1] != '[' || p[26] != ']') {
+        st->nbad++;
+        return;
+    }
+
+    /* Time stamp */
+    q = p + 2;
+    for (mon = 0; mon < 12; mon++)
+        if (!memcmp(q + 4, monthnames + mon * 3, 3))
+            break;
+    if (mon < 12) {
+        min = civdays((long)(q[20] - '0') * 1000 + (q[21] - '0') * 100 +
+                      (q[22] - '0') * 10 + (q[23] - '0'), mon + 1,
+                      (q[8] == ' ' ? 0 : q[8] - '0') * 10 + q[9] - '0');
+        min = min * 1440 + ((q[11] - '0') * 10 + q[12] - '0') * 60 +
+              (q[14] - '0') * 10 + q[15] - '0';
+    } else
+        min = -1;
+    p += 27;
+
+    /* Request line: the path is its second word */
+    path = "-";
+    plen = 1;
+    if (p + 1 < e && p[1] == '"') {
+        p += 2;
+        q = p;
+        while (p < e && *p != '"')
+            p++;
+        while (q < p && *q != ' ')
+            q++;
+        if (q < p) {
+            path = ++q;
+            while (q < p && *q != ' ')
+                q++;
+            plen = q - path;
+        }
+        if (p < e)
+            p++;
+    }
+
+    /* Status and, for 200, the size; anything else is a message */
+    code = 0;
+    bytes = 0;
+    if (p + 4 <= e && p[0] == ' ' &&
+        p[1] >= '0' && p[1] <= '9' && p[2] >= '0' && p[2] <= '9' &&
+        p[3] >= '0' && p[3] <= '9') {
+        code = (p[1] - '0') * 100 + (p[2] - '0') * 10 + p[3] - '0';
+        p += 4;
+        if (p < e && *p == ' ')
+            for (p++; p < e && *p >= '0' && *p <= '9'; p++)
+                bytes = bytes * 10 + *p - '0';
+    }
+
+    record(st, host, hlen, path, plen, min, code, bytes);
+}
+
+#define LE16(p) ((unsigned)(p)[0] | (unsigned)(p)[1] << 8)
+#define LE32(p) ((unsigned long)LE16(p) | (unsigned long)LE16((p) + 2) << 16)
+
+/*
+ * Parse all complete records in [p, e). Returns a pointer to the
+ * first byte not consumed, the start of a partial record.
+ */
+char *scanbuf(st, p, e)
+struct stats *st;
+char *p, *e;
+{
+    unsigned char *u;
+    char *nl;
+    unsigned hl, pl;
+
+    if (!binfmt) {
+        while (p < e && (nl = memchr(p, '\n', e - p))) {
+            scanline(st, p, nl);
+            p = nl + 1;
+        }
+        return p;
+    }
+
+    while (p + BLHDR <= e) {
+        u = (unsigned char *)p;
+        if (u[0] != 'H') {
+            st->nbad++;
+            return e;       /* lost sync; give up on this range */
+        }
+        hl = u[1];
+        pl = LE16(u + 2);
+        if (p + BLHDR + hl + pl > e)
+            break;
+        record(st, p + BLHDR, hl, pl ? p + BLHDR + hl : "-", pl ? pl : 1,
+               (long)((LE32(u + 4) + tzoff) / 60), (int)LE16(u + 8),
+               (long)LE32(u + 10));
+        p += BLHDR + hl + pl;
+    }
+    return p;
+}
+
+/* Parse a mapped range; only the last range can end without a newline */
+void scanmap(st, p, e)
+struct stats *st;
+char *p, *e;
+{
+    p = scanbuf(st, p, e);
+    if (p < e && !binfmt)
+        scanline(st, p, e);
+}
+
+/* Read fd from its current offset for len bytes (or to EOF if len < 0) */
+void scanfd(st, fd, len)
+struct stats *st;
+int fd;
+long len;
+{
+    char *buf, *p;
+    int n, have, want;
+
+    buf = (char *)xalloc(RDSIZE);
+    have = 0;
+    for (;;) {
+        want = RDSIZE - have;
+        if (len >= 0 && want > len)
+            want = len;
+        if (want == 0 && have == RDSIZE) {
+            /* One record longer than the buffer; skip it */
+            st->nbad++;
+            have = 0;
+            continue;
+        }
+        if (want == 0 || (n = read(fd, buf + have, want)) <= 0)
+            break;
+        if (len >= 0)
+            len -= n;
+        have += n;
+        p = scanbuf(st, buf, buf + have);
+        have -= p - buf;
+        bcopy(p, buf, have);
+    }
+    if (have > 0 && !binfmt) {
+        /* Last line without a newline */
+        scanline(st, buf, buf + have);
+    }
+    free(buf);
+}
+
+/* Serialize a worker's tables to the parent */
+void tput(t, fp)
+struct tab *t;
+FILE *fp;
+{
+    unsigned i;
+
+    fwrite((char *)&t->used, sizeof(t->used), 1, fp);
+    for (i = 0; i < t->size; i++) {
+        if (!t->e[i].key)
+            continue;
+        fwrite((char *)&t->e[i].klen, sizeof(unsigned), 1, fp);
+        fwrite((char *)&t->e[i].count, sizeof(long), 1, fp);
+        fwrite((char *)&t->e[i].bytes, sizeof(long), 1, fp);
+        fwrite(t->e[i].key, 1, t->e[i].klen, fp);
+    }
+}
+
+void sput(st, fp)
+struct stats *st;
+FILE *fp;
+{
+    unsigned i;
+
+    fwrite((char *)&st->nreq, sizeof(long), 1, fp);
+    fwrite((char *)&st->nbytes, sizeof(long), 1, fp);
+    fwrite((char *)&st->nbad, sizeof(long), 1, fp);
+    fwrite((char *)st->status, sizeof(long), NSTATUS, fp);
+    tput(&st->paths, fp);
+    tput(&st->hosts, fp);
+    fwrite((char *)&st->mins.used, sizeof(unsigned), 1, fp);
+    for (i = 0; i < st->mins.size; i++)
+        if (st->mins.e[i].min != -1)
+            fwrite((char *)&st->mins.e[i], sizeof(struct ment), 1, fp);
+}
+
+/* Merge a serialized table into t */
+int tmerge(t, fp)
+struct tab *t;
+FILE *fp;
+{
+    unsigned n, klen;
+    long cb[2];
+    char *key;
+    struct ent *e;
+
+    if (fread((char *)&n, sizeof(n), 1, fp) != 1)
+        return -1;
+    key = (char *)xalloc(65536);
+    while (n--) {
+        if (fread((char *)&klen, sizeof(klen), 1, fp) != 1 ||
+            fread((char *)cb, sizeof(long), 2, fp) != 2 ||
+            klen > 65536 || fread(key, 1, klen, fp) != klen) {
+            free(key);
+            return -1;
+        }
+        e = tget(t, key, klen);
+        e->count += cb[0];
+        e->bytes += cb[1];
+    }
+    free(key);
+    return 0;
+}
+
+int smerge(st, fp)
+struct stats *st;
+FILE *fp;
+{
+    long v[3 + NSTATUS];
+    unsigned n, i;
+    struct ment m;
+
+    if (fread((char *)v, sizeof(long), 3 + NSTATUS, fp) != 3 + NSTATUS)
+        return -1;
+    st->nreq += v[0];
+    st->nbytes += v[1];
+    st->nbad += v[2];
+    for (i = 0; i < NSTATUS; i++)
+        st->status[i] += v[3 + i];
+    if (tmerge(&st->paths, fp) < 0 || tmerge(&st->hosts, fp) < 0)
+        return -1;
+    if (fread((char *)&n, sizeof(n), 1, fp) != 1)
+        return -1;
+    while (n--) {
+        if (fread((char *)&m, sizeof(m), 1, fp) != 1)
+            return -1;
+        mget(&st->mins, m.min)->count += m.count;
+    }
+    return 0;
+}
+
+/*
+ * Cut [0, size) into nwork ranges that each begin on a record.
+ * For text a range starts just past a newline; binary records are
+ * walked header to header, which touches only a few bytes each.
+ */
+void split(base, fd, size, nwork, cut)
+char *base;
+int fd;
+long size;
+int nwork;
+long *cut;
+{
+    char c;
+    long off, next;
+    int i;
+    unsigned char *u;
+
+    cut[0] = 0;
+    cut[nwork] = size;
+    if (binfmt) {
+        off = 0;
+        for (i = 1; i < nwork; i++) {
+            next = size / nwork * i;
+            while (base && off < next && off + BLHDR <= size) {
+                u = (unsigned char *)base + off;
+                off += BLHDR + u[1] + LE16(u + 2);
+            }
+            cut[i] = base && off < size ? off : size;
+        }
+        return;
+    }
+    for (i = 1; i < nwork; i++) {
+        off = size / nwork * i;
+        if (off < cut[i - 1])
+            off = cut[i - 1];
+        if (base) {
+            while (off < size && base[off - 1] != '\n')
+                off++;
+        } else {
+            lseek(fd, off - 1, SEEK_SET);
+            while (off < size && read(fd, &c, 1) == 1 && c != '\n')
+                off++;
+        }
+        cut[i] = off;
+    }
+}
+
+int cmpcount(a, b)
+struct ent **a, **b;
+{
+    return (*b)->count > (*a)->count ? 1 : (*b)->count < (*a)->count ? -1 : 0;
+}
+
+int cmpbytes(a, b)
+struct ent **a, **b;
+{
+    return (*b)->bytes > (*a)->bytes ? 1 : (*b)->bytes < (*a)->bytes ? -1 : 0;
+}
+
+int cmpmin(a, b)
+struct ment *a, *b;
+{
+    return a->min > b->min ? 1 : a->min < b->min ? -1 : 0;
+}
+
+struct ent **sorted(t, cmp)
+struct tab *t;
+int (*cmp)();
+{
+    struct ent **v;
+    unsigned i, n;
+
+    v = (struct ent **)xalloc((t->used + 1) * sizeof(struct ent *));
+    for (i = n = 0; i < t->size; i++)
+        if (t->e[i].key)
+            v[n++] = &t->e[i];
+    qsort((char *)v, n, sizeof(*v), cmp);
+    return v;
+}
+
+void report(st, top)
+struct stats *st;
+int top;
+{
+    struct ent **v;
+    struct ment *m;
+    unsigned i, n;
+
+    printf("requests %ld  bytes %ld  unparsed %ld\n",
+           st->nreq, st->nbytes, st->nbad);
+
+    printf("\nstatus\n");
+    for (i = 0; i < NSTATUS; i++)
+        if (st->status[i])
+            printf("  %3d %10ld %5.1f%%\n", i, st->status[i],
+                   100.0 * st->status[i] / st->nreq);
+
+    printf("\ntop paths\n");
+    v = sorted(&st->paths, cmpcount);
+    for (i = 0; i < st->paths.used && i < top; i++)
+        printf("  %10ld %12ld %.*s\n", v[i]->count, v[i]->bytes,
+               (int)v[i]->klen, v[i]->key);
+    free(v);
+
+    printf("\nbytes by host\n");
+    v = sorted(&st->hosts, cmpbytes);
+    for (i = 0; i < st->hosts.used && i < top; i++)
+        printf("  %12ld %10ld %.*s\n", v[i]->bytes, v[i]->count,
+               (int)v[i]->klen, v[i]->key);
+    free(v);
+
+    if (st->stream)
+        return;
+    printf("\nrequests per minute\n");
+    m = (struct ment *)xalloc((st->mins.used + 1) * sizeof(struct ment));
+    for (i = n = 0; i < st->mins.size; i++)
+        if (st->mins.e[i].min != -1)
+            m[n++] = st->mins.e[i];
+    qsort((char *)m, n, sizeof(*m), cmpmin);
+    for (i = 0; i < n; i++) {
+        printf("  ");
+        prmin(m[i].min, m[i].count);
+    }
+    free(m);
+}
+
+int main(argc, argv)
+int argc;
+char *argv[];
+{
+    struct stats st;
+    struct stat sb;
+    char *file, *base;
+    long cut[MAXWORK + 1];
+    int fd, nwork, top, i, c;
+    int pfd[MAXWORK][2];
+    FILE *fp;
+    extern char *optarg;
+    extern int optind;
+
+    nwork = 4;
+    top = 10;
+    sinit(&st);
+    while ((c = getopt(argc, argv, "bsj:n:")) != EOF) {
+        switch (c) {
+        case 'b':
+            binfmt = 1;
+            break;
+        case 's':
+            st.stream = 1;
+            break;
+        case 'j':
+            nwork = atoi(optarg);
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                "Usage: %s [-b] [-s] [-j workers] [-n top] [logfile]\n",
+                argv[0]);
+            exit(1);
+        }
+    }
+    if (nwork < 1)
+        nwork = 1;
+    if (nwork > MAXWORK)
+        nwork = MAXWORK;
+
+    file = optind < argc ? argv[optind] : binfmt ? BINLOGFILE : LOGFILE;
+    if (!strcmp(file, "-"))
+        fd = 0;
+    else if ((fd = open(file, O_RDONLY)) < 0) {
+        perror(file);
+        exit(1);
+    }
+
+    if (binfmt) {
+        /* Binary times are UTC; report them in local time like ctime() */
+        time_t now;
+        struct tm *tm;
+
+        time(&now);
+        tm = localtime(&now);
+        tzoff = civdays((long)tm->tm_year + 1900, tm->tm_mon + 1,
+                        tm->tm_mday) * 86400L + tm->tm_hour * 3600L +
+                tm->tm_min * 60L + tm->tm_sec - (long)now;
+    }
+
+    /* Pipes, terminals and -s are read front to back */
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || st.stream ||
+        sb.st_size == 0) {
+        scanfd(&st, fd, -1L);
+        if (st.stream && st.curmin >= 0)
+            prmin(st.curmin, st.curcnt);
+        if (st.stream)
+            printf("\n");
+        report(&st, top);
+        exit(0);
+    }
+
+    base = 0;
+#ifndef NOMMAP
+    base = mmap((void *)0, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd,
+                (off_t)0);
+    if (base == (char *)MAP_FAILED)
+        base = 0;
+#ifdef MADV_SEQUENTIAL
+    else
+        madvise(base, (size_t)sb.st_size, MADV_SEQUENTIAL);
+#endif
+#endif
+    if (!base && binfmt)
+        nwork = 1;          /* cannot find record starts cheaply */
+    if (sb.st_size < RDSIZE)
+        nwork = 1;
+    split(base, fd, (long)sb.st_size, nwork, cut);
+
+    if (nwork == 1) {
+        if (base)
+            scanmap(&st, base, base + sb.st_size);
+        else {
+            lseek(fd, 0L, SEEK_SET);
+            scanfd(&st, fd, (long)sb.st_size);
+        }
+        report(&st, top);
+        exit(0);
+    }
+
+    for (i = 0; i < nwork; i++) {
+        if (pipe(pfd[i]) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+        switch (fork()) {
+        case -1:
+            perror("fork");
+            exit(1);
+        case 0:
+            close(pfd[i][0]);
+            sinit(&st);
+            if (base)
+                scanmap(&st, base + cut[i], base + cut[i + 1]);
+            else {
+                /* Each worker needs its own file offset */
+                close(fd);
+                fd = open(file, O_RDONLY);
+                lseek(fd, cut[i], SEEK_SET);
+                scanfd(&st, fd, cut[i + 1] - cut[i]);
+            }
+            fp = fdopen(pfd[i][1], "w");
+            sput(&st, fp);
+            fclose(fp);
+            _exit(0);
+        }
+        close(pfd[i][1]);
+    }
+
+    for (i = 0; i < nwork; i++) {
+        fp = fdopen(pfd[i][0], "r");
+        if (smerge(&st, fp) < 0) {
+            fprintf(stderr, "htstat: worker %d failed\n", i);
+            exit(1);
+        }
+        fclose(fp);
+    }
+    while (wait((int *)0) > 0)
+        ;
+
+    report(&st, top);
+    exit(0);
+}
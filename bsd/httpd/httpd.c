@@ -20,6 +20,7 @@
 #include <sys/time.h>
 
 #include <netdb.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +32,7 @@
 #define PATH_LEN 512
 #define WWW_ROOT "/var/www/"
 #define LOGFILE "/usr/adm/httpd.log"
+#define BINLOGFILE "/usr/adm/httpd.blog"
 
 #define HTTP_200 "HTTP/1.1 200 OK"
 #define HTTP_403 "HTTP/1.1 403 Forbidden"
@@ -39,6 +41,58 @@
 
 FILE *htlog;
 
+/* Fields of the current request, kept for the binary log */
+char htaddr[64];
+char htpath[PATH_LEN];
+long htsecs;
+int htcode;
+long htbytes;
+
+#ifdef BINLOG
+/*
+ * Append one compact record to BINLOGFILE. The layout is read by
+ * htstat -b; all integers are little-endian:
+ *
+ *   'H', hostlen, pathlen(2), time(4), status(2), bytes(4), host, path
+ *
+ * The whole record goes out in a single write() on an O_APPEND
+ * descriptor so concurrent servers never interleave records.
+ */
+void binlog()
+{
+    unsigned char rec[14 + sizeof(htaddr) + PATH_LEN];
+    int hl, pl, fd;
+
+    hl = strlen(htaddr);
+    pl = strlen(htpath);
+    rec[0] = 'H';
+    rec[1] = hl;
+    rec[2] = pl; rec[3] = pl >> 8;
+    rec[4] = htsecs; rec[5] = htsecs >> 8;
+    rec[6] = htsecs >> 16; rec[7] = htsecs >> 24;
+    rec[8] = htcode; rec[9] = htcode >> 8;
+    rec[10] = htbytes; rec[11] = htbytes >> 8;
+    rec[12] = htbytes >> 16; rec[13] = htbytes >> 24;
+    bcopy(htaddr, &rec[14], hl);
+    bcopy(htpath, &rec[14 + hl], pl);
+
+    fd = open(BINLOGFILE, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0)
+        return;
+    write(fd, (char *)rec, 14 + hl + pl);
+    close(fd);
+}
+#endif /* BINLOG */
+
+/* Finish the log entry for this request and close the log */
+void htclose()
+{
+#ifdef BINLOG
+    binlog();
+#endif
+    fclose(htlog);
+}
+
 /* Get path information and handle errors */
 void chk_path(path, st)
 char *path;
@@ -47,17 +101,20 @@ struct stat *st;
     /* stat the path. If there's an error, log it and terminate. */
     if (stat(path, st) != 0) {
         if (errno & (ENOENT | ENOTDIR | EINVAL | ENAMETOOLONG)) {
+            htcode = 404;
             fprintf(htlog, "404 %s\n", strerror(errno));
             printf("%s\r\n", HTTP_403);
         } else if (errno & EACCES) {
+            htcode = 403;
             fprintf(htlog, "403 %s\n", strerror(errno));
             printf("%s\r\n", HTTP_403);
         } else {
+            htcode = 500;
             fprintf(htlog, "500 %s\n", strerror(errno));
             printf("%s\r\n", HTTP_500);
         }
 
-        fclose(htlog);
+        htclose();
         exit(1);
     }
 }
@@ -98,6 +155,7 @@ char *argv[];
         }
 
         fprintf(htlog, "%s ", host);
+        strncpy(htaddr, host, sizeof(htaddr) - 1);
     }
 
     /* Log request time */
@@ -106,6 +164,7 @@ char *argv[];
         char *logtime;
 
         time(&secs);
+        htsecs = secs;
         logtime = ctime(&secs);
         /* Strip trailing newline from ctime string */
         logtime[strcspn(logtime, "\r\n")] = '\0';
@@ -149,8 +208,10 @@ char *argv[];
                 strtok(line, " ");
                 /* Next token is path */
                 lineptr = strtok(NULL, " ");
-                if (lineptr)
+                if (lineptr) {
                     strncat(path, lineptr, sizeof(path)-strlen(path)-1);
+                    strncpy(htpath, lineptr, sizeof(htpath) - 1);
+                }
             }
         }
     }
@@ -163,8 +224,9 @@ char *argv[];
     /* Check for parent directories in path */
     if (strstr(path, "/..")) {
         printf("%s\r\n", HTTP_403);
+        htcode = 403;
         fprintf(htlog, "403 Request contains \"..\"\n");
-        fclose(htlog);
+        htclose();
         exit(1);
     }
     
@@ -181,8 +243,9 @@ char *argv[];
     /* Only serve regular files */
     if (!(st.st_mode & S_IFREG)) {
         printf("%s\r\n", HTTP_403);
+        htcode = 403;
         fprintf(htlog, "403 Not a regular file\n");
-        fclose(htlog);
+        htclose();
         exit(1);
     }
 
@@ -197,9 +260,10 @@ char *argv[];
         if (!(st.st_mode & S_IEXEC) ||
                 (st.st_mode & (S_ISUID | S_ISGID))) {
             printf("%s\r\n", HTTP_403);
+            htcode = 403;
             fprintf(htlog,
                     "403 File not executable and/or is setuid/setgid\n");
-            fclose(htlog);
+            htclose();
             exit(1);
         }
         
@@ -239,13 +303,16 @@ char *argv[];
         if (!fd) {
             /* Earlier stat should have caught any errors, so we shouldn't
              * get here unless the file changed after the call */
+            htcode = 500;
             fprintf(htlog, "500 %s\n", strerror(errno));
             printf("%s\r\n", HTTP_500);
-            fclose(htlog);
+            htclose();
             exit(1);
         }
 
         printf("%s\r\n", HTTP_200);
+        htcode = 200;
+        htbytes = st.st_size;
         fprintf(htlog, "200 %ld\n", st.st_size);
 
         /* Extract file type and output content-type header */
@@ -271,6 +338,6 @@ char *argv[];
         fclose(fd);
     }
 
-    fclose(htlog);
+    htclose();
     return 0;
 }
@@ -0,0 +1,272 @@
+/*
+ * aggregate.c - publish summaries of metrics over a window (-A seconds)
+ *
+ * With -d and -A, a request whose value is a number is not published
+ * but added to a summary of its topic; every window seconds the
+ * summary of each topic that had values goes out on topic/summary, as
+ *
+ *      {"n":60,"min":1.5,"max":97,"mean":12.4,"last":3,
+ *       "p50":4.1,"p90":35.2,"p99":96.1,
+ *       "sketch":{"gamma":1.10526,"zero":0,"pos":{"k":4,"n":[2,0,7,...]},"neg":{}}}
+ *
+ * so that sampling fast to catch spikes costs the broker one message
+ * per topic and window. Other values, and those of topics beyond the
+ * first MAXMETRIC or too long to leave room for a summary, are
+ * published as they come.
+ *
+ * The quantiles come from a sketch with logarithmic buckets: a value x
+ * counts in bucket k = ceil(log|x| / log gamma), which holds values to
+ * within ALPHA of each other, in "pos" or "neg" by its sign and in
+ * "zero" if it is nearly 0. Each sign's counts are listed for buckets
+ * k, k+1, ... in turn. Sketches with the same gamma merge by
+ * adding the counts of equal buckets, so summaries from several
+ * windows or hosts can be combined downstream into quantiles of the
+ * whole. When a sketch has more than MAXBUCKET buckets, the lowest
+ * ones are merged into one: quantiles of the small values lose
+ * accuracy, those of the large values (the spikes) do not.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "mqtt.h"
+
+#define MAXMETRIC 256           /* topics summarised at once */
+#define HASHSIZE  512           /* twice that, a power of two */
+#define MAXBUCKET 48            /* buckets kept per sign, two decades */
+#define ALPHA     0.05          /* relative accuracy of a bucket */
+#define TINY      1e-9          /* closer to 0 than this counts as 0 */
+#define SUMMARY   960           /* room for topic and summary in a PUBLISH */
+
+/* Buckets of one sign, in increasing order of key */
+struct buckets {
+    int n;
+    int key[MAXBUCKET];
+    long count[MAXBUCKET];
+};
+
+struct metric {
+    char *topic;                /* NULL if the slot is free */
+    long n;
+    double min, max, sum, last;
+    long zero;
+    struct buckets pos, neg;    /* neg by the key of |x| */
+};
+
+int agg_window;                 /* -A: seconds, or 0 */
+
+static struct metric metrics[HASHSIZE];
+static int nmetric;
+static double gamma_, log_gamma;
+
+static unsigned hash(char *s) {
+    unsigned h = 5381;
+
+    while (*s != '\0') {
+        h = h * 33 + (uint8_t)*s++;
+    }
+    return h & (HASHSIZE - 1);
+}
+
+/* The metric for topic, made if need be, or NULL if there is no room */
+static struct metric *find_metric(char *topic) {
+    struct metric *m;
+    unsigned h;
+
+    for (h = hash(topic); metrics[h].topic != NULL; h = (h + 1) & (HASHSIZE - 1)) {
+        if (strcmp(metrics[h].topic, topic) == 0) {
+            return &metrics[h];
+        }
+    }
+    if (nmetric == MAXMETRIC) {
+        return NULL;
+    }
+    m = &metrics[h];
+    memset((char *)m, 0, sizeof(*m));
+    m->topic = (char *)malloc(strlen(topic) + 1);
+    if (m->topic == NULL) {
+        return NULL;
+    }
+    strcpy(m->topic, topic);
+    nmetric++;
+    return m;
+}
+
+/* Merge the two lowest buckets of b into the second */
+static void collapse(struct buckets *b) {
+    b->count[1] += b->count[0];
+    b->n--;
+    bcopy((char *)(b->key + 1), (char *)b->key, b->n * sizeof(int));
+    bcopy((char *)(b->count + 1), (char *)b->count, b->n * sizeof(long));
+}
+
+/* Count one value in bucket k of b */
+static void add_bucket(struct buckets *b, int k) {
+    int i;
+
+    for (i = 0; i < b->n && b->key[i] < k; i++) {
+    }
+    if (i < b->n && b->key[i] == k) {
+        b->count[i]++;
+        return;
+    }
+    if (b->n == MAXBUCKET) {
+        if (i == 0) {
+            b->count[0]++;      /* below the lowest kept: it is the lowest */
+            return;
+        }
+        collapse(b);
+        i--;
+    }
+    bcopy((char *)(b->key + i), (char *)(b->key + i + 1), (b->n - i) * sizeof(int));
+    bcopy((char *)(b->count + i), (char *)(b->count + i + 1), (b->n - i) * sizeof(long));
+    b->key[i] = k;
+    b->count[i] = 1;
+    b->n++;
+}
+
+/* A value in the middle of bucket k */
+static double bucket_value(int k) {
+    return 2.0 * pow(gamma_, k) / (gamma_ + 1.0);
+}
+
+/* The value with rank r (0 for the smallest) in the sketch of m */
+static double quantile(struct metric *m, long r) {
+    int i;
+
+    for (i = m->neg.n - 1; i >= 0; i--) {
+        if ((r -= m->neg.count[i]) < 0) {
+            return -bucket_value(m->neg.key[i]);
+        }
+    }
+    if ((r -= m->zero) < 0) {
+        return 0.0;
+    }
+    for (i = 0; i < m->pos.n; i++) {
+        if ((r -= m->pos.count[i]) < 0) {
+            return bucket_value(m->pos.key[i]);
+        }
+    }
+    return m->max;
+}
+
+/*
+ * Add value to the summary of topic, if it is a finite number (a
+ * trailing % is allowed). Returns 1 if it was taken, 0 if it is to be
+ * published as it is.
+ */
+int agg_add(char *topic, char *value) {
+    struct metric *m;
+    double x;
+    char *end;
+
+    x = strtod(value, &end);
+    if (end == value || !isfinite(x)) {
+        return 0;       /* "inf" and "nan" have no bucket */
+    }
+    end += strspn(end, "% \t");
+    if (*end != '\0' || strlen(topic) > SUMMARY - 240 || (m = find_metric(topic)) == NULL) {
+        return 0;
+    }
+    if (gamma_ == 0) {
+        gamma_ = (1 + ALPHA) / (1 - ALPHA);
+        log_gamma = log(gamma_);
+    }
+
+    if (m->n == 0 || x < m->min) {
+        m->min = x;
+    }
+    if (m->n == 0 || x > m->max) {
+        m->max = x;
+    }
+    m->n++;
+    m->sum += x;
+    m->last = x;
+    if (fabs(x) < TINY) {
+        m->zero++;
+    } else {
+        add_bucket(x > 0 ? &m->pos : &m->neg, (int)ceil(log(fabs(x)) / log_gamma));
+    }
+    return 1;
+}
+
+/* Append the buckets of b to s, as {"k":first key,"n":[counts]} */
+static void format_buckets(char *s, struct buckets *b) {
+    int i, k;
+
+    s += strlen(s);
+    if (b->n == 0) {
+        strcpy(s, "{}");
+        return;
+    }
+    s += sprintf(s, "{\"k\":%d,\"n\":[%ld", b->key[0], b->count[0]);
+    for (i = 1; i < b->n; i++) {
+        for (k = b->key[i - 1] + 1; k < b->key[i]; k++) {
+            s += sprintf(s, ",0");
+        }
+        s += sprintf(s, ",%ld", b->count[i]);
+    }
+    strcpy(s, "]}");
+}
+
+/* Put the summary of m, with its quantiles q, in s */
+static void format_summary(struct metric *m, double *q, char *s) {
+    sprintf(s, "{\"n\":%ld,\"min\":%.6g,\"max\":%.6g,\"mean\":%.6g,\"last\":%.6g,"
+        "\"p50\":%.6g,\"p90\":%.6g,\"p99\":%.6g,"
+        "\"sketch\":{\"gamma\":%.6g,\"zero\":%ld,\"pos\":",
+        m->n, m->min, m->max, m->sum / m->n, m->last,
+        q[0], q[1], q[2], gamma_, m->zero);
+    format_buckets(s, &m->pos);
+    strcat(s, ",\"neg\":");
+    format_buckets(s, &m->neg);
+    strcat(s, "}}");
+}
+
+/*
+ * Publish the summary of every topic that had values since the last
+ * time, and start them all again. Returns 0, or -1 if a send failed.
+ */
+int agg_flush(int sock) {
+    static char summary[40000];         /* gaps from 1e-9 to 1e308, both signs */
+    char topic[SUMMARY];
+    struct buckets *b;
+    struct metric *m;
+    double q[3];
+    int i, room;
+
+    for (i = 0; i < HASHSIZE; i++) {
+        m = &metrics[i];
+        if (m->topic == NULL || m->n == 0) {
+            continue;
+        }
+        room = SUMMARY - (int)strlen(m->topic) - 8;
+
+        /* A long sketch gives up its lowest buckets until it fits */
+        q[0] = quantile(m, (m->n - 1) * 50 / 100);
+        q[1] = quantile(m, (m->n - 1) * 90 / 100);
+        q[2] = quantile(m, (m->n - 1) * 99 / 100);
+        format_summary(m, q, summary);
+        while ((int)strlen(summary) > room) {
+            b = m->neg.n > m->pos.n ? &m->neg : &m->pos;
+            if (b->n < 2) {
+                break;
+            }
+            collapse(b);
+            format_summary(m, q, summary);
+        }
+        sprintf(topic, "%s/summary", m->topic);
+        if (publish_message(sock, topic, summary) != 0) {
+            return -1;
+        }
+
+        /* Keep the slot, so the table need not be rebuilt */
+        m->n = 0;
+        m->sum = 0;
+        m->zero = 0;
+        m->pos.n = m->neg.n = 0;
+    }
+    return 0;
+}
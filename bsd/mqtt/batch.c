@@ -0,0 +1,234 @@
+/*
+ * batch.c - publish many "topic value" lines on one connection (-b)
+ *
+ * The lines come from a file, or from stdin with -b -. Each one is
+ * encoded straight into a single output buffer of -B bytes, and the
+ * buffer goes to the broker in one write when the next packet would
+ * not fit, when the oldest packet in it has waited -L milliseconds,
+ * or at the end of the input. Ten thousand readings then cost one
+ * connection and a few dozen writes, not ten thousand runs of mqtt.
+ *
+ * At QoS 1 and 2 a batch also ends when the window of packets in
+ * flight is full (see qos.c).
+ *
+ * The latency bound only comes into play when lines trickle in from
+ * a pipe or terminal; a plain file is read as fast as it will go.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "mqtt.h"
+
+#define INSIZE 8192     /* input buffer, and so the longest line */
+
+/* Encoded packets waiting to go out */
+struct batch {
+    uint8_t *buf;
+    int len;
+    int size;
+    struct timeval first;       /* when the oldest packet went in */
+};
+
+static long messages, writes;
+
+/* Milliseconds since *tv */
+static long since(struct timeval *tv) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - tv->tv_sec) * 1000L +
+           (now.tv_usec - tv->tv_usec) / 1000L;
+}
+
+static int flush_batch(int sock, struct batch *b) {
+    if (b->len == 0) {
+        return 0;
+    }
+    if (send_all(sock, b->buf, b->len) != 0) {
+        return -1;
+    }
+    writes++;
+    b->len = 0;
+
+    /* Take in the acknowledgements that have come back meanwhile */
+    if (qos_pending() > 0 && qos_poll(sock) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Encode one request line into the batch, sending the batch first if
+ * the packet will not fit. Returns -1 only if a send failed.
+ */
+static int add_line(int sock, struct batch *b, char *line) {
+    char *topic, *value;
+    int n;
+
+    switch (split_request(line, &topic, &value)) {
+        case 0:
+            return 0;
+        case -1:
+            fprintf(stderr, "No value for topic %s, ignored.\n", topic);
+            return 0;
+    }
+
+    /* No broker: keep it in the spool */
+    if (sock < 0) {
+        if (spool_put(topic, value) == 0) {
+            messages++;
+        }
+        return 0;
+    }
+
+    /* At QoS 1 and 2, wait for room in the window */
+    if (qos_full() && (flush_batch(sock, b) != 0 || qos_room(sock) != 0)) {
+        return -1;
+    }
+
+    n = qos_encode(b->buf + b->len, b->size - b->len, topic, value, strlen(value));
+    if (n < 0) {
+        if (flush_batch(sock, b) != 0) {
+            return -1;
+        }
+        n = qos_encode(b->buf, b->size, topic, value, strlen(value));
+        if (n < 0) {
+            fprintf(stderr, "Message for %s larger than the batch, ignored.\n", topic);
+            return 0;
+        }
+    }
+    if (b->len == 0) {
+        gettimeofday(&b->first, NULL);
+    }
+    b->len += n;
+    messages++;
+    return 0;
+}
+
+/*
+ * Publish the lines of file ("-" for stdin) on sock, size bytes of
+ * packets at a time, holding none back for more than latency ms.
+ * With sock -1 the lines go to the spool instead.
+ * Returns 0, or -1 on error.
+ */
+int run_batch(int sock, char *file, int size, int latency) {
+    struct batch b;
+    struct stat st;
+    struct timeval tv;
+    fd_set rfds;
+    char in[INSIZE + 1];
+    char *p, *nl;
+    int fd, n, len, toolong, trickle, rc;
+    long wait;
+
+    fd = strcmp(file, "-") == 0 ? 0 : open(file, O_RDONLY);
+    if (fd < 0) {
+        perror(file);
+        return -1;
+    }
+    b.buf = (uint8_t *)malloc(size);
+    if (b.buf == NULL) {
+        fprintf(stderr, "Cannot allocate a %d byte batch.\n", size);
+        return -1;
+    }
+    b.len = 0;
+    b.size = size;
+    trickle = fstat(fd, &st) != 0 || !S_ISREG(st.st_mode);
+
+    len = 0;
+    toolong = 0;
+    rc = 0;
+    for (;;) {
+        /* Wait for more input only as long as the oldest packet may */
+        if (b.len > 0 && trickle) {
+            wait = latency - since(&b.first);
+            if (wait <= 0) {
+                if (flush_batch(sock, &b) != 0) {
+                    rc = -1;
+                    break;
+                }
+                continue;
+            }
+            FD_ZERO(&rfds);
+            FD_SET(fd, &rfds);
+            tv.tv_sec = wait / 1000;
+            tv.tv_usec = (wait % 1000) * 1000;
+            if (select(fd + 1, &rfds, NULL, NULL, &tv) <= 0) {
+                continue;
+            }
+        }
+
+        n = read(fd, in + len, INSIZE - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror(file);
+            rc = -1;
+            break;
+        }
+        if (n == 0) {
+            /* A last line may lack its newline */
+            if (len > 0 && !toolong) {
+                in[len] = '\0';
+                rc = add_line(sock, &b, in);
+            }
+            break;
+        }
+        len += n;
+        in[len] = '\0';
+
+        p = in;
+        while ((nl = strchr(p, '\n')) != NULL) {
+            *nl = '\0';
+            if (nl > p && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+            if (toolong) {
+                toolong = 0;
+            } else if (add_line(sock, &b, p) != 0) {
+                rc = -1;
+                break;
+            }
+            p = nl + 1;
+        }
+        if (rc != 0) {
+            break;
+        }
+        if (sock < 0) {
+            spool_sync();
+        }
+        len -= p - in;
+        bcopy(p, in, len);
+        if (len == INSIZE) {
+            if (!toolong) {
+                fprintf(stderr, "Request line too long, ignored.\n");
+            }
+            toolong = 1;
+            len = 0;
+        }
+    }
+
+    if (rc == 0) {
+        rc = flush_batch(sock, &b);
+    }
+    if (rc == 0 && sock < 0) {
+        printf("Spooled %ld messages.\n", messages);
+    } else if (rc == 0) {
+        printf("Published %ld messages in %ld writes.\n", messages, writes);
+    }
+    free(b.buf);
+    if (fd != 0) {
+        close(fd);
+    }
+    return rc;
+}
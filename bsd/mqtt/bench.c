@@ -0,0 +1,478 @@
+/*
+ * bench.c - throughput and latency of the mqtt publish modes
+ *
+ * Usage: bench [-P port] [-n count] [-r rate] [mode ...]
+ *
+ * Starts ./broker on 127.0.0.1, subscribes to bench/#, and for each
+ * mode pushes count messages through ./mqtt: oneshot (a process per
+ * message, as system.sh does), daemon (lines into a FIFO of one -d
+ * process), batch (-b - from a pipe), qos1 and qos2 (batch with -q),
+ * and v5 (batch over MQTT 5, where the topic goes by its alias).
+ * All modes run by default; oneshot sends at most ONESHOT messages.
+ *
+ * Each payload is "seq ms", the time the line was handed to mqtt, so
+ * the time it reaches the subscriber gives its publish-to-deliver
+ * latency. With -r the lines are paced at rate messages a second,
+ * otherwise they go as fast as mqtt takes them and the latency is
+ * mostly time spent queued. A line per mode gives the messages seen,
+ * the rate from the first line written to the last message received,
+ * and the 50th, 90th and 99th percentile and largest latencies.
+ *
+ * Needs no network beyond loopback. Linux, as broker.c is.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PORT  11883
+#define DEFAULT_COUNT 10000
+#define ONESHOT       500       /* a fork and exec each: keep it short */
+#define IDLE_MS       5000      /* give up when nothing arrives this long */
+#define TOPIC         "bench/t"
+
+static int port = DEFAULT_PORT;
+static char portstr[16];
+static int rate;                /* -r: lines a second, 0 for no pacing */
+
+/* What the subscriber has received of the current run */
+static double *latency;
+static char *seen;
+static long count, received;
+static double last_recv;
+
+static char *modes[] = { "oneshot", "daemon", "batch", "qos1", "qos2", "v5" };
+
+static uint8_t inbuf[65536];
+static long inlen;
+
+static double now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-P port] [-n count] [-r rate] [oneshot|daemon|batch|qos1|qos2|v5 ...]\n", prog);
+    exit(1);
+}
+
+/* Start ./prog with args, stdin from fd in (if >= 0), stdout to /dev/null */
+static int spawn(char **args, int in) {
+    int pid, fd;
+
+    pid = fork();
+    if (pid == 0) {
+        if (in >= 0) {
+            dup2(in, 0);
+            close(in);
+        }
+        fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        execv(args[0], args);
+        perror(args[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int send_all(int sock, uint8_t *p, int n) {
+    int k;
+
+    while (n > 0) {
+        if ((k = write(sock, p, n)) <= 0) {
+            return -1;
+        }
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/* Read the next whole packet. Returns its type, with body and length set, or -1 */
+static int next_packet(int sock, uint8_t **body, long *length, int wait_ms) {
+    static long start;
+    struct timeval tv;
+    fd_set rfds;
+    long len, mult;
+    int i, n;
+
+    for (;;) {
+        len = 0;
+        mult = 1;
+        for (i = 1; start + i < inlen && i <= 4; i++) {
+            len += (inbuf[start + i] & 0x7F) * mult;
+            mult *= 128;
+            if (!(inbuf[start + i] & 0x80)) {
+                break;
+            }
+        }
+        if (start + i < inlen && inlen - start >= 1 + i + len) {
+            *body = inbuf + start + 1 + i;
+            *length = len;
+            n = inbuf[start];
+            start += 1 + i + len;
+            return n;
+        }
+        if (1 + i + len > sizeof(inbuf)) {
+            fprintf(stderr, "Packet too long for the subscriber.\n");
+            return -1;
+        }
+        bcopy(inbuf + start, inbuf, inlen - start);
+        inlen -= start;
+        start = 0;
+
+        FD_ZERO(&rfds);
+        FD_SET(sock, &rfds);
+        tv.tv_sec = wait_ms / 1000;
+        tv.tv_usec = (wait_ms % 1000) * 1000;
+        if (select(sock + 1, &rfds, NULL, NULL, &tv) <= 0) {
+            return -1;
+        }
+        n = read(sock, inbuf + inlen, sizeof(inbuf) - inlen);
+        if (n <= 0) {
+            return -1;
+        }
+        inlen += n;
+    }
+}
+
+/* Connect and subscribe to bench/#. Returns the socket, or -1 */
+static int subscribe(void) {
+    static uint8_t conn[] = {
+        0x10, 17, 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x00, 60,
+        0x00, 0x05, 'b', 'e', 'n', 'c', 'h'
+    };
+    static uint8_t sub[] = {
+        0x82, 12, 0x00, 0x01, 0x00, 0x07, 'b', 'e', 'n', 'c', 'h', '/', '#', 0x00
+    };
+    struct sockaddr_in addr;
+    uint8_t *body;
+    long length;
+    int sock, tries, on = 1;
+
+    for (tries = 0; tries < 100; tries++) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        memset((char *)&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+        usleep(20000);          /* the broker is still starting */
+    }
+    if (sock < 0) {
+        perror("bench: connect");
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    if (send_all(sock, conn, sizeof(conn)) != 0 ||
+        next_packet(sock, &body, &length, IDLE_MS) != 0x20 ||
+        send_all(sock, sub, sizeof(sub)) != 0 ||
+        next_packet(sock, &body, &length, IDLE_MS) != 0x90) {
+        fprintf(stderr, "bench: no subscription\n");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Write n lines "bench/t seq ms" to fd, paced if -r was given, then
+ * exit. Runs in a child of its own.
+ */
+static void write_lines(int fd, long n) {
+    static char out[65536];
+    FILE *fp;
+    double start;
+    long i;
+
+    fp = fdopen(fd, "w");
+    setvbuf(fp, out, _IOFBF, sizeof(out));
+    start = now_ms();
+    for (i = 0; i < n; i++) {
+        if (rate > 0) {
+            while (now_ms() < start + i * 1000.0 / rate) {
+                usleep(200);
+            }
+        }
+        fprintf(fp, "%s %ld %.3f\n", TOPIC, i, now_ms());
+        if (rate > 0) {
+            fflush(fp);
+        }
+    }
+    fclose(fp);
+    _exit(0);
+}
+
+/* The options every run of mqtt takes, in args[0..8] */
+static void mqtt_args(char **args) {
+    args[0] = "./mqtt";
+    args[1] = "-h";
+    args[2] = "127.0.0.1";
+    args[3] = "-P";
+    args[4] = portstr;
+    args[5] = "-u";
+    args[6] = "bench";
+    args[7] = "-p";
+    args[8] = "bench";
+}
+
+/* One mqtt process per message */
+static void run_oneshot(long n) {
+    char value[64];
+    char *args[16];
+    double start;
+    long i;
+    int pid, status;
+
+    mqtt_args(args);
+    args[9] = "-t";
+    args[10] = TOPIC;
+    args[11] = "-v";
+    args[12] = value;
+    args[13] = NULL;
+    start = now_ms();
+    for (i = 0; i < n; i++) {
+        if (rate > 0) {
+            while (now_ms() < start + i * 1000.0 / rate) {
+                usleep(200);
+            }
+        }
+        sprintf(value, "%ld %.3f", i, now_ms());
+        pid = spawn(args, -1);
+        waitpid(pid, &status, 0);
+    }
+    _exit(0);
+}
+
+static void on_message(uint8_t *body, long length) {
+    char payload[64];
+    long seq, tlen;
+    double sent;
+
+    tlen = (body[0] << 8) | body[1];
+    length -= 2 + tlen;
+    if (length <= 0 || length >= sizeof(payload)) {
+        return;
+    }
+    memcpy(payload, body + 2 + tlen, length);
+    payload[length] = '\0';
+    if (sscanf(payload, "%ld %lf", &seq, &sent) != 2 || seq < 0 || seq >= count || seen[seq]) {
+        return;
+    }
+    last_recv = now_ms();
+    seen[seq] = 1;
+    latency[received++] = last_recv - sent;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(double *)a, y = *(double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Run one mode: feed n messages through mqtt with the options in
+ * args (NULL for oneshot) and collect what the subscriber gets.
+ */
+static void run_mode(int sock, char *name, char **args, int fifo, long n) {
+    char path[64];
+    uint8_t *body;
+    long length;
+    double start;
+    int fd[2], mqtt, writer, status;
+
+    count = n;
+    received = 0;
+    latency = (double *)malloc(n * sizeof(double));
+    seen = (char *)calloc(n, 1);
+    if (latency == NULL || seen == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+
+    mqtt = -1;
+    start = now_ms();
+    if (args == NULL) {
+        if ((writer = fork()) == 0) {
+            close(sock);
+            run_oneshot(n);
+        }
+    } else if (fifo) {
+        /* -d: a long lived mqtt reading a FIFO */
+        sprintf(path, "/tmp/bench.%d", (int)getpid());
+        unlink(path);
+        mkfifo(path, 0600);
+        args[10] = path;
+        mqtt = spawn(args, -1);
+        if ((writer = fork()) == 0) {
+            close(sock);
+            write_lines(open(path, O_WRONLY), n);
+        }
+    } else {
+        pipe(fd);
+        fcntl(fd[1], F_SETFD, FD_CLOEXEC);     /* or mqtt never sees EOF */
+        mqtt = spawn(args, fd[0]);
+        close(fd[0]);
+        if ((writer = fork()) == 0) {
+            close(sock);
+            write_lines(fd[1], n);
+        }
+        close(fd[1]);
+    }
+
+    last_recv = start;
+    while (received < n) {
+        switch (next_packet(sock, &body, &length, IDLE_MS)) {
+            case -1:
+                goto done;
+            case 0x30:
+                on_message(body, length);
+                break;
+        }
+    }
+done:
+    if (mqtt > 0 && fifo) {
+        kill(mqtt, SIGTERM);
+    }
+    waitpid(writer, &status, 0);
+    if (mqtt > 0) {
+        waitpid(mqtt, &status, 0);
+    }
+    if (fifo) {
+        unlink(path);
+    }
+
+    qsort(latency, received, sizeof(double), compare);
+    printf("%-8s %7ld %7ld %9.0f", name, n, received,
+        last_recv > start ? received * 1000.0 / (last_recv - start) : 0.0);
+    if (received > 0) {
+        printf(" %8.2f %8.2f %8.2f %8.2f\n", latency[(received - 1) * 50 / 100],
+            latency[(received - 1) * 90 / 100], latency[(received - 1) * 99 / 100],
+            latency[received - 1]);
+    } else {
+        printf("\n");
+    }
+    fflush(stdout);
+    free(latency);
+    free(seen);
+}
+
+static int wanted(char *name, int argc, char **argv) {
+    int i;
+
+    if (argc == 0) {
+        return 1;
+    }
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *broker[4];
+    char *args[16];
+    long n = DEFAULT_COUNT;
+    int sock, pid, status, opt, i;
+    extern char *optarg;
+    extern int optind;
+
+    while ((opt = getopt(argc, argv, "P:n:r:")) != EOF) {
+        switch (opt) {
+            case 'P':
+                port = atoi(optarg);
+                break;
+            case 'n':
+                n = atol(optarg);
+                break;
+            case 'r':
+                rate = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (n < 1 || rate < 0) {
+        usage(argv[0]);
+    }
+    argc -= optind;
+    argv += optind;
+    for (i = 0; i < argc; i++) {
+        if (!wanted(argv[i], 6, modes)) {
+            usage("bench");
+        }
+    }
+    sprintf(portstr, "%d", port);
+    signal(SIGPIPE, SIG_IGN);
+
+    broker[0] = "./broker";
+    broker[1] = "-P";
+    broker[2] = portstr;
+    broker[3] = NULL;
+    pid = spawn(broker, -1);
+    if ((sock = subscribe()) < 0) {
+        kill(pid, SIGTERM);
+        exit(1);
+    }
+
+    printf("%-8s %7s %7s %9s %8s %8s %8s %8s\n",
+        "mode", "sent", "recvd", "msgs/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    fflush(stdout);
+    mqtt_args(args);
+    if (wanted("oneshot", argc, argv)) {
+        run_mode(sock, "oneshot", NULL, 0, n < ONESHOT ? n : ONESHOT);
+    }
+    if (wanted("daemon", argc, argv)) {
+        args[9] = "-d";
+        args[11] = NULL;
+        run_mode(sock, "daemon", args, 1, n);
+    }
+    args[9] = "-b";
+    args[10] = "-";
+    args[11] = NULL;
+    if (wanted("batch", argc, argv)) {
+        run_mode(sock, "batch", args, 0, n);
+    }
+    args[11] = "-q";
+    args[13] = NULL;
+    if (wanted("qos1", argc, argv)) {
+        args[12] = "1";
+        run_mode(sock, "qos1", args, 0, n);
+    }
+    if (wanted("qos2", argc, argv)) {
+        args[12] = "2";
+        run_mode(sock, "qos2", args, 0, n);
+    }
+    if (wanted("v5", argc, argv)) {
+        args[11] = "-V";
+        args[12] = "5";
+        run_mode(sock, "v5", args, 0, n);
+    }
+
+    close(sock);
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    return 0;
+}
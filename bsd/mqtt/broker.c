@@ -0,0 +1,632 @@
+/*
+ * broker.c - a small MQTT broker for loopback testing and benchmarks
+ *
+ * Usage: broker [-P port] [-v]
+ *
+ * Enough of MQTT 3.1.1 and 5.0 to stand in for a real broker on one
+ * machine: CONNECT/CONNACK (any username and password), PUBLISH at
+ * QoS 0, 1 and 2 with their acknowledgements, SUBSCRIBE/UNSUBSCRIBE
+ * with the + and # wildcards, PINGREQ and DISCONNECT. MQTT 5 clients
+ * may set up to MAXALIAS topic aliases; other properties are skipped.
+ * A message goes to every client with a matching subscription, at
+ * QoS 0. Nothing is retained or kept for clients that are not
+ * connected. At exit the messages and bytes taken in are counted.
+ *
+ * One epoll loop serves all clients, on non-blocking sockets. What
+ * comes in is cut into packets in place in the client's input buffer;
+ * what goes out is appended to the client's output buffer and written
+ * once per wakeup, or when the socket has room again. A subscriber
+ * that falls more than MAXQUEUE bytes behind is dropped.
+ *
+ * Listens on 127.0.0.1 only. Linux (epoll) only.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "mqtt.h"
+
+#define MAXEVENTS 64
+#define MAXQUEUE  (64L * 1024 * 1024)   /* output a slow client may owe */
+#define MAXSUBS   32                    /* filters per client */
+#define MAXALIAS  64                    /* topic aliases per MQTT 5 client */
+
+/* A growable byte buffer; data is buf[start..end) */
+struct buffer {
+    uint8_t *buf;
+    long size, start, end;
+};
+
+struct client {
+    int fd;
+    int connected;              /* CONNECT seen */
+    int version;                /* its protocol level: 4, or 5 */
+    int writing;                /* waiting for EPOLLOUT */
+    int closing;                /* to be dropped once the wakeup is done */
+    struct buffer in, out;
+    int nsubs;
+    char *subs[MAXSUBS];
+    char *alias[MAXALIAS + 1];  /* topics by alias */
+    struct client *next;
+};
+
+static struct client *clients;
+static int epfd;
+static int verbose;
+static long npublish, ndeliver, nbytes;
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-P port] [-v]\n", prog);
+    exit(1);
+}
+
+/* Make room for n more bytes at the end of b. Returns 0, or -1 */
+static int reserve(struct buffer *b, long n) {
+    uint8_t *p;
+    long size;
+
+    if (b->size - b->end >= n) {
+        return 0;
+    }
+    if (b->start > 0) {
+        bcopy(b->buf + b->start, b->buf, b->end - b->start);
+        b->end -= b->start;
+        b->start = 0;
+        if (b->size - b->end >= n) {
+            return 0;
+        }
+    }
+    for (size = b->size > 0 ? b->size : 4096; size - b->end < n; size *= 2) {
+    }
+    p = (uint8_t *)realloc(b->buf, size);
+    if (p == NULL) {
+        return -1;
+    }
+    b->buf = p;
+    b->size = size;
+    return 0;
+}
+
+static int append(struct buffer *b, uint8_t *data, long n) {
+    if (reserve(b, n) != 0) {
+        return -1;
+    }
+    memcpy(b->buf + b->end, data, n);
+    b->end += n;
+    return 0;
+}
+
+static void drop(struct client *c) {
+    struct client **pp;
+    int i;
+
+    if (verbose) {
+        fprintf(stderr, "close %d\n", c->fd);
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    for (pp = &clients; *pp != c; pp = &(*pp)->next) {
+    }
+    *pp = c->next;
+    for (i = 0; i < c->nsubs; i++) {
+        free(c->subs[i]);
+    }
+    for (i = 0; i <= MAXALIAS; i++) {
+        free(c->alias[i]);
+    }
+    free(c->in.buf);
+    free(c->out.buf);
+    free(c);
+}
+
+/* Write what c has queued. Returns 0, or -1 if c is gone */
+static int flush_client(struct client *c) {
+    struct epoll_event ev;
+    long n;
+
+    while (c->out.end > c->out.start) {
+        n = write(c->fd, c->out.buf + c->out.start, c->out.end - c->out.start);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        c->out.start += n;
+    }
+    if (c->out.start == c->out.end) {
+        c->out.start = c->out.end = 0;
+    }
+
+    /* Ask for EPOLLOUT only while something is left over */
+    if ((c->out.end > 0) != c->writing) {
+        c->writing = c->out.end > 0;
+        ev.events = EPOLLIN | (c->writing ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+    return 0;
+}
+
+/* Does topic (of tlen bytes) match filter? */
+static int matches(char *filter, char *topic, int tlen) {
+    char *t = topic, *end = topic + tlen;
+
+    while (*filter != '\0') {
+        if (*filter == '#') {
+            return 1;
+        }
+        if (*filter == '+') {
+            while (t < end && *t != '/') {
+                t++;
+            }
+            filter++;
+        } else {
+            if (t == end || *t != *filter) {
+                /* "a/#" also matches "a" */
+                return t == end && filter[0] == '/' && filter[1] == '#' && filter[2] == '\0';
+            }
+            t++;
+            filter++;
+        }
+    }
+    return t == end;
+}
+
+/* Encode the Remaining Length n into p. Returns its byte count */
+static int put_length(long n, uint8_t *p) {
+    int i = 0;
+
+    do {
+        p[i] = n % 128;
+        n /= 128;
+        if (n > 0) {
+            p[i] |= 0x80;
+        }
+        i++;
+    } while (n > 0);
+    return i;
+}
+
+/* Send the 4 byte acknowledgement of the given type for packet id */
+static int ack(struct client *c, int type, int id) {
+    uint8_t a[4];
+
+    a[0] = type;
+    a[1] = 0x02;
+    a[2] = (id >> 8) & 0xFF;
+    a[3] = id & 0xFF;
+    return append(&c->out, a, 4);
+}
+
+/* Pass a PUBLISH on to every subscriber, at QoS 0 */
+static void fan_out(uint8_t *topic, int tlen, uint8_t *payload, long plen) {
+    struct client *c;
+    uint8_t head[2][7], none = 0;
+    int i, n[2];
+
+    npublish++;
+    for (i = 0; i < 2; i++) {
+        /* [0] for MQTT 3.1.1, [1] for 5 with its empty Properties */
+        head[i][0] = 0x30;
+        n[i] = 1 + put_length(2 + tlen + i + plen, head[i] + 1);
+        head[i][n[i]++] = (tlen >> 8) & 0xFF;
+        head[i][n[i]++] = tlen & 0xFF;
+    }
+    for (c = clients; c != NULL; c = c->next) {
+        if (c->closing) {
+            continue;
+        }
+        for (i = 0; i < c->nsubs; i++) {
+            if (matches(c->subs[i], (char *)topic, tlen)) {
+                break;
+            }
+        }
+        if (i == c->nsubs) {
+            continue;
+        }
+        i = c->version == 5;
+        if (c->out.end - c->out.start > MAXQUEUE ||
+            append(&c->out, head[i], n[i]) != 0 || append(&c->out, topic, tlen) != 0 ||
+            append(&c->out, &none, i) != 0 || append(&c->out, payload, plen) != 0) {
+            /* Not freed here: it may be the publisher, in serve() */
+            fprintf(stderr, "Dropping client %d: too far behind.\n", c->fd);
+            c->closing = 1;
+            continue;
+        }
+        ndeliver++;
+    }
+}
+
+/*
+ * Skip the MQTT 5 Properties at p, noting a Topic Alias in *alias.
+ * Returns their length, the length field included, or -1.
+ */
+static int properties(uint8_t *p, long n, int *alias) {
+    long len, mult;
+    int i, k, id;
+
+    len = 0;
+    mult = 1;
+    for (k = 0; k < n && k < 4; k++) {
+        len += (p[k] & 0x7F) * mult;
+        mult *= 128;
+        if (!(p[k] & 0x80)) {
+            break;
+        }
+    }
+    if (k == n || k == 4 || ++k + len > n) {
+        return -1;
+    }
+    for (i = k; i < k + len; ) {
+        id = p[i++];
+        switch (id) {
+            case 0x01: case 0x17: case 0x19: case 0x24: case 0x25:
+            case 0x28: case 0x29: case 0x2A:
+                i += 1;
+                break;
+            case 0x23: /* Topic Alias */
+                if (i + 2 <= k + len) {
+                    *alias = (p[i] << 8) | p[i + 1];
+                }
+                /* FALLTHROUGH */
+            case 0x13: case 0x21: case 0x22:
+                i += 2;
+                break;
+            case 0x02: case 0x11: case 0x18: case 0x27:
+                i += 4;
+                break;
+            case 0x0B: /* Subscription Identifier */
+                while (i < k + len && (p[i++] & 0x80)) {
+                }
+                break;
+            case 0x26: /* a pair of strings */
+                if (i + 2 > k + len) {
+                    return -1;
+                }
+                i += 2 + ((p[i] << 8) | p[i + 1]);
+                /* FALLTHROUGH */
+            case 0x03: case 0x08: case 0x09: case 0x12: case 0x15:
+            case 0x16: case 0x1A: case 0x1C: case 0x1F:
+                if (i + 2 > k + len) {
+                    return -1;
+                }
+                i += 2 + ((p[i] << 8) | p[i + 1]);
+                break;
+            default:
+                return -1;
+        }
+    }
+    return i == k + len ? i : -1;
+}
+
+/*
+ * The topic of a PUBLISH from c: as sent, or by its Topic Alias.
+ * Returns its length, with *topic set, or -1.
+ */
+static int resolve(struct client *c, uint8_t **topic, int tlen, int alias) {
+    if (alias < 0 || alias > MAXALIAS) {
+        return -1;
+    }
+    if (alias > 0 && tlen > 0) {
+        free(c->alias[alias]);
+        c->alias[alias] = (char *)malloc(tlen + 1);
+        if (c->alias[alias] == NULL) {
+            return -1;
+        }
+        memcpy(c->alias[alias], *topic, tlen);
+        c->alias[alias][tlen] = '\0';
+    } else if (alias > 0) {
+        if (c->alias[alias] == NULL) {
+            return -1;
+        }
+        *topic = (uint8_t *)c->alias[alias];
+        tlen = strlen(c->alias[alias]);
+    }
+    return tlen;
+}
+
+/* Act on one packet from c. Returns 0, or -1 to drop c */
+static int handle(struct client *c, int type, uint8_t *body, long length) {
+    uint8_t reply[8 + MAXSUBS];
+    uint8_t *topic;
+    int id, tlen, q, i, j, k, n, alias, unsub;
+    char *f;
+
+    if (!c->connected && (type & 0xF0) != 0x10) {
+        return -1;
+    }
+    id = length >= 2 ? (body[0] << 8) | body[1] : 0;
+    switch (type & 0xF0) {
+        case 0x10: /* CONNECT */
+            c->connected = 1;
+            c->version = length > 6 ? body[6] : 4;
+            if (verbose) {
+                fprintf(stderr, "connect %d, version %d\n", c->fd, c->version);
+            }
+            reply[0] = 0x20;
+            reply[1] = 0x02;
+            reply[2] = 0x00;
+            reply[3] = 0x00;
+            if (c->version != 5) {
+                return append(&c->out, reply, 4);
+            }
+            reply[1] = 0x06;
+            reply[4] = 3;               /* Properties: */
+            reply[5] = 0x22;            /* Topic Alias Maximum */
+            reply[6] = 0x00;
+            reply[7] = MAXALIAS;
+            return append(&c->out, reply, 8);
+        case 0x30: /* PUBLISH */
+            q = (type >> 1) & 3;
+            tlen = id;
+            j = 2 + tlen + (q > 0 ? 2 : 0);
+            if (length < j || q == 3) {
+                return -1;
+            }
+            topic = body + 2;
+            alias = 0;
+            if (c->version == 5) {
+                if ((k = properties(body + j, length - j, &alias)) < 0 ||
+                    (tlen = resolve(c, &topic, tlen, alias)) < 0) {
+                    return -1;
+                }
+                j += k;
+            }
+            if (q > 0) {
+                /* PUBACK, or PUBREC; the id follows the topic as sent */
+                n = (body[2 + id] << 8) | body[3 + id];
+                if (ack(c, q == 1 ? 0x40 : 0x50, n) != 0) {
+                    return -1;
+                }
+            }
+            fan_out(topic, tlen, body + j, length - j);
+            return 0;
+        case 0x60: /* PUBREL */
+            return ack(c, 0x70, id);
+        case 0x80: /* SUBSCRIBE */
+        case 0xA0: /* UNSUBSCRIBE */
+            unsub = (type & 0xF0) == 0xA0;
+            j = 2;
+            if (c->version == 5 && (k = properties(body + 2, length - 2, &alias)) >= 0) {
+                j += k;
+            }
+            n = 0;
+            while (j + 2 <= length && n < MAXSUBS) {
+                tlen = (body[j] << 8) | body[j + 1];
+                if (j + 2 + tlen + !unsub > length) {
+                    return -1;
+                }
+                f = (char *)body + j + 2;
+                j += 2 + tlen + !unsub;         /* SUBSCRIBE has an options byte */
+                for (i = 0; i < c->nsubs; i++) {
+                    if (strlen(c->subs[i]) == tlen && memcmp(c->subs[i], f, tlen) == 0) {
+                        break;
+                    }
+                }
+                if (unsub) {
+                    /* 0x11: there was no such subscription */
+                    reply[5 + n++] = i < c->nsubs ? 0x00 : 0x11;
+                    if (i < c->nsubs) {
+                        free(c->subs[i]);
+                        c->subs[i] = c->subs[--c->nsubs];
+                    }
+                    continue;
+                }
+                if (i == c->nsubs && c->nsubs < MAXSUBS) {
+                    c->subs[i] = (char *)malloc(tlen + 1);
+                    memcpy(c->subs[i], f, tlen);
+                    c->subs[i][tlen] = '\0';
+                    c->nsubs++;
+                    if (verbose) {
+                        fprintf(stderr, "subscribe %d %s\n", c->fd, c->subs[i]);
+                    }
+                }
+                reply[5 + n++] = i < MAXSUBS ? 0x00 : 0x80;     /* granted QoS 0 */
+            }
+
+            /* SUBACK or UNSUBACK: MQTT 5 has Properties, and for UNSUBACK reason codes */
+            reply[0] = unsub ? 0xB0 : 0x90;
+            reply[2] = body[0];
+            reply[3] = body[1];
+            if (c->version == 5) {
+                reply[1] = 3 + n;
+                reply[4] = 0;
+                return append(&c->out, reply, 5 + n);
+            }
+            if (unsub) {
+                n = 0;
+            }
+            reply[1] = 2 + n;
+            bcopy(reply + 5, reply + 4, n);
+            return append(&c->out, reply, 4 + n);
+        case 0xC0: /* PINGREQ */
+            reply[0] = 0xD0;
+            reply[1] = 0x00;
+            return append(&c->out, reply, 2);
+        case 0xE0: /* DISCONNECT */
+            return -1;
+    }
+    return 0;
+}
+
+/* Read what c has sent and act on each whole packet. Returns 0, or -1 */
+static int serve(struct client *c) {
+    struct buffer *b = &c->in;
+    long length, mult, n;
+    int i;
+
+    for (;;) {
+        if (reserve(b, 16384) != 0) {
+            return -1;
+        }
+        n = read(c->fd, b->buf + b->end, b->size - b->end);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        b->end += n;
+        if (b->end < b->size) {
+            break;      /* the socket is empty */
+        }
+    }
+
+    for (;;) {
+        length = 0;
+        mult = 1;
+        for (i = 1; b->start + i < b->end; i++) {
+            length += (b->buf[b->start + i] & 0x7F) * mult;
+            mult *= 128;
+            if (!(b->buf[b->start + i] & 0x80)) {
+                break;
+            }
+            if (i == 4) {
+                return -1;
+            }
+        }
+        if (b->start + i >= b->end || b->end - b->start < 1 + i + length) {
+            break;
+        }
+        if (handle(c, b->buf[b->start], b->buf + b->start + 1 + i, length) != 0) {
+            return -1;
+        }
+        nbytes += 1 + i + length;
+        b->start += 1 + i + length;
+        if (c->closing) {
+            return -1;  /* fan_out() dropped it: it subscribed to its own topic */
+        }
+    }
+    if (b->start == b->end) {
+        b->start = b->end = 0;
+    }
+    return 0;
+}
+
+static void accept_clients(int lfd) {
+    struct epoll_event ev;
+    struct client *c;
+    int fd, on = 1;
+
+    while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+        c = (struct client *)calloc(1, sizeof(struct client));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->next = clients;
+        clients = c;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        if (verbose) {
+            fprintf(stderr, "accept %d\n", fd);
+        }
+    }
+}
+
+static volatile int stop;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct epoll_event ev, events[MAXEVENTS];
+    struct sockaddr_in addr;
+    struct client *c, *next;
+    int port = DEFAULT_PORT;
+    int lfd, n, i, opt, on = 1;
+    extern char *optarg;
+
+    while ((opt = getopt(argc, argv, "P:v")) != EOF) {
+        switch (opt) {
+            case 'P':
+                port = atoi(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    memset((char *)&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 128) < 0) {
+        perror("broker");
+        exit(1);
+    }
+    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+
+    epfd = epoll_create(MAXEVENTS);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;         /* the listener */
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stop) {
+        n = epoll_wait(epfd, events, MAXEVENTS, -1);
+        for (i = 0; i < n; i++) {
+            c = (struct client *)events[i].data.ptr;
+            if (c == NULL) {
+                accept_clients(lfd);
+                continue;
+            }
+            if (c->closing) {
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && serve(c) != 0) {
+                c->closing = 1;
+            }
+        }
+
+        /* One write per client per wakeup, for all it was sent */
+        for (c = clients; c != NULL; c = c->next) {
+            if (!c->closing && c->out.end > c->out.start && flush_client(c) != 0) {
+                c->closing = 1;
+            }
+        }
+
+        /* Only now, with no event or serve() left to use them, free those to go */
+        for (c = clients; c != NULL; c = next) {
+            next = c->next;
+            if (c->closing) {
+                drop(c);
+            }
+        }
+    }
+    fprintf(stderr, "%ld messages in (%ld bytes of packets), %ld delivered.\n",
+        npublish, nbytes, ndeliver);
+    return 0;
+}
@@ -0,0 +1,463 @@
+/*
+ * collect.c - sample system counters and publish them (-c seconds)
+ *
+ * Instead of system.sh forking vmstat, tail, a dozen awks and bc, and
+ * then mqtt once per value, the counters are read here straight from
+ * the kernel every interval. Rates and percentages come from the
+ * difference between one sample and the last. The whole set goes out
+ * as one buffer of PUBLISH packets, under the topic prefix given with
+ * -t (default "pdp11"), with the names system.sh used:
+ *
+ *      cpu_usage cpu_usage_user cpu_usage_system cpu_usage_idle   %
+ *      virtual_memory free_memory                                 kB
+ *      disk_activity_<disk>                              transfers/s
+ *
+ * With -F cbor the sample goes instead as one message on prefix/sample,
+ * a CBOR map (RFC 8949) from those names, and "time" in seconds since
+ * 1970, to the values as 32 bit floats: a few hundred bytes where the
+ * text form costs a PUBLISH, topic and all, per value. In text form,
+ * -D and -H leave out the values that have not changed (see deadband.c).
+ *
+ * With -R a lost connection is opened again (see reconnect.c), and
+ * sampling goes on; what was in flight at QoS 1 and 2 is not lost.
+ * With -S as well, sampling does not wait for the broker: the values
+ * are spooled until it is back, as are those at QoS 0 that were in a
+ * write that failed.
+ *
+ * The counters come from /proc/stat, /proc/meminfo and /proc/diskstats,
+ * so for now this works on Linux only.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "mqtt.h"
+
+#define MAXDISK  16
+#define PROCSIZE 16384          /* enough for /proc/diskstats */
+
+/* One reading of the kernel's counters */
+struct counters {
+    unsigned long user, system, idle, total;    /* CPU ticks */
+    long committed, memfree;                    /* kB */
+    int ndisk;
+    char disk[MAXDISK][32];
+    unsigned long io[MAXDISK];                  /* transfers completed */
+};
+
+static char procbuf[PROCSIZE];
+static volatile int stop;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+#ifdef __linux__
+/*
+ * Read all of file into procbuf. Returns 0, or -1 if it cannot be read.
+ */
+static int read_proc(char *file) {
+    int fd, n, len;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        perror(file);
+        return -1;
+    }
+    len = 0;
+    while (len < PROCSIZE - 1 && (n = read(fd, procbuf + len, PROCSIZE - 1 - len)) > 0) {
+        len += n;
+    }
+    close(fd);
+    procbuf[len] = '\0';
+    return 0;
+}
+
+/* The value of the "name: value kB" line in procbuf, or 0 */
+static long meminfo(char *name) {
+    char *p;
+    int n = strlen(name);
+
+    for (p = procbuf; p != NULL; p = strchr(p, '\n')) {
+        if (*p == '\n') {
+            p++;
+        }
+        if (strncmp(p, name, n) == 0 && p[n] == ':') {
+            return atol(p + n + 1);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Fill c from /proc. Returns 0, or -1 if the counters cannot be read.
+ */
+static int read_counters(struct counters *c) {
+    unsigned long v[8], rd, wr;
+    char name[32], path[64], *p;
+    int i;
+
+    /* cpu  user nice system idle iowait irq softirq steal */
+    if (read_proc("/proc/stat") != 0) {
+        return -1;
+    }
+    for (i = 0; i < 8; i++) {
+        v[i] = 0;
+    }
+    if (sscanf(procbuf, "cpu %lu %lu %lu %lu %lu %lu %lu %lu", &v[0], &v[1],
+               &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) {
+        fprintf(stderr, "Cannot parse /proc/stat.\n");
+        return -1;
+    }
+    c->user = v[0] + v[1];
+    c->system = v[2] + v[5] + v[6] + v[7];
+    c->idle = v[3] + v[4];
+    c->total = c->user + c->system + c->idle;
+
+    if (read_proc("/proc/meminfo") != 0) {
+        return -1;
+    }
+    c->committed = meminfo("Committed_AS");
+    c->memfree = meminfo("MemFree");
+
+    /* major minor name reads merged sectors ms writes ... */
+    if (read_proc("/proc/diskstats") != 0) {
+        return -1;
+    }
+    c->ndisk = 0;
+    for (p = procbuf; *p != '\0' && c->ndisk < MAXDISK; p++) {
+        if (sscanf(p, "%*u %*u %31s %lu %*u %*u %*u %lu", name, &rd, &wr) == 3 &&
+            strncmp(name, "loop", 4) != 0 && strncmp(name, "ram", 3) != 0) {
+            /* Whole disks only, not their partitions */
+            sprintf(path, "/sys/block/%s", name);
+            if (access(path, F_OK) == 0) {
+                strcpy(c->disk[c->ndisk], name);
+                c->io[c->ndisk++] = rd + wr;
+            }
+        }
+        if ((p = strchr(p, '\n')) == NULL) {
+            break;
+        }
+    }
+    return 0;
+}
+#else
+static int read_counters(struct counters *c) {
+    fprintf(stderr, "Collecting needs the Linux /proc files.\n");
+    return -1;
+}
+#endif
+
+/* PUBLISH packets for one sample, on their way to the broker */
+struct output {
+    int sock;
+    int len;
+    uint8_t buf[4096];
+    int klen;
+    char kept[4096];            /* "topic\0value\0" of each QoS 0 packet in buf */
+    int packed;                 /* -F cbor: the sample as one map */
+    int slen;
+    uint8_t sample[2048];       /* the map as it is built */
+};
+
+/*
+ * The session failed: with -S go on offline, or with -R open another.
+ * Returns 0 if we may go on, -1 to give up.
+ */
+static int recover(int sock) {
+    fprintf(stderr, "Connection to MQTT broker lost.\n");
+    if (spooling) {
+        reconnect_lost();
+        return 0;
+    }
+    if (reconnect_max == 0 || reconnect(sock, &stop) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Send the packets in o. If that fails, what was at QoS 0 is kept
+ * (see keep_unsent()) and the session recovered. Returns 0, or -1 to
+ * give up.
+ */
+static int flush_output(struct output *o) {
+    char *p;
+
+    if (o->len > 0 && send_all(o->sock, o->buf, o->len) != 0) {
+        for (p = o->kept; p < o->kept + o->klen; p += strlen(p) + 1) {
+            keep_unsent(p, p + strlen(p) + 1);
+            p += strlen(p) + 1;
+        }
+        o->len = o->klen = 0;
+        return recover(o->sock);
+    }
+    o->len = o->klen = 0;
+    return 0;
+}
+
+/* Append a CBOR head: major type and argument n */
+static void cbor_head(struct output *o, int major, unsigned long n) {
+    uint8_t *p = o->sample + o->slen;
+
+    if (n < 24) {
+        p[0] = major << 5 | n;
+        o->slen += 1;
+    } else if (n < 256) {
+        p[0] = major << 5 | 24;
+        p[1] = n;
+        o->slen += 2;
+    } else {
+        p[0] = major << 5 | 26;
+        p[1] = (n >> 24) & 0xFF;
+        p[2] = (n >> 16) & 0xFF;
+        p[3] = (n >> 8) & 0xFF;
+        p[4] = n & 0xFF;
+        o->slen += 5;
+    }
+}
+
+/* Append name and value to the map in o, the value as a 32 bit float */
+static void cbor_metric(struct output *o, char *name, double value) {
+    union {
+        float f;
+        uint32_t u;
+    } v;
+    uint8_t *p;
+    int len = strlen(name);
+
+    if (o->slen + 5 + len + 5 + 1 > sizeof(o->sample)) {
+        return;         /* no room left before the end of the map */
+    }
+    cbor_head(o, 3, len);               /* text string */
+    memcpy(o->sample + o->slen, name, len);
+    o->slen += len;
+    v.f = value;
+    p = o->sample + o->slen;
+    p[0] = 0xFA;                        /* single-precision float */
+    p[1] = (v.u >> 24) & 0xFF;
+    p[2] = (v.u >> 16) & 0xFF;
+    p[3] = (v.u >> 8) & 0xFF;
+    p[4] = v.u & 0xFF;
+    o->slen += 5;
+}
+
+/*
+ * Close the map in o and encode it as the one PUBLISH on prefix/sample.
+ * Returns -1 only if the session failed for good.
+ */
+static int add_sample(struct output *o, char *prefix) {
+    char topic[128];
+    int n;
+
+    o->sample[o->slen++] = 0xFF;        /* "break": the end of the map */
+    if (qos_full() && (flush_output(o) != 0 || (qos_room(o->sock) != 0 && recover(o->sock) != 0))) {
+        return -1;
+    }
+    sprintf(topic, "%.60s/sample", prefix);
+    n = qos_encode(o->buf + o->len, sizeof(o->buf) - o->len, topic, (char *)o->sample, o->slen);
+    if (n > 0) {
+        o->len += n;
+    }
+    return 0;
+}
+
+/*
+ * Encode "prefix/name value" onto the end of the packets in o, or with
+ * -F cbor add it to the map; offline, spool it instead. Returns -1 only
+ * if the session failed for good.
+ */
+static int add_metric(struct output *o, char *prefix, char *name, double value) {
+    char topic[128], text[32];
+    int n;
+
+    if (o->packed) {
+        cbor_metric(o, name, value);
+        return 0;
+    }
+
+    sprintf(topic, "%.60s/%.60s", prefix, name);
+    sprintf(text, "%.1f", value);
+    if (db_active && !db_pass(topic, text)) {
+        return 0;
+    }
+
+    /* At QoS 1 and 2, wait for room in the window */
+    if (!offline && qos_full() &&
+        (flush_output(o) != 0 || (!offline && qos_room(o->sock) != 0 && recover(o->sock) != 0))) {
+        return -1;
+    }
+    n = -1;
+    if (!offline) {
+        n = qos_encode(o->buf + o->len, sizeof(o->buf) - o->len, topic, text, strlen(text));
+    }
+    if (n < 0 && !offline) {
+        if (flush_output(o) != 0) {
+            return -1;
+        }
+        if (!offline) {
+            n = qos_encode(o->buf, sizeof(o->buf), topic, text, strlen(text));
+        }
+    }
+    if (offline) {
+        keep_unsent(topic, text);
+        return 0;
+    }
+    if (n > 0) {
+        o->len += n;
+        if (qos == 0 && o->klen + strlen(topic) + strlen(text) + 2 <= sizeof(o->kept)) {
+            strcpy(o->kept + o->klen, topic);
+            o->klen += strlen(topic) + 1;
+            strcpy(o->kept + o->klen, text);
+            o->klen += strlen(text) + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Publish what changed between samples a and b, taken ms apart, in as
+ * few writes as the window allows. Returns 0, or -1 if the session
+ * failed for good.
+ */
+static int publish_sample(int sock, char *prefix, int packed, struct counters *a, struct counters *b,
+                          double ms) {
+    static struct output o;
+    char name[64];
+    double total;
+    int i, j;
+
+    total = b->total - a->total;
+    if (total <= 0) {
+        total = 1;
+    }
+    o.sock = sock;
+    o.len = o.klen = 0;
+    o.packed = packed;
+    if (packed) {
+        o.slen = 0;
+        o.sample[o.slen++] = 0xBF;      /* a map of indefinite length */
+        cbor_head(&o, 3, 4);
+        memcpy(o.sample + o.slen, "time", 4);
+        o.slen += 4;
+        cbor_head(&o, 0, (unsigned long)time(NULL));
+    }
+    if (add_metric(&o, prefix, "cpu_usage", 100.0 * (total - (b->idle - a->idle)) / total) != 0 ||
+        add_metric(&o, prefix, "cpu_usage_user", 100.0 * (b->user - a->user) / total) != 0 ||
+        add_metric(&o, prefix, "cpu_usage_system", 100.0 * (b->system - a->system) / total) != 0 ||
+        add_metric(&o, prefix, "cpu_usage_idle", 100.0 * (b->idle - a->idle) / total) != 0 ||
+        add_metric(&o, prefix, "virtual_memory", (double)b->committed) != 0 ||
+        add_metric(&o, prefix, "free_memory", (double)b->memfree) != 0) {
+        return -1;
+    }
+    for (i = 0; i < b->ndisk; i++) {
+        /* A disk that has just appeared has no rate yet */
+        for (j = 0; j < a->ndisk && strcmp(a->disk[j], b->disk[i]) != 0; j++) {
+        }
+        if (j == a->ndisk) {
+            continue;
+        }
+        sprintf(name, "disk_activity_%.31s", b->disk[i]);
+        if (add_metric(&o, prefix, name, (b->io[i] - a->io[j]) * 1000.0 / ms) != 0) {
+            return -1;
+        }
+    }
+    if (packed && add_sample(&o, prefix) != 0) {
+        return -1;
+    }
+    return flush_output(&o);
+}
+
+/*
+ * Wait until the time next, reading what the broker sends (see qos.c)
+ * and pinging it if nothing else has gone out for half the keep-alive,
+ * or offline trying to connect again. Returns 0, or -1 if the
+ * connection is gone.
+ */
+static int idle_until(int sock, double next, double *last_send) {
+    double now, wait;
+
+    while (!stop && (now = now_ms()) < next) {
+        if (offline) {
+            wait = reconnect_due();
+            if (wait > next - now) {
+                wait = next - now;
+            }
+            pause_ms(wait, &stop);
+            if (!stop && reconnect_try(sock) >= 0) {
+                *last_send = now_ms();
+            }
+            continue;
+        }
+        if (now - *last_send >= KEEP_ALIVE * 500.0) {
+            if (send_pingreq(sock) != 0) {
+                return -1;
+            }
+            *last_send = now;
+        }
+        wait = next - now;
+        if (wait > *last_send + KEEP_ALIVE * 500.0 - now) {
+            wait = *last_send + KEEP_ALIVE * 500.0 - now;
+        }
+        if (qos_pending() > 0 && wait > 1000) {
+            wait = 1000;        /* to look for packets to send again */
+        }
+        if (qos_wait(sock, (int)wait + 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Publish the system's counters under prefix every interval seconds,
+ * as one CBOR message each time if packed, until SIGINT or SIGTERM.
+ * Returns 0, or -1 on error.
+ */
+int run_collect(int sock, char *prefix, int interval, int packed) {
+    struct counters c[2];
+    double taken[2], last_send, next;
+    int cur;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    cur = 0;
+    if (read_counters(&c[cur]) != 0) {
+        return -1;
+    }
+    taken[cur] = next = last_send = now_ms();
+    for (;;) {
+        next += interval * 1000.0;
+        if (idle_until(sock, next, &last_send) != 0) {
+            if (recover(sock) != 0) {
+                return -1;
+            }
+            last_send = now_ms();
+        }
+        if (stop) {
+            break;
+        }
+        cur = !cur;
+        if (read_counters(&c[cur]) != 0) {
+            return -1;
+        }
+        taken[cur] = now_ms();
+        if (publish_sample(sock, prefix, packed, &c[!cur], &c[cur], taken[cur] - taken[!cur]) != 0) {
+            return -1;
+        }
+        last_send = taken[cur];
+    }
+    return 0;
+}
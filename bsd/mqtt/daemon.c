@@ -0,0 +1,371 @@
+/*
+ * daemon.c - hold one MQTT session open and publish what is written to us
+ *
+ * Publish requests are lines of the form "topic value". They are read
+ * from the path given with -d: if it names an existing FIFO, that is
+ * read; otherwise a Unix domain socket is made there, and any number
+ * of local programs may connect and write lines to it. Each line then
+ * costs a single PUBLISH frame on the session that is already open,
+ * instead of a process, a TCP handshake and a CONNECT.
+ *
+ * At QoS 1 and 2 acknowledgements are read as they come, and a
+ * request is only held up while the window is full (see qos.c).
+ *
+ * With -A, numeric values are gathered into a summary per topic that
+ * is published once a window (see aggregate.c). With -D or -H, a value
+ * that has not changed enough since the last one on its topic is
+ * dropped (see deadband.c).
+ *
+ * When nothing has been sent for half the keep-alive interval a
+ * PINGREQ goes out. If the broker does not answer it within a whole
+ * interval, or closes the connection, the daemon gives up, or with -R
+ * connects again (see reconnect.c). With -S as well it goes on reading
+ * requests while the broker is away, and spools them.
+ *
+ * Given several brokers, there is no one session: each line goes to
+ * the connections of shard.c, which this loop also waits on.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mqtt.h"
+
+#define MAXSRC   16     /* FIFO or socket clients read at once */
+#define LINESIZE 400    /* longest request line; fits a PUBLISH buffer */
+
+/* One place requests come from, with its partial line */
+struct source {
+    int fd;             /* -1 if the slot is free */
+    int len;
+    int toolong;        /* dropping the rest of an overlong line */
+    char buf[LINESIZE];
+};
+
+static struct source sources[MAXSRC];
+static int listen_fd = -1;
+static time_t last_send;        /* when a packet last went to the broker */
+static time_t ping_sent;        /* when the unanswered PINGREQ went, or 0 */
+static volatile int stop;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static void add_source(int fd) {
+    int i;
+
+    for (i = 0; i < MAXSRC; i++) {
+        if (sources[i].fd < 0) {
+            sources[i].fd = fd;
+            sources[i].len = 0;
+            sources[i].toolong = 0;
+            return;
+        }
+    }
+    fprintf(stderr, "Too many clients, dropping one.\n");
+    close(fd);
+}
+
+/*
+ * Open the FIFO at path, or make a listening Unix socket there.
+ */
+static int open_input(char *path) {
+    struct stat st;
+    struct sockaddr_un sun;
+    int fd;
+
+    if (stat(path, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        /* Opened for writing as well, so it never reads as EOF */
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        add_source(fd);
+        return 0;
+    }
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset((char *)&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        listen(fd, 5) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    listen_fd = fd;
+    return 0;
+}
+
+/*
+ * The session on sock has failed: with -R, open another in its place,
+ * or with -S go on offline until one opens. Returns 0 if there is one
+ * or we are offline, -1 to give up.
+ */
+static int recover(int sock) {
+    if (spooling) {
+        reconnect_lost();
+        return 0;
+    }
+    if (reconnect_max == 0 || reconnect(sock, &stop) < 0) {
+        return -1;
+    }
+    last_send = time(NULL);
+    ping_sent = 0;
+    return 0;
+}
+
+/*
+ * Publish one "topic value" line. Returns -1 only if the session failed.
+ */
+static int handle_line(int sock, char *line) {
+    char *topic, *value;
+
+    switch (split_request(line, &topic, &value)) {
+        case 0:
+            return 0;
+        case -1:
+            fprintf(stderr, "No value for topic %s, ignored.\n", topic);
+            return 0;
+    }
+
+    if (agg_window > 0 && agg_add(topic, value)) {
+        return 0;
+    }
+    if (db_active && !db_pass(topic, value)) {
+        return 0;
+    }
+    if (publish_message(sock, topic, value) != 0) {
+        return -1;
+    }
+    last_send = time(NULL);
+    return 0;
+}
+
+/*
+ * Read what a source has for us and publish each complete line.
+ * Returns -1 if the session failed.
+ */
+static int read_source(int sock, struct source *s) {
+    char *p, *nl;
+    int n;
+
+    n = read(s->fd, s->buf + s->len, LINESIZE - 1 - s->len);
+    if (n <= 0) {
+        /* A client went away (a FIFO never gets here) */
+        close(s->fd);
+        s->fd = -1;
+        return 0;
+    }
+    s->len += n;
+    s->buf[s->len] = '\0';
+
+    p = s->buf;
+    while ((nl = strchr(p, '\n')) != NULL) {
+        *nl = '\0';
+        if (nl > p && nl[-1] == '\r') {
+            nl[-1] = '\0';
+        }
+        if (s->toolong) {
+            s->toolong = 0;
+        } else if (handle_line(sock, p) != 0 && recover(sock) != 0) {
+            return -1;
+        }
+        p = nl + 1;
+    }
+    s->len -= p - s->buf;
+    bcopy(p, s->buf, s->len);
+    if (s->len == LINESIZE - 1) {
+        if (!s->toolong) {
+            fprintf(stderr, "Request line too long, ignored.\n");
+        }
+        s->toolong = 1;
+        s->len = 0;
+    }
+    return 0;
+}
+
+/*
+ * Publish requests from the FIFO or socket at path on the session
+ * open on sock, or if it is -1 to the brokers of shard.c, until SIGINT
+ * or SIGTERM. Returns 0, or -1 on error.
+ */
+int run_daemon(int sock, char *path) {
+    fd_set rfds, wfds;
+    struct timeval tv;
+    time_t now, due, flush;
+    int i, n, fd, maxfd, rc, ms;
+
+    for (i = 0; i < MAXSRC; i++) {
+        sources[i].fd = -1;
+    }
+    if (open_input(path) != 0) {
+        return -1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    last_send = time(NULL);
+    ping_sent = 0;
+    flush = last_send + agg_window;
+    rc = 0;
+    while (!stop) {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        maxfd = -1;
+        if (sock >= 0 && !offline) {
+            FD_SET(sock, &rfds);
+            maxfd = sock;
+        }
+        if (listen_fd >= 0) {
+            FD_SET(listen_fd, &rfds);
+            if (listen_fd > maxfd) {
+                maxfd = listen_fd;
+            }
+        }
+        for (i = 0; i < MAXSRC; i++) {
+            if (sources[i].fd >= 0) {
+                FD_SET(sources[i].fd, &rfds);
+                if (sources[i].fd > maxfd) {
+                    maxfd = sources[i].fd;
+                }
+            }
+        }
+
+        /* Sleep until a ping is due, or its answer is overdue */
+        now = time(NULL);
+        due = ping_sent ? ping_sent + KEEP_ALIVE : last_send + KEEP_ALIVE / 2;
+        if (offline) {
+            due = now + KEEP_ALIVE;     /* no pings, only reconnect_due() */
+        }
+        if (agg_window > 0 && flush < due) {
+            due = flush;
+        }
+        tv.tv_sec = due > now ? due - now : 0;
+        tv.tv_usec = 0;
+        if (qos_pending() > 0 && tv.tv_sec > 1) {
+            tv.tv_sec = 1;      /* to look for packets to send again */
+        }
+        if (offline && (ms = reconnect_due()) < tv.tv_sec * 1000) {
+            tv.tv_sec = ms / 1000;
+            tv.tv_usec = (ms % 1000) * 1000;
+        }
+        if (nshard > 0 && (ms = shard_fds(&rfds, &wfds, &maxfd)) < tv.tv_sec * 1000) {
+            tv.tv_sec = ms / 1000;
+            tv.tv_usec = (ms % 1000) * 1000;
+        }
+        if (select(maxfd + 1, &rfds, &wfds, NULL, &tv) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("select");
+            rc = -1;
+            break;
+        }
+
+        if (offline && reconnect_try(sock) >= 0) {
+            last_send = time(NULL);
+            ping_sent = 0;
+        }
+        if (sock >= 0 && !offline && (FD_ISSET(sock, &rfds) || qos_pending() > 0)) {
+            n = qos_poll(sock);
+            if (n < 0) {
+                fprintf(stderr, "Connection to MQTT broker lost.\n");
+                if (recover(sock) != 0) {
+                    rc = -1;
+                    break;
+                }
+                continue;
+            }
+            if (n & GOT_PINGRESP) {
+                ping_sent = 0;
+            }
+        }
+        if (listen_fd >= 0 && FD_ISSET(listen_fd, &rfds)) {
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                add_source(fd);
+            }
+        }
+        for (i = 0; i < MAXSRC && rc == 0; i++) {
+            if (sources[i].fd >= 0 && FD_ISSET(sources[i].fd, &rfds)) {
+                rc = read_source(sock, &sources[i]);
+            }
+        }
+        if (rc != 0) {
+            break;
+        }
+        if (nshard > 0) {
+            shard_step(&rfds, &wfds);
+        }
+
+        now = time(NULL);
+        if (agg_window > 0 && now >= flush) {
+            if (agg_flush(sock) != 0 && recover(sock) != 0) {
+                rc = -1;
+                break;
+            }
+            last_send = now;
+            flush += agg_window;
+            if (flush <= now) {
+                flush = now + agg_window;       /* we were held up */
+            }
+        }
+        if (sock < 0 || offline) {
+            continue;
+        }
+        if (ping_sent && now - ping_sent >= KEEP_ALIVE) {
+            fprintf(stderr, "No PINGRESP from MQTT broker.\n");
+            if (recover(sock) != 0) {
+                rc = -1;
+                break;
+            }
+        } else if (!ping_sent && now - last_send >= KEEP_ALIVE / 2) {
+            if (send_pingreq(sock) != 0 && recover(sock) != 0) {
+                rc = -1;
+                break;
+            }
+            ping_sent = last_send = now;
+        }
+    }
+
+    if (rc == 0 && agg_window > 0) {
+        rc = agg_flush(sock);
+    }
+    if (rc == 0 && sock >= 0 && !offline) {
+        qos_drain(sock, KEEP_ALIVE * 1000);
+        send_disconnect(sock);
+    }
+    for (i = 0; i < MAXSRC; i++) {
+        if (sources[i].fd >= 0) {
+            close(sources[i].fd);
+        }
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path);
+    }
+    return rc;
+}
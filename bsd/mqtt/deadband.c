@@ -0,0 +1,182 @@
+/*
+ * deadband.c - publish a value only when it has changed (-D, -H)
+ *
+ * Most of what system.sh sends is the same as last time: free_memory
+ * and an idle disk's activity hardly move between samples. With -D or
+ * -H, the daemon (-d) and the collector (-c) remember the last value
+ * published on each topic and let a new one through only if it is
+ * different enough:
+ *
+ *      -D 1024                 numbers that moved by more than 1024
+ *      -D 'pdp11/cpu_usage=5%' ... by more than 5% of the last one
+ *      -D 'pdp11/+/temp=0.5'   ... by more than 0.5, on those topics
+ *
+ * A rule is [filter=]threshold[%], with the + and # wildcards of a
+ * subscription; the first rule whose filter matches the topic is used,
+ * and a topic that matches none, or whose value is not a number, is
+ * published whenever its value changes at all. With -H seconds a value
+ * goes out anyway once its topic has been silent that long, so that a
+ * subscriber can tell a steady metric from a dead publisher.
+ *
+ * Topics beyond the first MAXTOPIC, and values too long to remember,
+ * are always published.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "mqtt.h"
+
+#define MAXRULE  16             /* -D options */
+#define MAXTOPIC 256            /* topics remembered at once */
+#define HASHSIZE 512            /* twice that, a power of two */
+#define VALSIZE  32             /* longest value compared as text */
+
+struct rule {
+    char *filter;               /* NULL for every topic */
+    double threshold;
+    int percent;
+};
+
+struct last {
+    char *topic;                /* NULL if the slot is free */
+    char value[VALSIZE];        /* as published */
+    time_t when;
+};
+
+int db_heartbeat;               /* -H: seconds, or 0 */
+int db_active;                  /* any -D or -H given */
+
+static struct rule rules[MAXRULE];
+static int nrule;
+static struct last lasts[HASHSIZE];
+static int nlast;
+
+static unsigned hash(char *s) {
+    unsigned h = 5381;
+
+    while (*s != '\0') {
+        h = h * 33 + (uint8_t)*s++;
+    }
+    return h & (HASHSIZE - 1);
+}
+
+/*
+ * Add the rule "[filter=]threshold[%]" of a -D option. Returns 0, or
+ * -1 if it is malformed or there are too many.
+ */
+int db_rule(char *arg) {
+    struct rule *r;
+    char *eq, *end;
+
+    if (nrule == MAXRULE) {
+        fprintf(stderr, "Error: at most %d -D rules.\n", MAXRULE);
+        return -1;
+    }
+    r = &rules[nrule];
+    r->filter = NULL;
+    if ((eq = strrchr(arg, '=')) != NULL) {
+        *eq = '\0';
+        r->filter = arg;
+        arg = eq + 1;
+    }
+    r->threshold = strtod(arg, &end);
+    r->percent = *end == '%';
+    if (end == arg || r->threshold < 0 || *(end + r->percent) != '\0') {
+        fprintf(stderr, "Error: invalid deadband %s.\n", arg);
+        return -1;
+    }
+    nrule++;
+    db_active = 1;
+    return 0;
+}
+
+/* Does topic match the subscription filter? */
+static int matches(char *filter, char *topic) {
+    while (*filter != '\0') {
+        if (*filter == '#') {
+            return 1;
+        }
+        if (*filter == '+') {
+            topic += strcspn(topic, "/");
+            filter++;
+            continue;
+        }
+        if (*topic != *filter) {
+            /* "a/#" also matches "a" */
+            return *topic == '\0' && strcmp(filter, "/#") == 0;
+        }
+        topic++;
+        filter++;
+    }
+    return *topic == '\0';
+}
+
+/* Is value far enough from last, under the rule for topic? */
+static int changed(char *topic, char *last, char *value) {
+    struct rule *r;
+    double x, y;
+    char *end;
+    int i;
+
+    for (i = 0; i < nrule; i++) {
+        if (rules[i].filter == NULL || matches(rules[i].filter, topic)) {
+            break;
+        }
+    }
+    if (i == nrule) {
+        return strcmp(last, value) != 0;
+    }
+    r = &rules[i];
+
+    /* "inf" and "nan" are not numbers here: nothing is ever within a threshold of NaN */
+    x = strtod(value, &end);
+    if (end == value || *(end + strspn(end, "% \t")) != '\0' || !isfinite(x)) {
+        return strcmp(last, value) != 0;
+    }
+    y = strtod(last, &end);
+    if (end == last || !isfinite(y)) {
+        return 1;
+    }
+    if (r->percent) {
+        return fabs(x - y) > fabs(y) * r->threshold / 100.0;
+    }
+    return fabs(x - y) > r->threshold;
+}
+
+/*
+ * Should value be published on topic? If so it becomes the last value
+ * there, on the assumption that it will be.
+ */
+int db_pass(char *topic, char *value) {
+    struct last *l;
+    time_t now = time(NULL);
+    unsigned h;
+
+    if (strlen(value) >= VALSIZE) {
+        return 1;
+    }
+    for (h = hash(topic); lasts[h].topic != NULL; h = (h + 1) & (HASHSIZE - 1)) {
+        if (strcmp(lasts[h].topic, topic) == 0) {
+            break;
+        }
+    }
+    l = &lasts[h];
+    if (l->topic == NULL) {
+        if (nlast == MAXTOPIC || (l->topic = (char *)malloc(strlen(topic) + 1)) == NULL) {
+            return 1;
+        }
+        strcpy(l->topic, topic);
+        nlast++;
+    } else if (!changed(topic, l->value, value) &&
+               (db_heartbeat == 0 || now - l->when < db_heartbeat)) {
+        return 0;
+    }
+    strcpy(l->value, value);
+    l->when = now;
+    return 1;
+}
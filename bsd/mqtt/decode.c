@@ -0,0 +1,254 @@
+/*
+ * decode.c - reading packets from the broker
+ *
+ * What the broker sends is read into one buffer, in reads as large as
+ * the buffer has room for, and cut into packets where they lie: a
+ * packet handed on is a pointer to its body in the buffer, never a
+ * copy. The Remaining Length is decoded in full, up to its four bytes
+ * and 256 MB; a packet longer than the buffer makes it grow to fit.
+ * A partial packet left at the end of a read is moved to the front
+ * when more room is needed.
+ *
+ * Acknowledgements of what we sent go to qos.c, messages on topics we
+ * subscribed to go to on_publish. What has to be answered (PUBACK,
+ * PUBREC, PUBREL, PUBCOMP) is gathered and sent in one write per read.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "mqtt.h"
+
+#define INITSIZE 16384
+
+/* Bytes read from the broker and not yet handed on */
+static uint8_t *buf;
+static long size, start, end;
+
+/* Answers to what came in, sent when the read is done */
+static uint8_t replies[1024];
+static int nreplies;
+
+/* Called for each PUBLISH from the broker */
+void (*on_publish)(char *topic, int topic_length, uint8_t *payload, long length);
+
+/*
+ * Make room for at least need bytes after end, moving what is
+ * unread to the front or growing the buffer. Returns 0, or -1.
+ */
+static int make_room(long need) {
+    uint8_t *p;
+    long n;
+
+    if (size - end >= need) {
+        return 0;
+    }
+    if (start > 0) {
+        bcopy(buf + start, buf, end - start);
+        end -= start;
+        start = 0;
+    }
+    if (size - end >= need) {
+        return 0;
+    }
+    for (n = size > 0 ? size : INITSIZE; n - end < need; n *= 2) {
+    }
+    p = (uint8_t *)realloc(buf, n);
+    if (p == NULL) {
+        fprintf(stderr, "Cannot allocate %ld bytes for a packet.\n", n);
+        return -1;
+    }
+    buf = p;
+    size = n;
+    return 0;
+}
+
+/*
+ * The next whole packet in the buffer. Returns 1 with p filled in,
+ * 0 if more must be read first, or -1 if the stream is malformed.
+ */
+static int next_packet(struct packet *p) {
+    long length, mult;
+    int i;
+
+    length = 0;
+    mult = 1;
+    for (i = 1; ; i++) {
+        if (start + i >= end) {
+            return 0;
+        }
+        length += (buf[start + i] & 0x7F) * mult;
+        mult *= 128;
+        if (!(buf[start + i] & 0x80)) {
+            break;
+        }
+        if (i == 4) {
+            fprintf(stderr, "Malformed Remaining Length from broker.\n");
+            return -1;
+        }
+    }
+    if (end - start < 1 + i + length) {
+        /* Incomplete: see that the rest will fit */
+        return make_room(1 + i + length - (end - start)) == 0 ? 0 : -1;
+    }
+    p->type = buf[start];
+    p->length = length;
+    p->body = buf + start + 1 + i;
+    start += 1 + i + length;
+    return 1;
+}
+
+/* Read what the socket has. Returns the byte count, 0 at EOF, or -1 */
+static int fill(int sock) {
+    int n;
+
+    if (end == size && make_room(INITSIZE / 4) != 0) {
+        return -1;
+    }
+    n = recv(sock, buf + end, size - end, 0);
+    if (n > 0) {
+        end += n;
+    }
+    return n;
+}
+
+static int send_replies(int sock) {
+    int n;
+
+    n = nreplies;
+    nreplies = 0;
+    return n > 0 ? send_all(sock, replies, n) : 0;
+}
+
+/* Queue the 4 byte answer of the given type to packet id */
+static int reply(int sock, int type, int id) {
+    if (nreplies + 4 > sizeof(replies) && send_replies(sock) != 0) {
+        return -1;
+    }
+    replies[nreplies++] = type;
+    replies[nreplies++] = 0x02;
+    replies[nreplies++] = (id >> 8) & 0xFF;
+    replies[nreplies++] = id & 0xFF;
+    return 0;
+}
+
+/*
+ * Act on packet p. Returns GOT_ flags, or -1 if a send failed or the
+ * packet is malformed.
+ */
+static int dispatch(int sock, struct packet *p) {
+    int id, tlen, q, j, k;
+
+    id = p->length >= 2 ? (p->body[0] << 8) | p->body[1] : 0;
+    switch (p->type & 0xF0) {
+        case 0x30: /* PUBLISH */
+            q = (p->type >> 1) & 3;
+            tlen = p->length >= 2 ? (p->body[0] << 8) | p->body[1] : 0;
+            j = 2 + tlen + (q > 0 ? 2 : 0);
+            k = 0;
+            if (version == 5 && p->length >= j) {
+                k = skip_props(p->body + j, p->length - j);
+            }
+            if (p->length < j || q == 3 || k < 0) {
+                fprintf(stderr, "Malformed PUBLISH from broker.\n");
+                return -1;
+            }
+            j += k;     /* the payload follows the Properties */
+            if (on_publish != NULL) {
+                (*on_publish)((char *)p->body + 2, tlen, p->body + j, p->length - j);
+            }
+            if (q > 0) {
+                id = (p->body[2 + tlen] << 8) | p->body[3 + tlen];
+                /* PUBACK, or PUBREC */
+                if (reply(sock, q == 1 ? 0x40 : 0x50, id) != 0) {
+                    return -1;
+                }
+            }
+            return 0;
+        case 0x40: /* PUBACK */
+        case 0x50: /* PUBREC */
+        case 0x70: /* PUBCOMP */
+            if (nreplies + 4 > sizeof(replies) && send_replies(sock) != 0) {
+                return -1;
+            }
+            nreplies += qos_ack(p->type, id, replies + nreplies);
+            return 0;
+        case 0x60: /* PUBREL, for a QoS 2 message to us */
+            return reply(sock, 0x70, id) == 0 ? 0 : -1;
+        case 0x90: /* SUBACK */
+            k = 2;
+            if (version == 5 && (k = skip_props(p->body + 2, p->length - 2)) >= 0) {
+                k += 2;
+            }
+            for (j = k; k >= 0 && j < p->length; j++) {
+                if (p->body[j] & 0x80) {
+                    fprintf(stderr, "Subscription %d refused by broker.\n", j - k + 1);
+                }
+            }
+            return GOT_SUBACK;
+        case 0xE0: /* DISCONNECT, only from an MQTT 5 broker */
+            fprintf(stderr, "Disconnected by broker, reason code %d.\n",
+                p->length > 0 ? p->body[0] : 0);
+            return -1;
+        case 0xD0: /* PINGRESP */
+            return GOT_PINGRESP;
+    }
+    return 0;
+}
+
+/*
+ * Read from the broker and act on the packets that are complete.
+ * Returns -1 if the connection is gone, else the GOT_ flags of what
+ * came in.
+ */
+int read_broker(int sock) {
+    struct packet p;
+    int n, rc;
+
+    if (fill(sock) <= 0) {
+        return -1;
+    }
+    rc = 0;
+    while ((n = next_packet(&p)) > 0) {
+        if ((n = dispatch(sock, &p)) < 0) {
+            return -1;
+        }
+        rc |= n;
+    }
+    if (n < 0 || send_replies(sock) != 0) {
+        return -1;
+    }
+    if (start == end) {
+        start = end = 0;
+    }
+    return rc;
+}
+
+/*
+ * Forget what was read from a connection that has failed, so that the
+ * next one starts at its first byte.
+ */
+void decode_reset(void) {
+    start = end = 0;
+    nreplies = 0;
+}
+
+/*
+ * Wait for the next packet from the broker and return it in p, without
+ * acting on it (for CONNACK). Returns 0, or -1 if there is none.
+ */
+int read_packet(int sock, struct packet *p) {
+    int n;
+
+    while ((n = next_packet(p)) == 0) {
+        if (make_room(1) != 0 || fill(sock) <= 0) {
+            return -1;
+        }
+    }
+    return n > 0 ? 0 : -1;
+}
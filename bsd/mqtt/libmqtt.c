@@ -0,0 +1,591 @@
+/*
+ * libmqtt.c - a non-blocking MQTT publisher to embed in other programs
+ *
+ * The CONNECT/PUBLISH encoding of mqtt.c, taken out of the command
+ * line client so that httpd, rz/sz or a daemon can send telemetry from
+ * their own event loop: no globals, no blocking calls, no output. See
+ * libmqtt.h for the interface.
+ *
+ * Packets are encoded straight into the arena the caller hands to
+ * mqtt_init(), one after another, and written from there as the socket
+ * takes them; the arena is reused from the front each time it drains.
+ * Only QoS 0 is offered: a message is gone once written, so nothing has
+ * to be kept for acknowledgements. What the broker sends is read into
+ * a small buffer in the context; beyond CONNACK and PINGRESP it is
+ * skipped.
+ *
+ * The broker is given by address, as inet_addr() takes it, so that
+ * opening a connection never waits on a name lookup.
+ *
+ * A program with many threads collecting (CPU, disk, network, its own
+ * counters) feeds one client through a queue, below: the producers
+ * never lock nor allocate, and the client's thread moves what they have
+ * queued into the arena in runs, as room allows.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "libmqtt.h"
+
+#define KEEP_ALIVE 60           /* seconds, as sent in CONNECT */
+
+static double now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static int fail(struct mqtt_client *c, char *why) {
+    c->error = why;
+    return -1;
+}
+
+/*
+ * Room for n more bytes at the end of the arena, moving what is still
+ * unsent to the front if need be. Returns where they go, or NULL.
+ */
+static uint8_t *reserve(struct mqtt_client *c, int n) {
+    if (c->head == c->tail) {
+        c->head = c->tail = 0;
+    }
+    if (c->size - c->tail < n && c->head > 0) {
+        memmove(c->arena, c->arena + c->head, c->tail - c->head);
+        c->tail -= c->head;
+        c->head = 0;
+    }
+    return c->size - c->tail >= n ? c->arena + c->tail : NULL;
+}
+
+/* Encode the Remaining Length n at p. Returns its byte count */
+static int put_length(long n, uint8_t *p) {
+    int i = 0;
+
+    do {
+        p[i] = n % 128;
+        n /= 128;
+        if (n > 0) {
+            p[i] |= 0x80;
+        }
+        i++;
+    } while (n > 0);
+    return i;
+}
+
+static int length_size(long n) {
+    return n < 128 ? 1 : n < 16384 ? 2 : n < 2097152 ? 3 : 4;
+}
+
+static uint8_t *put_string(uint8_t *p, char *s, int len) {
+    *p++ = (len >> 8) & 0xFF;
+    *p++ = len & 0xFF;
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/*
+ * Set up c to send from the size bytes of arena, which must stay put
+ * as long as c is used, as do the strings. Returns 0, or -1.
+ */
+int mqtt_init(struct mqtt_client *c, unsigned char *arena, int size,
+              char *client_id, char *username, char *password) {
+    memset((char *)c, 0, sizeof(*c));
+    c->fd = -1;
+    c->state = MQTT_CLOSED;
+    c->keep_alive = KEEP_ALIVE;
+    c->client_id = client_id;
+    c->username = username != NULL ? username : "";
+    c->password = password != NULL ? password : "";
+    c->arena = arena;
+    c->size = size;
+    if (size < 128) {
+        return fail(c, "arena too small");
+    }
+    return 0;
+}
+
+/* Queue the CONNECT at the front of the arena */
+static int queue_connect(struct mqtt_client *c) {
+    int idlen, ulen, plen;
+    long rl;
+    uint8_t *p;
+
+    idlen = strlen(c->client_id);
+    ulen = strlen(c->username);
+    plen = strlen(c->password);
+    rl = 10 + 2 + idlen + (ulen > 0 ? 2 + ulen : 0) + (plen > 0 ? 2 + plen : 0);
+    if ((p = reserve(c, 1 + length_size(rl) + rl)) == NULL) {
+        return fail(c, "arena too small for CONNECT");
+    }
+    *p++ = 0x10;
+    p += put_length(rl, p);
+    p = put_string(p, "MQTT", 4);
+    *p++ = 0x04;                                        /* 3.1.1 */
+    *p++ = 0x02 | (ulen > 0 ? 0x80 : 0) | (plen > 0 ? 0x40 : 0);
+    *p++ = (c->keep_alive >> 8) & 0xFF;
+    *p++ = c->keep_alive & 0xFF;
+    p = put_string(p, c->client_id, idlen);
+    if (ulen > 0) {
+        p = put_string(p, c->username, ulen);
+    }
+    if (plen > 0) {
+        p = put_string(p, c->password, plen);
+    }
+    c->tail = p - c->arena;
+    return 0;
+}
+
+/*
+ * Start connecting to the broker at ip and port. Returns 0 once the
+ * connection is under way, or -1.
+ */
+int mqtt_open(struct mqtt_client *c, char *ip, int port) {
+    struct sockaddr_in addr;
+    int on = 1;
+
+    if (c->state != MQTT_CLOSED) {
+        return fail(c, "already open");
+    }
+    memset((char *)&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip);
+    if (addr.sin_addr.s_addr == INADDR_NONE) {
+        return fail(c, "invalid broker address");
+    }
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        return fail(c, "cannot make a socket");
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+#ifdef TCP_NODELAY
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+#endif
+
+    c->head = c->tail = 0;
+    c->inlen = 0;
+    c->skip = 0;
+    c->ping_sent = 0;
+    c->last_send = now_ms();
+    if (queue_connect(c) != 0) {
+        mqtt_close(c);
+        return -1;
+    }
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        c->state = MQTT_WAITING;
+    } else if (errno == EINPROGRESS) {
+        c->state = MQTT_CONNECTING;
+    } else {
+        mqtt_close(c);
+        return fail(c, "cannot connect to broker");
+    }
+    return 0;
+}
+
+/*
+ * Queue a PUBLISH of length bytes of payload on topic. Returns 0, or
+ * -1 if there is no room for it in the arena (or no connection).
+ */
+int mqtt_publish(struct mqtt_client *c, char *topic, void *payload, int length) {
+    int tlen;
+    long rl;
+    uint8_t *p;
+
+    if (c->state == MQTT_CLOSED) {
+        return fail(c, "not connected");
+    }
+    tlen = strlen(topic);
+    rl = 2 + tlen + length;
+    if ((p = reserve(c, 1 + length_size(rl) + rl)) == NULL) {
+        c->dropped++;
+        return fail(c, "arena full");
+    }
+    *p++ = 0x30;
+    p += put_length(rl, p);
+    p = put_string(p, topic, tlen);
+    memcpy(p, payload, length);
+    c->tail = p + length - c->arena;
+    return 0;
+}
+
+int mqtt_fd(struct mqtt_client *c) {
+    return c->fd;
+}
+
+/* What to wait for on mqtt_fd() before the next mqtt_step() */
+int mqtt_events(struct mqtt_client *c) {
+    switch (c->state) {
+        case MQTT_CONNECTING:
+            return MQTT_WRITE;
+        case MQTT_WAITING:
+        case MQTT_READY:
+            return MQTT_READ | (c->tail > c->head ? MQTT_WRITE : 0);
+    }
+    return 0;
+}
+
+/*
+ * The longest the caller may wait before calling mqtt_step() for the
+ * keep-alive, in ms, or -1 if there is no connection.
+ */
+int mqtt_timeout(struct mqtt_client *c) {
+    double due;
+
+    if (c->state == MQTT_CLOSED) {
+        return -1;
+    }
+    if (c->state == MQTT_READY && c->ping_sent == 0) {
+        due = c->last_send + c->keep_alive * 500.0;
+    } else {
+        due = (c->ping_sent > 0 ? c->ping_sent : c->last_send) + c->keep_alive * 1000.0;
+    }
+    due -= now_ms();
+    return due > 0 ? (int)due + 1 : 0;
+}
+
+/* Act on one packet from the broker */
+static int dispatch(struct mqtt_client *c, uint8_t *p, long length) {
+    switch (p[0] & 0xF0) {
+        case 0x20: /* CONNACK */
+            if (c->state != MQTT_WAITING || length != 2) {
+                return fail(c, "unexpected CONNACK");
+            }
+            if (p[3] != 0) {
+                return fail(c, "connection refused by broker");
+            }
+            c->state = MQTT_READY;
+            break;
+        case 0xD0: /* PINGRESP */
+            c->ping_sent = 0;
+            break;
+    }
+    return 0;
+}
+
+/* Read what the broker has sent and act on it. Returns 0, or -1 */
+static int do_read(struct mqtt_client *c) {
+    long length, mult, n;
+    int i;
+
+    n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+    if (n == 0) {
+        return fail(c, "connection closed by broker");
+    }
+    if (n < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : fail(c, "read from broker failed");
+    }
+    c->inlen += n;
+
+    for (;;) {
+        /* Drop what is left of a packet we have no use for */
+        n = c->skip < c->inlen ? c->skip : c->inlen;
+        if (n > 0) {
+            memmove(c->in, c->in + n, c->inlen - n);
+            c->inlen -= n;
+            c->skip -= n;
+        }
+        if (c->inlen == 0) {
+            return 0;
+        }
+
+        length = 0;
+        mult = 1;
+        for (i = 1; i < c->inlen; i++) {
+            length += (c->in[i] & 0x7F) * mult;
+            mult *= 128;
+            if (!(c->in[i] & 0x80)) {
+                break;
+            }
+            if (i == 4) {
+                return fail(c, "malformed packet from broker");
+            }
+        }
+        if (i == c->inlen) {
+            return 0;           /* the Remaining Length is not all here */
+        }
+        if (1 + i + length > sizeof(c->in)) {
+            c->skip = 1 + i + length;
+            continue;
+        }
+        if (c->inlen < 1 + i + length) {
+            return 0;
+        }
+        if (dispatch(c, c->in, length) != 0) {
+            return -1;
+        }
+        c->skip = 1 + i + length;
+    }
+}
+
+/* Write what the socket will take of the arena. Returns 0, or -1 */
+static int do_write(struct mqtt_client *c) {
+    int n;
+
+    while (c->tail > c->head) {
+        n = write(c->fd, c->arena + c->head, c->tail - c->head);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (n <= 0) {
+            return fail(c, "write to broker failed");
+        }
+        c->head += n;
+        c->last_send = now_ms();
+    }
+    return 0;
+}
+
+/*
+ * Do what can be done without waiting: finish connecting, read what
+ * the broker sent, write what is queued, keep the connection alive.
+ * readable and writable say what select() or poll() found. Returns the
+ * state, or -1 with mqtt_error() saying why; then the connection is
+ * of no further use and should be closed.
+ */
+int mqtt_step(struct mqtt_client *c, int readable, int writable) {
+    double now;
+    int err;
+    socklen_t len;
+    uint8_t *p;
+
+    if (c->state == MQTT_CLOSED) {
+        return fail(c, "not connected");
+    }
+    if (c->state == MQTT_CONNECTING) {
+        if (writable) {
+            err = 0;
+            len = sizeof(err);
+            if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &len) != 0 || err != 0) {
+                return fail(c, "cannot connect to broker");
+            }
+            c->state = MQTT_WAITING;
+        }
+    }
+    if (c->state != MQTT_CONNECTING) {
+        if (readable && do_read(c) != 0) {
+            return -1;
+        }
+        if (do_write(c) != 0) {
+            return -1;
+        }
+    }
+
+    now = now_ms();
+    if (c->state != MQTT_READY || c->ping_sent > 0) {
+        if (now - (c->ping_sent > 0 ? c->ping_sent : c->last_send) >= c->keep_alive * 1000.0) {
+            return fail(c, c->state == MQTT_READY ? "no PINGRESP from broker" : "no CONNACK from broker");
+        }
+    } else if (now - c->last_send >= c->keep_alive * 500.0 && (p = reserve(c, 2)) != NULL) {
+        p[0] = 0xC0;    /* PINGREQ */
+        p[1] = 0x00;
+        c->tail += 2;
+        c->ping_sent = now;
+        if (do_write(c) != 0) {
+            return -1;
+        }
+    }
+    return c->state;
+}
+
+char *mqtt_error(struct mqtt_client *c) {
+    return c->error != NULL ? c->error : "no error";
+}
+
+/* Say DISCONNECT if it can go at once, and close the connection */
+void mqtt_close(struct mqtt_client *c) {
+    static uint8_t disconnect[2] = { 0xE0, 0x00 };
+
+    if (c->fd >= 0) {
+        if (c->state == MQTT_READY && c->tail == c->head) {
+            write(c->fd, disconnect, 2);
+        }
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = MQTT_CLOSED;
+    c->head = c->tail = 0;
+}
+
+/*
+ * The queue is a ring of fixed slots, each with a sequence number that
+ * says whose turn it is: a slot at position pos is free for the
+ * producer that claims pos when its number is pos, and holds a message
+ * for whoever takes pos when it is pos + 1. Producers claim positions
+ * by compare-and-swap on tail, so no two write the same slot, and
+ * publish the message by storing the number last. The GCC __atomic
+ * builtins do the work; there is no lock, and once a producer has
+ * claimed a slot none of the others waits for it to finish.
+ *
+ * Under MQTT_DROP_OLDEST a producer may take the oldest message while
+ * mqtt_drain() is looking at it, and another write the slot again. So
+ * the lengths, which mqtt_drain() needs before it takes the message,
+ * are stored and loaded atomically too, and are only believed once the
+ * compare-and-swap on head has shown that no one else took it.
+ */
+struct mqtt_slot {
+    unsigned long seq;
+    short tlen, plen;           /* the topic, then a NUL, then the payload */
+    char data[MQTT_SLOTSIZE - sizeof(unsigned long) - 2 * sizeof(short)];
+};
+
+#define LOAD(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define CAS(p, old, v)  __atomic_compare_exchange_n(p, old, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+/*
+ * Set up q in the size bytes at slots, which must be aligned as
+ * malloc() would and stay put as long as q is used. What to do when it
+ * is full is one of MQTT_COUNT, MQTT_DROP_OLDEST or MQTT_BLOCK.
+ * Returns 0, or -1 if there is room for fewer than two messages.
+ */
+int mqtt_queue_init(struct mqtt_queue *q, void *slots, long size, int policy) {
+    unsigned long n, i;
+
+    memset((char *)q, 0, sizeof(*q));
+    for (n = 2; n * 2 * sizeof(struct mqtt_slot) <= (unsigned long)size; n *= 2) {
+    }
+    if (n * sizeof(struct mqtt_slot) > (unsigned long)size) {
+        return -1;
+    }
+    q->slots = (struct mqtt_slot *)slots;
+    q->mask = n - 1;
+    q->policy = policy;
+    for (i = 0; i < n; i++) {
+        q->slots[i].seq = i;
+    }
+    return 0;
+}
+
+/*
+ * Take the oldest message, if it has been written, for the caller
+ * alone. Returns its slot, or NULL if there is none.
+ */
+static struct mqtt_slot *take(struct mqtt_queue *q) {
+    struct mqtt_slot *s;
+    unsigned long pos;
+
+    pos = LOAD(&q->head);
+    for (;;) {
+        s = &q->slots[pos & q->mask];
+        if ((long)(LOAD(&s->seq) - (pos + 1)) < 0) {
+            return NULL;
+        }
+        if (CAS(&q->head, &pos, pos + 1)) {
+            return s;
+        }
+    }
+}
+
+/* Give the slot of a message taken back to the producers */
+static void release(struct mqtt_queue *q, struct mqtt_slot *s) {
+    STORE(&s->seq, s->seq + q->mask);
+}
+
+/*
+ * Queue a message for the client, from any thread. Returns 0, or -1 if
+ * it does not fit in a slot, or the queue is full under MQTT_COUNT.
+ */
+int mqtt_enqueue(struct mqtt_queue *q, char *topic, void *payload, int length) {
+    struct mqtt_slot *s;
+    unsigned long pos;
+    long dif;
+    int tlen;
+
+    tlen = strlen(topic);
+    if (length < 0 || tlen + 1 + length > (int)sizeof(s->data)) {
+        return -1;
+    }
+    pos = LOAD(&q->tail);
+    for (;;) {
+        s = &q->slots[pos & q->mask];
+        dif = (long)(LOAD(&s->seq) - pos);
+        if (dif == 0) {
+            if (CAS(&q->tail, &pos, pos + 1)) {
+                break;
+            }
+            continue;
+        }
+        if (dif < 0) {
+            /* The slot still holds a message from a lap ago: full */
+            if (q->policy == MQTT_COUNT) {
+                __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+                return -1;
+            }
+            if (q->policy == MQTT_DROP_OLDEST && (s = take(q)) != NULL) {
+                release(q, s);
+                __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+            } else {
+                sched_yield();
+            }
+        }
+        pos = LOAD(&q->tail);
+    }
+
+    memcpy(s->data, topic, tlen + 1);
+    memcpy(s->data + tlen + 1, payload, length);
+    __atomic_store_n(&s->tlen, tlen, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->plen, length, __ATOMIC_RELAXED);
+    STORE(&s->seq, pos + 1);
+    return 0;
+}
+
+/*
+ * Move up to max queued messages (all there are, if max is 0) into the
+ * arena of c, oldest first, from the thread that owns c. A message
+ * stays queued while the arena has no room for it. Returns the number
+ * moved.
+ */
+int mqtt_drain(struct mqtt_queue *q, struct mqtt_client *c, int max) {
+    struct mqtt_slot *s;
+    unsigned long pos;
+    long rl;
+    int n, tlen, plen;
+
+    if (c->state == MQTT_CLOSED) {
+        return 0;
+    }
+    for (n = 0; max == 0 || n < max; ) {
+        pos = LOAD(&q->head);
+        s = &q->slots[pos & q->mask];
+        if (LOAD(&s->seq) != pos + 1) {
+            if ((long)(LOAD(&s->seq) - (pos + 1)) < 0) {
+                break;          /* empty, or the oldest is still being written */
+            }
+            continue;           /* a producer dropped it */
+        }
+        tlen = __atomic_load_n(&s->tlen, __ATOMIC_RELAXED);
+        plen = __atomic_load_n(&s->plen, __ATOMIC_RELAXED);
+        rl = 2 + tlen + plen;
+        if (reserve(c, 1 + length_size(rl) + rl) == NULL) {
+            break;
+        }
+        if (!CAS(&q->head, &pos, pos + 1)) {
+            continue;           /* taken by a producer: the lengths may be another's */
+        }
+        mqtt_publish(c, s->data, s->data + tlen + 1, plen);
+        release(q, s);
+        n++;
+    }
+    return n;
+}
+
+/* The number of messages refused or dropped for want of room */
+long mqtt_dropped(struct mqtt_queue *q) {
+    return __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+}
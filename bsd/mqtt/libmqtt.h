@@ -0,0 +1,89 @@
+/*
+ * libmqtt.h - a non-blocking MQTT publisher to embed in other programs
+ *
+ * All state is in a struct mqtt_client the caller owns, so a program
+ * may have several. Nothing blocks and nothing is printed: the caller
+ * waits on mqtt_fd() for what mqtt_events() asks, then calls
+ * mqtt_step(). A typical loop:
+ *
+ *      mqtt_init(&c, arena, sizeof(arena), "httpd", "user", "pass");
+ *      mqtt_open(&c, "127.0.0.1", 1883);
+ *      for (;;) {
+ *          (add mqtt_fd(&c) to the select() sets per mqtt_events(&c),
+ *           with mqtt_timeout(&c) as the longest wait)
+ *          ...
+ *          if (mqtt_step(&c, readable, writable) < 0) {
+ *              log mqtt_error(&c); mqtt_close(&c); reopen later
+ *          }
+ *      }
+ *
+ * mqtt_publish() only queues a PUBLISH (QoS 0) in the arena; it may be
+ * called as soon as mqtt_open() has succeeded. When the arena is full
+ * the message is refused rather than waited for.
+ *
+ * A client belongs to one thread. Other threads hand it messages
+ * through a struct mqtt_queue, which takes them without a lock or a
+ * malloc(): each producer calls mqtt_enqueue(), and the thread that
+ * owns the client calls mqtt_drain() before each mqtt_step():
+ *
+ *      mqtt_queue_init(&q, slots, sizeof(slots), MQTT_DROP_OLDEST);
+ *      (any thread)  mqtt_enqueue(&q, "pdp11/disk", text, strlen(text));
+ *      (client's)    mqtt_drain(&q, &c, 0); mqtt_step(&c, ...);
+ */
+
+#define MQTT_READ        1      /* mqtt_events(): wait for readable */
+#define MQTT_WRITE       2      /* ... or writable */
+
+#define MQTT_CLOSED      0      /* states */
+#define MQTT_CONNECTING  1      /* TCP connect in progress */
+#define MQTT_WAITING     2      /* CONNECT sent, no CONNACK yet */
+#define MQTT_READY       3
+
+#define MQTT_COUNT       0      /* full queue: refuse the message, count it */
+#define MQTT_DROP_OLDEST 1      /* ... make room by dropping the oldest */
+#define MQTT_BLOCK       2      /* ... wait for room */
+
+#define MQTT_SLOTSIZE    256    /* a queued message: topic, payload and 8 bytes */
+
+struct mqtt_client {
+    int fd;
+    int state;
+    int keep_alive;             /* seconds */
+    char *client_id, *username, *password;
+    char *error;                /* why the last call failed */
+    unsigned char *arena;       /* packets to send: arena[head..tail) */
+    int size, head, tail;
+    unsigned char in[64];       /* what the broker sends us, in part */
+    int inlen;
+    long skip;                  /* bytes left of a packet too long for in */
+    double last_send, ping_sent;
+    long dropped;               /* messages refused for want of room */
+};
+
+/* Messages from many threads to one client; updated atomically */
+struct mqtt_queue {
+    struct mqtt_slot *slots;
+    unsigned long mask;         /* slots - 1, a power of two less one */
+    int policy;
+    char pad1[64];              /* keep producers and consumer apart in the cache */
+    unsigned long tail;         /* the next to be claimed by a producer */
+    long dropped;               /* messages refused or dropped */
+    char pad2[64];
+    unsigned long head;         /* the next to be taken by mqtt_drain() */
+};
+
+int mqtt_init(struct mqtt_client *c, unsigned char *arena, int size,
+              char *client_id, char *username, char *password);
+int mqtt_open(struct mqtt_client *c, char *ip, int port);
+int mqtt_publish(struct mqtt_client *c, char *topic, void *payload, int length);
+int mqtt_fd(struct mqtt_client *c);
+int mqtt_events(struct mqtt_client *c);
+int mqtt_timeout(struct mqtt_client *c);
+int mqtt_step(struct mqtt_client *c, int readable, int writable);
+char *mqtt_error(struct mqtt_client *c);
+void mqtt_close(struct mqtt_client *c);
+
+int mqtt_queue_init(struct mqtt_queue *q, void *slots, long size, int policy);
+int mqtt_enqueue(struct mqtt_queue *q, char *topic, void *payload, int length);
+int mqtt_drain(struct mqtt_queue *q, struct mqtt_client *c, int max);
+long mqtt_dropped(struct mqtt_queue *q);
@@ -3,41 +3,54 @@
  * Written in ANSI C (K&R compatible) for 211BSD
  * Implements MQTT CONNECT with Username and Password Authentication
  * Parses command-line options using getopt()
- * Parses command-line options using getopt()
+ *
+ * By default one value is published and the client exits. With -d path
+ * it stays connected and publishes "topic value" lines written to the
+ * FIFO or Unix socket at path (see daemon.c), or with -A summaries of
+ * them over a window (see aggregate.c); with -b file it publishes
+ * the lines of file in a few large writes and exits (see batch.c); with
+ * -c seconds it publishes the system's counters on that interval (see
+ * collect.c).
+ * Messages go at QoS 0 unless -q asks for 1 or 2 (see qos.c). With -S,
+ * what cannot be published because the broker is unreachable is kept
+ * on disk and sent on the next connection (see spool.c). With -s it
+ * prints the messages on the topics it subscribes to (see subscribe.c).
+ * With -V 5 it speaks MQTT 5.0, and repeated topics go by alias (see
+ * mqtt5.c).
  */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <unistd.h>     /* For getopt() */     /* For getopt() */
+#include <unistd.h>     /* For getopt() */
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>  /* For inet_addr */
 
+#include "mqtt.h"
+
 /* Define default MQTT broker details */
 #define DEFAULT_HOSTNAME "localhost"
-#define DEFAULT_PORT     1883
 #define DEFAULT_TOPIC    "pdp11/cpu_usage"
+#define DEFAULT_PREFIX   "pdp11"        /* topic prefix for -c */
 #define DEFAULT_VALUE    "42.5%"
 #define CLIENT_ID        "pdp11"
+#define SESSION_EXPIRY   86400  /* seconds the broker keeps our session (-R, MQTT 5) */
+#define DEFAULT_BATCH    8192   /* bytes of packets per write (-B) */
+#define DEFAULT_LATENCY  100    /* ms a batched packet may wait (-L) */
+#define DEFAULT_WINDOW   32     /* QoS 1/2 packets in flight (-w) */
+#define DEFAULT_SPOOL    1024   /* kbytes of ring in a new spool (-Z) */
+#define MAXSUB           16     /* -s topic filters */
 
-/* Function prototypes */
-int connect_to_broker(char *broker_ip, int port);
-int send_mqtt_connect(int sock, char *username, char *password);
-int send_mqtt_connect(int sock, char *username, char *password);
-int receive_connack(int sock);
-int publish_message(int sock, char *topic, char *message);
-int send_disconnect(int sock);
-int encode_remaining_length(int length, unsigned char *buffer);
-int send_all(int sock, unsigned char *buffer, int length);
-int NumberOfUsers(void);
-int CPUUsage(void);
+int quiet;      /* no progress messages on stdout (daemon mode) */
+char *client_id = CLIENT_ID;    /* -i */
 
 /* Custom memmove implementation if bcopy is unavailable */
 #ifndef HAVE_BCOPY
-#ifndef HAVE_BCOPY
 void my_memmove(char *dest, char *src, int n) {
     int i;
     if (src < dest) {
@@ -51,20 +64,37 @@ void my_memmove(char *dest, char *src, int n) {
     }
 }
 #endif
-#endif
 
-int main(int argc, char *argv[]) {
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-h hostname] [-P port] [-u username] [-p password] [-t topic] [-v value]\n", prog);
+    fprintf(stderr, "       %s [-h hostname] [-P port] [-u username] [-p password] -d fifo_or_socket [-A seconds] [-D rule ...] [-H seconds] [-R seconds]\n", prog);
+    fprintf(stderr, "       %s -h host[:port],host[:port],... [-N replicas] [-u username] [-p password] -d fifo_or_socket\n", prog);
+    fprintf(stderr, "       %s [-h hostname] [-P port] [-u username] [-p password] -b file [-B bytes] [-L ms]\n", prog);
+    fprintf(stderr, "       %s [-h hostname] [-P port] [-u username] [-p password] [-t prefix] -c seconds [-F text|cbor] [-D rule ...] [-H seconds] [-R seconds]\n", prog);
+    fprintf(stderr, "       %s [-h hostname] [-P port] [-u username] [-p password] -s filter [-s filter ...]\n", prog);
+    fprintf(stderr, "       (each also takes [-q qos] [-w window] [-S spool [-Z kbytes]] [-V 4|5] [-i client_id])\n");
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
     int sock;
+    int port = DEFAULT_PORT;
+    char *daemon_path = NULL;
+    char *batch_file = NULL;
+    int batch_size = DEFAULT_BATCH;
+    int latency = DEFAULT_LATENCY;
+    int interval = 0;
+    int qos_level = 0;
+    int window = DEFAULT_WINDOW;
+    char *spool_path = NULL;
+    long spool_kb = DEFAULT_SPOOL;
+    char *filters[MAXSUB];
+    int nfilters = 0;
+    int packed = 0;
     char *hostname;
     char *username = "";
     char *password = "";
-    char *topic = DEFAULT_TOPIC;
-    char *value = DEFAULT_VALUE;
-    char *hostname;
-    char *username = "";
-    char *password = "";
-    char *topic = DEFAULT_TOPIC;
+    char *topic = NULL;
     char *value = DEFAULT_VALUE;
     int rc;
     int opt;
@@ -73,19 +103,21 @@ int main(int argc, char *argv[]) {
 
     /* Check if no arguments are provided */
     if (argc == 1) {
-        fprintf(stderr, "Usage: %s [-h hostname] [-u username] [-p password] [-t topic] [-v value]\n", argv[0]);
-        exit(1);
+        usage(argv[0]);
     }
 
     /* Initialize hostname to default */
     hostname = DEFAULT_HOSTNAME;
 
     /* Parse command-line options */
-    while ((opt = getopt(argc, argv, "h:u:p:t:v:")) != EOF) {
+    while ((opt = getopt(argc, argv, "h:P:u:p:t:v:d:b:B:L:c:q:w:S:Z:s:V:F:A:D:H:R:i:N:")) != EOF) {
         switch (opt) {
             case 'h':
                 hostname = optarg;
                 break;
+            case 'P':
+                port = atoi(optarg);
+                break;
             case 'u':
                 username = optarg;
                 break;
@@ -98,88 +130,248 @@ int main(int argc, char *argv[]) {
             case 'v':
                 value = optarg;
                 break;
+            case 'd':
+                daemon_path = optarg;
+                break;
+            case 'b':
+                batch_file = optarg;
+                break;
+            case 'B':
+                batch_size = atoi(optarg);
+                break;
+            case 'L':
+                latency = atoi(optarg);
+                break;
+            case 'c':
+                interval = atoi(optarg);
+                if (interval <= 0) {
+                    fprintf(stderr, "Error: invalid interval %s.\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'q':
+                qos_level = atoi(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            case 'S':
+                spool_path = optarg;
+                break;
+            case 'Z':
+                spool_kb = atol(optarg);
+                break;
+            case 's':
+                if (nfilters == MAXSUB) {
+                    fprintf(stderr, "Error: at most %d -s filters.\n", MAXSUB);
+                    usage(argv[0]);
+                }
+                filters[nfilters++] = optarg;
+                break;
+            case 'A':
+                agg_window = atoi(optarg);
+                if (agg_window <= 0) {
+                    fprintf(stderr, "Error: invalid window %s.\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'D':
+                if (db_rule(optarg) != 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'H':
+                db_heartbeat = atoi(optarg);
+                if (db_heartbeat <= 0) {
+                    fprintf(stderr, "Error: invalid heartbeat %s.\n", optarg);
+                    usage(argv[0]);
+                }
+                db_active = 1;
+                break;
+            case 'R':
+                reconnect_max = atoi(optarg);
+                if (reconnect_max <= 0) {
+                    fprintf(stderr, "Error: invalid reconnect delay %s.\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'i':
+                client_id = optarg;
+                break;
+            case 'N':
+                shard_replicas = atoi(optarg);
+                break;
+            case 'V':
+                version = atoi(optarg);
+                break;
+            case 'F':
+                packed = strcmp(optarg, "cbor") == 0;
+                if (!packed && strcmp(optarg, "text") != 0) {
+                    fprintf(stderr, "Error: unknown format %s.\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-h hostname] [-u username] [-p password] [-t topic] [-v value]\n", argv[0]);
-                exit(1);
+                usage(argv[0]);
         }
     }
 
     /* Ensure mandatory arguments are provided */
     if (username[0] == '\0' || password[0] == '\0') {
         fprintf(stderr, "Error: Username and password are required.\n");
-        fprintf(stderr, "Usage: %s [-h hostname] [-u username] [-p password] [-t topic] [-v value]\n", argv[0]);
+        usage(argv[0]);
+    }
+    if ((daemon_path != NULL) + (batch_file != NULL) + (interval > 0) + (nfilters > 0) > 1) {
+        fprintf(stderr, "Error: only one of -d, -b, -c and -s may be used.\n");
+        usage(argv[0]);
+    }
+    if (batch_size < 64 || latency < 0) {
+        fprintf(stderr, "Error: invalid batch size or latency.\n");
+        usage(argv[0]);
+    }
+    if (qos_level < 0 || qos_level > 2 || window < 1 || window > 4096) {
+        fprintf(stderr, "Error: invalid QoS level or window.\n");
+        usage(argv[0]);
+    }
+    if (version != 4 && version != 5) {
+        fprintf(stderr, "Error: MQTT version must be 4 (3.1.1) or 5.\n");
+        usage(argv[0]);
+    }
+    if (agg_window > 0 && daemon_path == NULL) {
+        fprintf(stderr, "Error: -A applies to -d only.\n");
+        usage(argv[0]);
+    }
+    if (db_active && ((daemon_path == NULL && interval == 0) || packed)) {
+        fprintf(stderr, "Error: -D and -H apply to -d and -c -F text only.\n");
+        usage(argv[0]);
+    }
+    if (reconnect_max > 0 && daemon_path == NULL && interval == 0) {
+        fprintf(stderr, "Error: -R applies to -d and -c only.\n");
+        usage(argv[0]);
+    }
+    if (strchr(hostname, ',') != NULL &&
+        (daemon_path == NULL || qos_level > 0 || version != 4 || reconnect_max > 0 || spool_path != NULL)) {
+        fprintf(stderr, "Error: several brokers only with -d, at QoS 0, without -V, -R or -S.\n");
+        usage(argv[0]);
+    }
+    if (shard_replicas != 1 && strchr(hostname, ',') == NULL) {
+        fprintf(stderr, "Error: -N applies to a list of brokers only.\n");
+        usage(argv[0]);
+    }
+    if (packed && interval == 0) {
+        fprintf(stderr, "Error: -F applies to -c only.\n");
+        usage(argv[0]);
+    }
+    if (spool_path != NULL && (daemon_path != NULL || interval > 0) && (reconnect_max == 0 || packed)) {
+        fprintf(stderr, "Error: -S with -d or -c needs -R, and -F text.\n");
+        usage(argv[0]);
+    }
+    if (spool_kb < 16) {
+        fprintf(stderr, "Error: invalid spool size.\n");
+        usage(argv[0]);
+    }
+    if (qos_init(qos_level, window) != 0) {
         exit(1);
     }
-    int opt;
-    extern char *optarg;
-    extern int optind;
+    if (daemon_path != NULL || batch_file != NULL || interval > 0 || nfilters > 0) {
+        quiet = 1;
+    }
 
-    /* Check if no arguments are provided */
-    if (argc == 1) {
-        fprintf(stderr, "Usage: %s [-h hostname] [-u username] [-p password] [-t topic] [-v value]\n", argv[0]);
+    if (spool_path != NULL && spool_open(spool_path, spool_kb * 1024L) != 0) {
         exit(1);
     }
+    if (topic == NULL && interval == 0) {
+        topic = DEFAULT_TOPIC;
+    }
 
-    /* Initialize hostname to default */
-    hostname = DEFAULT_HOSTNAME;
+    /* Daemon for a cluster: a connection per broker (see shard.c) */
+    if (strchr(hostname, ',') != NULL) {
+        if (shard_open(hostname, port, username, password) != 0) {
+            exit(1);
+        }
+        rc = run_daemon(-1, daemon_path);
+        shard_close(KEEP_ALIVE * 1000);
+        return rc == 0 ? 0 : 1;
+    }
 
-    /* Parse command-line options */
-    while ((opt = getopt(argc, argv, "h:u:p:t:v:")) != EOF) {
-        switch (opt) {
-            case 'h':
-                hostname = optarg;
-                break;
-            case 'u':
-                username = optarg;
-                break;
-            case 'p':
-                password = optarg;
-                break;
-            case 't':
-                topic = optarg;
-                break;
-            case 'v':
-                value = optarg;
-                break;
-            default:
-                fprintf(stderr, "Usage: %s [-h hostname] [-u username] [-p password] [-t topic] [-v value]\n", argv[0]);
-                exit(1);
+    /* Connect to MQTT broker */
+    if (reconnect_max > 0) {
+        reconnect_init(hostname, port, username, password);
+    }
+    sock = open_session(hostname, port, username, password);
+    if (sock < 0 && reconnect_max > 0 && spool_path != NULL) {
+        /* Start offline, with a socket for the session to take over */
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        reconnect_lost();
+    } else if (sock < 0 && reconnect_max > 0) {
+        sock = reconnect(-1, NULL);
+    }
+    if (sock < 0) {
+        if (spool_path == NULL || daemon_path != NULL || interval > 0 || nfilters > 0) {
+            exit(1);
+        }
+
+        /* Keep what was to be published for the next connection */
+        if (batch_file != NULL) {
+            rc = run_batch(-1, batch_file, batch_size, latency);
+        } else if ((rc = spool_put(topic, value)) == 0) {
+            printf("Spooled: %s\n", value);
         }
+        spool_sync();
+        return rc == 0 ? 0 : 1;
     }
 
-    /* Ensure mandatory arguments are provided */
-    if (username[0] == '\0' || password[0] == '\0') {
-        fprintf(stderr, "Error: Username and password are required.\n");
-        fprintf(stderr, "Usage: %s [-h hostname] [-u username] [-p password] [-t topic] [-v value]\n", argv[0]);
+    /* Send what was spooled while the broker was away, before anything new */
+    if (!offline && spool_drain(sock) != 0) {
+        fprintf(stderr, "Failed to send spooled messages.\n");
+        close(sock);
         exit(1);
     }
 
-    /* Connect to MQTT broker */
-    sock = connect_to_broker(hostname, DEFAULT_PORT);
-    sock = connect_to_broker(hostname, DEFAULT_PORT);
-    if (sock < 0) {
-        fprintf(stderr, "Failed to connect to MQTT broker.\n");
-        exit(1);
+    /* Subscriber: print what arrives until told to stop */
+    if (nfilters > 0) {
+        rc = run_subscribe(sock, filters, nfilters);
+        if (rc == 0) {
+            send_disconnect(sock);
+        }
+        close(sock);
+        return rc == 0 ? 0 : 1;
     }
 
-    /* Send MQTT CONNECT packet */
-    rc = send_mqtt_connect(sock, username, password);
-    if (rc != 0) {
-        fprintf(stderr, "Failed to send MQTT CONNECT packet.\n");
+    /* Daemon mode: publish what arrives until told to stop */
+    if (daemon_path != NULL) {
+        rc = run_daemon(sock, daemon_path);
         close(sock);
-        exit(1);
+        return rc == 0 ? 0 : 1;
     }
 
-    /* Receive CONNACK packet */
-    rc = receive_connack(sock);
-    if (rc != 0) {
-        fprintf(stderr, "Failed to receive valid CONNACK from broker.\n");
+    /* Batch mode: publish every line of the file, then disconnect */
+    if (batch_file != NULL) {
+        rc = run_batch(sock, batch_file, batch_size, latency);
+        if (rc == 0) {
+            rc = qos_drain(sock, KEEP_ALIVE * 1000);
+            send_disconnect(sock);
+        }
         close(sock);
-        exit(1);
+        return rc == 0 ? 0 : 1;
+    }
+
+    /* Collector: publish the system's counters until told to stop */
+    if (interval > 0) {
+        rc = run_collect(sock, topic != NULL ? topic : DEFAULT_PREFIX, interval, packed);
+        if (rc == 0 && !offline) {
+            rc = qos_drain(sock, KEEP_ALIVE * 1000);
+            send_disconnect(sock);
+        }
+        close(sock);
+        return rc == 0 ? 0 : 1;
     }
 
     /* Publish the message */
     rc = publish_message(sock, topic, value);
+    if (rc == 0) {
+        rc = qos_drain(sock, KEEP_ALIVE * 1000);
+    }
     if (rc != 0) {
         fprintf(stderr, "Failed to publish message.\n");
         close(sock);
@@ -201,6 +393,35 @@ int main(int argc, char *argv[]) {
 }
 
 
+/*
+ * Function to connect to the broker and open a session on it.
+ * Returns the socket, or -1 on failure.
+ */
+int open_session(char *hostname, int port, char *username, char *password) {
+    int sock;
+
+    sock = connect_to_broker(hostname, port);
+    if (sock < 0) {
+        fprintf(stderr, "Failed to connect to MQTT broker.\n");
+        return -1;
+    }
+
+    /* Send MQTT CONNECT packet */
+    if (send_mqtt_connect(sock, username, password) != 0) {
+        fprintf(stderr, "Failed to send MQTT CONNECT packet.\n");
+        close(sock);
+        return -1;
+    }
+
+    /* Receive CONNACK packet */
+    if (receive_connack(sock) != 0) {
+        fprintf(stderr, "Failed to receive valid CONNACK from broker.\n");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
 /*
  * Function to establish a TCP connection to the MQTT broker.
  */
@@ -237,7 +458,17 @@ int connect_to_broker(char *broker_ip, int port) {
         return -1;
     }
 
-    printf("Connected to MQTT broker at %s:%d\n", broker_ip, port);
+#ifdef TCP_NODELAY
+    /* Packets are gathered into large writes here; send them at once */
+    {
+        int on = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    }
+#endif
+
+    if (!quiet) {
+        printf("Connected to MQTT broker at %s:%d\n", broker_ip, port);
+    }
     return sockfd;
 }
 
@@ -295,6 +526,12 @@ int send_mqtt_connect(int sock, char * USERNAME, char * PASSWORD) {
     uint8_t remaining_length_encoded[4];
     int rl_len;
 
+    /* Refuse what would not fit in the packet buffer */
+    if (5 + 16 + 2 + strlen(client_id) + 2 + strlen(USERNAME) + 2 + strlen(PASSWORD) > sizeof(connect_packet)) {
+        fprintf(stderr, "Username and password too long.\n");
+        return -1;
+    }
+
     /* Initialize index */
     index = 0;
 
@@ -316,12 +553,14 @@ int send_mqtt_connect(int sock, char * USERNAME, char * PASSWORD) {
     }
 
     /* Protocol Level */
-    connect_packet[index++] = 0x04; /* MQTT version 3.1.1 */
+    connect_packet[index++] = version; /* 4 for MQTT 3.1.1, or 5 */
 
     /* Connect Flags */
     {
         uint8_t connect_flags = 0;
-        connect_flags |= 0x02; /* Clean Session */
+        if (reconnect_max == 0) {
+            connect_flags |= 0x02; /* Clean Session */
+        }
         if (USERNAME[0] != '\0') {
             connect_flags |= 0x80; /* Username Flag */
         }
@@ -333,16 +572,27 @@ int send_mqtt_connect(int sock, char * USERNAME, char * PASSWORD) {
 
     /* Keep Alive */
     {
-        uint16_t keep_alive = 60; /* seconds */
+        uint16_t keep_alive = KEEP_ALIVE; /* seconds */
         connect_packet[index++] = (keep_alive >> 8) & 0xFF;
         connect_packet[index++] = keep_alive & 0xFF;
     }
 
+    /* Properties (MQTT 5): how long to keep a session, if it is to be kept */
+    if (version == 5 && reconnect_max > 0) {
+        connect_packet[index++] = 5;
+        connect_packet[index++] = 0x11; /* Session Expiry Interval */
+        connect_packet[index++] = (SESSION_EXPIRY >> 24) & 0xFF;
+        connect_packet[index++] = (SESSION_EXPIRY >> 16) & 0xFF;
+        connect_packet[index++] = (SESSION_EXPIRY >> 8) & 0xFF;
+        connect_packet[index++] = SESSION_EXPIRY & 0xFF;
+    } else if (version == 5) {
+        connect_packet[index++] = 0x00;
+    }
+
     /* Payload */
 
     /* Client ID */
     {
-        char *client_id = CLIENT_ID;
         int client_id_length = strlen(client_id);
         connect_packet[index++] = (client_id_length >> 8) & 0xFF;
         connect_packet[index++] = client_id_length & 0xFF;
@@ -387,7 +637,9 @@ int send_mqtt_connect(int sock, char * USERNAME, char * PASSWORD) {
         }
     }
 
-    printf("Sent MQTT CONNECT packet.\n");
+    if (!quiet) {
+        printf("Sent MQTT CONNECT packet.\n");
+    }
     return 0;
 }
 
@@ -395,104 +647,178 @@ int send_mqtt_connect(int sock, char * USERNAME, char * PASSWORD) {
  * Function to receive and validate the CONNACK packet from the broker.
  */
 int receive_connack(int sock) {
-    uint8_t connack[4];
-    int n;
-    int i;
+    struct packet p;
 
-    /* CONNACK is 4 bytes: Fixed Header (2 bytes) + Variable Header (2 bytes) */
-    for (i = 0; i < 4; i++) {
-        n = recv(sock, &connack[i], 1, 0);
-        if (n <= 0) {
-            fprintf(stderr, "Failed to receive CONNACK byte %d.\n", i + 1);
-            return -1;
-        }
+    if (read_packet(sock, &p) != 0) {
+        fprintf(stderr, "Failed to receive CONNACK.\n");
+        return -1;
     }
 
     /* Validate Fixed Header */
-    if (connack[0] != 0x20) { /* CONNACK packet type */
-        fprintf(stderr, "Invalid CONNACK packet type: 0x%02X\n", connack[0]);
+    if (p.type != 0x20) { /* CONNACK packet type */
+        fprintf(stderr, "Invalid CONNACK packet type: 0x%02X\n", p.type);
         return -1;
     }
 
-    /* Validate Remaining Length */
-    if (connack[1] != 0x02) {
-        fprintf(stderr, "Invalid CONNACK remaining length: %d\n", connack[1]);
+    /* Validate Remaining Length; MQTT 5 adds Properties */
+    if (version == 5 ? p.length < 3 : p.length != 2) {
+        fprintf(stderr, "Invalid CONNACK remaining length: %ld\n", p.length);
         return -1;
     }
 
-    /* Check Connection Acknowledgment Flags and Return Code */
-    {
-        uint8_t session_present = connack[2] & 0x01;
-        uint8_t return_code = connack[3];
-
-        if (return_code != 0x00) {
-            fprintf(stderr, "Connection refused, return code: %d\n", return_code);
-            return -1;
-        }
+    /* Check the Return Code */
+    if (p.body[1] != 0x00) {
+        fprintf(stderr, "Connection refused, return code: %d\n", p.body[1]);
+        return -1;
+    }
+    session_present = p.body[0] & 0x01;
+    if (version == 5 && connack_props(p.body + 2, p.length - 2) != 0) {
+        fprintf(stderr, "Malformed CONNACK properties.\n");
+        return -1;
     }
 
-    printf("Received CONNACK, connection successful.\n");
+    if (!quiet) {
+        printf("Received CONNACK, connection successful.\n");
+    }
     return 0;
 }
 
 /*
- * Function to publish a message to a specified MQTT topic.
+ * Function to encode a PUBLISH packet of payload_length bytes of message
+ * into buffer. A packet_id is only sent for QoS 1 and 2. With MQTT 5
+ * the topic goes by its alias once the broker knows it (see mqtt5.c).
+ * Returns the packet length, or -1 if it would not fit in size bytes.
  */
-int publish_message(int sock, char *topic, char *message) {
-    uint8_t publish_packet[512];
+int encode_publish(uint8_t *buffer, int size, char *topic, char *message, int payload_length,
+                   int qos, int packet_id) {
     int index;
+    int topic_length = strlen(topic);
     int remaining_length;
     uint8_t remaining_length_encoded[4];
     int rl_len;
+    int alias = 0, known = 0;
 
-    /* Initialize index */
-    index = 0;
-
-    /* Fixed Header: PUBLISH packet type and flags */
-    publish_packet[index++] = 0x30; /* PUBLISH with QoS 0 */
+    if (version == 5) {
+        alias = topic_alias(topic, &known);
+        if (known) {
+            topic_length = 0;
+        }
+    }
+    remaining_length = 2 + topic_length + payload_length + (qos > 0 ? 2 : 0);
+    if (version == 5) {
+        remaining_length += alias > 0 ? 4 : 1;      /* the Properties */
+    }
+    rl_len = encode_remaining_length(remaining_length, remaining_length_encoded);
+    if (1 + rl_len + remaining_length > size) {
+        return -1;
+    }
 
-    /* Variable Header and Payload preparation */
+    /* Fixed Header: PUBLISH packet type and flags, Remaining Length */
+    index = 0;
+    buffer[index++] = 0x30 | (qos << 1); /* PUBLISH with its QoS */
+    memcpy(&buffer[index], remaining_length_encoded, rl_len);
+    index += rl_len;
 
     /* Topic Name */
-    {
-        int topic_length = strlen(topic);
-        publish_packet[index++] = (topic_length >> 8) & 0xFF;
-        publish_packet[index++] = topic_length & 0xFF;
-        memcpy(&publish_packet[index], topic, topic_length);
-        index += topic_length;
+    buffer[index++] = (topic_length >> 8) & 0xFF;
+    buffer[index++] = topic_length & 0xFF;
+    memcpy(&buffer[index], topic, topic_length);
+    index += topic_length;
+
+    /* Packet Identifier */
+    if (qos > 0) {
+        buffer[index++] = (packet_id >> 8) & 0xFF;
+        buffer[index++] = packet_id & 0xFF;
+    }
+
+    /* Properties: at most a Topic Alias */
+    if (version == 5) {
+        if (alias > 0) {
+            buffer[index++] = 3;
+            buffer[index++] = 0x23;
+            buffer[index++] = (alias >> 8) & 0xFF;
+            buffer[index++] = alias & 0xFF;
+            if (!known) {
+                alias_sent(topic, alias);
+            }
+        } else {
+            buffer[index++] = 0;
+        }
     }
 
     /* Payload */
-    {
-        char *payload = message;
-        int payload_length = strlen(payload);
-        memcpy(&publish_packet[index], payload, payload_length);
-        index += payload_length;
+    memcpy(&buffer[index], message, payload_length);
+    index += payload_length;
+
+    return index;
+}
+
+/*
+ * Function to publish a message to a specified MQTT topic.
+ * While offline, or if it does not go out, it is kept for the next
+ * session (see keep_unsent()).
+ */
+int publish_message(int sock, char *topic, char *message) {
+    uint8_t publish_packet[1024];
+    int total_length;
+
+    if (nshard > 0) {
+        return shard_publish(topic, message);
+    }
+    if (offline) {
+        keep_unsent(topic, message);
+        return 0;
     }
 
-    /* Calculate Remaining Length */
-    remaining_length = (strlen(topic) + strlen(message));
-    rl_len = encode_remaining_length(remaining_length, remaining_length_encoded);
+    /* Wait for room in the in-flight window */
+    if (qos_room(sock) != 0) {
+        keep_unsent(topic, message);
+        return -1;
+    }
 
-    /* Shift the variable header and payload to make room for the remaining length */
-    /* Use bcopy instead of memmove */
-    bcopy(&publish_packet[1], &publish_packet[1 + rl_len], remaining_length);
-    /* Insert the encoded Remaining Length */
-    bcopy(remaining_length_encoded, &publish_packet[1], rl_len);
-    /* Update the total length */
-    {
-        int total_length = 1 + rl_len + remaining_length;
-        /* Send the PUBLISH packet */
-        if (send_all(sock, publish_packet, total_length) != 0) {
-            fprintf(stderr, "Failed to send MQTT PUBLISH packet.\n");
-            return -1;
+    total_length = qos_encode(publish_packet, sizeof(publish_packet), topic, message, strlen(message));
+    if (total_length < 0) {
+        fprintf(stderr, "Topic and message too long to publish.\n");
+        return -1;
+    }
+
+    /* Send the PUBLISH packet */
+    if (send_all(sock, publish_packet, total_length) != 0) {
+        fprintf(stderr, "Failed to send MQTT PUBLISH packet.\n");
+        if (qos == 0) {
+            keep_unsent(topic, message);        /* above, it is in flight */
         }
+        return -1;
     }
 
-    printf("Sent MQTT PUBLISH packet.\n");
+    if (!quiet) {
+        printf("Sent MQTT PUBLISH packet.\n");
+    }
     return 0;
 }
 
+/*
+ * Function to split a "topic value" request line in place.
+ * Returns 1 with topic and value set, 0 for a blank or comment line,
+ * or -1 if the line has a topic but no value.
+ */
+int split_request(char *line, char **topic, char **value) {
+    char *p;
+
+    line += strspn(line, " \t");
+    if (line[0] == '\0' || line[0] == '#') {
+        return 0;
+    }
+    *topic = line;
+    p = line + strcspn(line, " \t");
+    if (*p == '\0') {
+        return -1;
+    }
+    *p++ = '\0';
+    *value = p + strspn(p, " \t");
+    return 1;
+}
+
 /*
  * Function to send an MQTT DISCONNECT packet.
  */
@@ -508,16 +834,34 @@ int send_disconnect(int sock) {
         return -1;
     }
 
-    printf("Sent MQTT DISCONNECT packet.\n");
+    if (!quiet) {
+        printf("Sent MQTT DISCONNECT packet.\n");
+    }
     return 0;
 }
 
 /*
- * Dummy function to retrieve CPU usage.
- * This should be implemented to fetch actual CPU usage.
+ * Function to send an MQTT PINGREQ packet, to keep the session alive.
  */
-float get_cpu_usage(void) {
-    /* Placeholder for CPU usage retrieval */
-    /* For demonstration, return a fixed value */
-    return 42.5;
+int send_pingreq(int sock) {
+    uint8_t pingreq_packet[2];
+
+    pingreq_packet[0] = 0xC0; /* PINGREQ packet type */
+    pingreq_packet[1] = 0x00; /* Remaining Length */
+
+    if (send_all(sock, pingreq_packet, 2) != 0) {
+        fprintf(stderr, "Failed to send MQTT PINGREQ packet.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function to read the time of day in milliseconds.
+ */
+double now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
 }
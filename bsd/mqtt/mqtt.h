@@ -0,0 +1,125 @@
+/*
+ * mqtt.h - definitions shared by the mqtt client modules
+ */
+
+#define DEFAULT_PORT     1883
+#define KEEP_ALIVE       60     /* seconds, as sent in CONNECT */
+
+extern int quiet;
+extern char *client_id;
+
+/* A packet from the broker, its body still in the read buffer */
+struct packet {
+    int type;                   /* the first byte: type and flags */
+    long length;
+    unsigned char *body;
+};
+
+/* mqtt.c */
+int open_session(char *hostname, int port, char *username, char *password);
+int connect_to_broker(char *broker_ip, int port);
+int send_mqtt_connect(int sock, char *username, char *password);
+int receive_connack(int sock);
+int encode_publish(unsigned char *buffer, int size, char *topic, char *message, int payload_length,
+                   int qos, int packet_id);
+int publish_message(int sock, char *topic, char *message);
+int split_request(char *line, char **topic, char **value);
+int send_pingreq(int sock);
+int send_disconnect(int sock);
+int encode_remaining_length(int length, unsigned char *buffer);
+int send_all(int sock, unsigned char *buffer, int length);
+double now_ms(void);
+
+/* daemon.c */
+int run_daemon(int sock, char *path);
+
+/* batch.c */
+int run_batch(int sock, char *file, int size, int latency);
+
+/* decode.c */
+#define GOT_PINGRESP     1      /* read_broker() saw a PINGRESP */
+#define GOT_SUBACK       2      /* ... or a SUBACK */
+
+extern void (*on_publish)(char *topic, int topic_length, unsigned char *payload, long length);
+
+int read_broker(int sock);
+int read_packet(int sock, struct packet *p);
+void decode_reset(void);
+
+/* qos.c */
+extern int qos;
+
+int qos_init(int q, int w);
+void qos_limit(int max);
+int qos_full(void);
+int qos_pending(void);
+int qos_encode(unsigned char *buffer, int size, char *topic, char *message, int length);
+int qos_ack(int type, int id, unsigned char *reply);
+int qos_poll(int sock);
+int qos_wait(int sock, int ms);
+int qos_room(int sock);
+void qos_unalias(void);
+int qos_resume(int sock, int present);
+int qos_drain(int sock, int ms);
+
+/* spool.c */
+extern int spooling;
+
+int spool_open(char *path, long ring_size);
+int spool_put(char *topic, char *value);
+void spool_sync(void);
+int spool_drain(int sock);
+
+/* subscribe.c */
+int run_subscribe(int sock, char **filters, int n);
+
+/* collect.c */
+int run_collect(int sock, char *prefix, int interval, int packed);
+
+/* mqtt5.c */
+extern int version;
+
+int get_varint(unsigned char *p, long n, long *value);
+int skip_props(unsigned char *p, long n);
+int connack_props(unsigned char *p, long n);
+int topic_alias(char *topic, int *known);
+void alias_sent(char *topic, int alias);
+int unalias_publish(unsigned char *pkt, int len, int size);
+
+/* aggregate.c */
+extern int agg_window;
+
+int agg_add(char *topic, char *value);
+int agg_flush(int sock);
+
+/* deadband.c */
+extern int db_heartbeat;
+extern int db_active;
+
+int db_rule(char *arg);
+int db_pass(char *topic, char *value);
+
+/* reconnect.c */
+extern int reconnect_max;
+extern int session_present;
+extern int offline;
+
+void reconnect_init(char *hostname, int port, char *username, char *password);
+void pause_ms(double ms, volatile int *stop);
+void reconnect_lost(void);
+int reconnect_due(void);
+int reconnect_try(int sock);
+int reconnect(int sock, volatile int *stop);
+void keep_unsent(char *topic, char *message);
+
+/* shard.c */
+extern int nshard;
+extern int shard_replicas;
+
+int shard_open(char *hosts, int port, char *username, char *password);
+int shard_publish(char *topic, char *message);
+#ifdef FD_SET           /* where <sys/time.h> was included first */
+int shard_fds(fd_set *rfds, fd_set *wfds, int *maxfd);
+void shard_step(fd_set *rfds, fd_set *wfds);
+#endif
+void shard_close(int ms);
@@ -0,0 +1,255 @@
+/*
+ * mqtt5.c - MQTT 5.0 properties and topic aliases (-V 5)
+ *
+ * With -V 5 the session speaks MQTT 5.0 instead of 3.1.1. The packets
+ * are the same but for a block of properties in CONNECT, CONNACK,
+ * PUBLISH and SUBSCRIBE. We send none but a Topic Alias; of the
+ * broker's, Receive Maximum caps the -w window and Topic Alias Maximum
+ * says how many aliases we may set up.
+ *
+ * The first PUBLISH on a topic carries the topic and a new alias for
+ * it; every later one carries only the two byte alias, so that a
+ * stream of samples on a dozen long topics is mostly payload. Aliases
+ * are found by hashing the topic, and last as long as the connection.
+ * When they are used up, further topics go out in full. Packets kept
+ * to be sent again on a new connection (-R) are given back their topic.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mqtt.h"
+
+#define ALIASES  256            /* most aliases we keep track of */
+#define HASHSIZE 512            /* twice that, a power of two */
+
+int version = 4;                /* -V: 4 for 3.1.1, or 5 */
+
+static int alias_max;           /* Topic Alias Maximum from CONNACK */
+static int nalias;
+static char *alias_topic[HASHSIZE];
+static int alias_num[HASHSIZE];
+
+/*
+ * Decode a Variable Byte Integer from the n bytes at p into *value.
+ * Returns its length, or -1 if it is malformed or cut short.
+ */
+int get_varint(uint8_t *p, long n, long *value) {
+    long mult = 1;
+    int i;
+
+    *value = 0;
+    for (i = 0; i < n && i < 4; i++) {
+        *value += (p[i] & 0x7F) * mult;
+        mult *= 128;
+        if (!(p[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * The length of the properties at p, the length field included, with
+ * the Receive Maximum and Topic Alias Maximum they hold (if receive_max
+ * is not NULL). Returns -1 if they are malformed.
+ */
+static int walk_props(uint8_t *p, long n, int *receive_max, int *alias_limit) {
+    long len, v;
+    int i, k, id;
+
+    if ((k = get_varint(p, n, &len)) < 0 || k + len > n) {
+        return -1;
+    }
+    for (i = k; i < k + len; ) {
+        id = p[i++];
+        switch (id) {
+            case 0x01: case 0x17: case 0x19: case 0x24: case 0x25:
+            case 0x28: case 0x29: case 0x2A:
+                i += 1;
+                break;
+            case 0x13: case 0x21: case 0x22: case 0x23:
+                if (i + 2 <= k + len && receive_max != NULL) {
+                    v = (p[i] << 8) | p[i + 1];
+                    if (id == 0x21) {
+                        *receive_max = v;
+                    } else if (id == 0x22) {
+                        *alias_limit = v;
+                    }
+                }
+                i += 2;
+                break;
+            case 0x02: case 0x11: case 0x18: case 0x27:
+                i += 4;
+                break;
+            case 0x0B:
+                if ((id = get_varint(p + i, k + len - i, &v)) < 0) {
+                    return -1;
+                }
+                i += id;
+                break;
+            case 0x03: case 0x08: case 0x09: case 0x12: case 0x15:
+            case 0x16: case 0x1A: case 0x1C: case 0x1F:
+                if (i + 2 > k + len) {
+                    return -1;
+                }
+                i += 2 + ((p[i] << 8) | p[i + 1]);
+                break;
+            case 0x26:  /* a pair of strings */
+                if (i + 2 > k + len) {
+                    return -1;
+                }
+                i += 2 + ((p[i] << 8) | p[i + 1]);
+                if (i + 2 > k + len) {
+                    return -1;
+                }
+                i += 2 + ((p[i] << 8) | p[i + 1]);
+                break;
+            default:
+                return -1;
+        }
+    }
+    return i == k + len ? i : -1;
+}
+
+/*
+ * The length of the properties at p, the length field included, or -1.
+ */
+int skip_props(uint8_t *p, long n) {
+    return walk_props(p, n, NULL, NULL);
+}
+
+/*
+ * Take what matters to us from the properties of a CONNACK, and start
+ * the connection with no aliases. Returns 0, or -1 if they are
+ * malformed.
+ */
+int connack_props(uint8_t *p, long n) {
+    int receive_max = 65535, alias_limit = 0, i;
+
+    if (walk_props(p, n, &receive_max, &alias_limit) < 0) {
+        return -1;
+    }
+    if (receive_max > 0) {
+        qos_limit(receive_max);
+    }
+    for (i = 0; i < HASHSIZE; i++) {
+        if (alias_topic[i] != NULL) {
+            free(alias_topic[i]);
+            alias_topic[i] = NULL;
+        }
+    }
+    nalias = 0;
+    alias_max = alias_limit < ALIASES ? alias_limit : ALIASES;
+    return 0;
+}
+
+static unsigned hash(char *s) {
+    unsigned h = 5381;
+
+    while (*s != '\0') {
+        h = h * 33 + (uint8_t)*s++;
+    }
+    return h & (HASHSIZE - 1);
+}
+
+/*
+ * The alias for topic, with *known set if the broker has already been
+ * told it. A new alias is only taken by alias_sent(). Returns 0 if
+ * there is none to be had.
+ */
+int topic_alias(char *topic, int *known) {
+    unsigned h;
+
+    *known = 0;
+    if (alias_max == 0) {
+        return 0;
+    }
+    for (h = hash(topic); alias_topic[h] != NULL; h = (h + 1) & (HASHSIZE - 1)) {
+        if (strcmp(alias_topic[h], topic) == 0) {
+            *known = 1;
+            return alias_num[h];
+        }
+    }
+    return nalias < alias_max ? nalias + 1 : 0;
+}
+
+/* Note that a PUBLISH has told the broker that alias is topic */
+void alias_sent(char *topic, int alias) {
+    unsigned h;
+
+    for (h = hash(topic); alias_topic[h] != NULL; h = (h + 1) & (HASHSIZE - 1)) {
+    }
+    alias_topic[h] = (char *)malloc(strlen(topic) + 1);
+    if (alias_topic[h] == NULL) {
+        return;         /* it will just be told again */
+    }
+    strcpy(alias_topic[h], topic);
+    alias_num[h] = alias;
+    nalias++;
+}
+
+/* The topic alias stands for, or NULL */
+static char *alias_name(int alias) {
+    int h;
+
+    for (h = 0; h < HASHSIZE; h++) {
+        if (alias_topic[h] != NULL && alias_num[h] == alias) {
+            return alias_topic[h];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Rewrite the PUBLISH of len bytes at pkt, at QoS 1 or 2, to name its
+ * topic and set no alias, for the next connection, on which the
+ * aliases of this one mean nothing. No alias is used from here until
+ * the next CONNACK. Returns the new length, or -1 if the topic is
+ * unknown or will not fit in size bytes.
+ */
+int unalias_publish(uint8_t *pkt, int len, int size) {
+    static uint8_t payload[1024];
+    static char topic[1024];
+    long rem, plen;
+    int i, k, tlen, id, alias, dup, n;
+
+    if ((k = get_varint(pkt + 1, len - 1, &rem)) < 0) {
+        return -1;
+    }
+    i = 1 + k;
+    tlen = (pkt[i] << 8) | pkt[i + 1];
+    if (tlen >= (int)sizeof(topic)) {
+        return -1;
+    }
+    memcpy(topic, pkt + i + 2, tlen);
+    topic[tlen] = '\0';
+    i += 2 + tlen;
+    id = (pkt[i] << 8) | pkt[i + 1];
+    i += 2;
+    if ((k = get_varint(pkt + i, len - i, &plen)) < 0) {
+        return -1;
+    }
+    alias = plen == 3 && pkt[i + k] == 0x23 ? (pkt[i + k + 1] << 8) | pkt[i + k + 2] : 0;
+    i += k + plen;
+    if (tlen == 0) {
+        if (alias == 0 || alias_name(alias) == NULL) {
+            return -1;
+        }
+        strcpy(topic, alias_name(alias));
+    }
+    if (len - i > (int)sizeof(payload)) {
+        return -1;
+    }
+    memcpy(payload, pkt + i, len - i);
+
+    alias_max = 0;
+    dup = pkt[0] & 0x08;
+    n = encode_publish(pkt, size, topic, (char *)payload, len - i, (pkt[0] >> 1) & 3, id);
+    if (n > 0) {
+        pkt[0] |= dup;
+    }
+    return n;
+}
@@ -0,0 +1,383 @@
+/*
+ * qos.c - QoS 1 and 2 delivery with a window of packets in flight (-q, -w)
+ *
+ * Each PUBLISH above QoS 0 takes a slot, which keeps a copy of the
+ * packet until the broker has acknowledged it: PUBACK for QoS 1;
+ * PUBREC, then our PUBREL, then PUBCOMP for QoS 2. Up to -w packets
+ * may be in flight at once, so a high latency link is kept busy
+ * rather than waiting out a round trip per message. When every slot
+ * is taken the sender waits until half of them have been acknowledged;
+ * the queue of unacknowledged packets never grows past the window.
+ *
+ * A packet not acknowledged within RETRY_MS is sent again, with DUP
+ * set on a PUBLISH. Packet identifiers are chosen so that the slot
+ * for an acknowledgement is found without a search. The
+ * acknowledgements themselves are read by decode.c. With -R, what is
+ * in flight when the connection fails goes again on the next one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "mqtt.h"
+
+#define SLOTSIZE 1024           /* largest packet publish_message sends */
+#define RETRY_MS 5000           /* resend what is unacknowledged this long */
+
+#define S_FREE   0
+#define S_ACK    1              /* PUBLISH sent, waiting for PUBACK/PUBREC */
+#define S_COMP   2              /* PUBREL sent, waiting for PUBCOMP */
+
+/* One packet in flight */
+struct slot {
+    int id;                     /* its packet identifier */
+    int state;
+    double sent;                /* when it last went out */
+    long seq;                   /* the order it first went in */
+    int len;
+    uint8_t *pkt;
+};
+
+int qos;                        /* -q: 0, 1 or 2 */
+
+static struct slot *slots;
+static int window;
+static int *free_slots;         /* stack of free slot numbers */
+static int nfree;
+static long seq;
+
+/*
+ * Set up for QoS level q with up to w packets in flight.
+ * Returns 0, or -1 if there is no memory for the window.
+ */
+int qos_init(int q, int w) {
+    uint8_t *pkts;
+    int i;
+
+    qos = q;
+    if (qos == 0) {
+        return 0;
+    }
+    window = w;
+    slots = (struct slot *)malloc(window * sizeof(struct slot));
+    free_slots = (int *)malloc(window * sizeof(int));
+    pkts = (uint8_t *)malloc(window * SLOTSIZE);
+    if (slots == NULL || free_slots == NULL || pkts == NULL) {
+        fprintf(stderr, "Cannot allocate a window of %d packets.\n", window);
+        return -1;
+    }
+    for (i = 0; i < window; i++) {
+        slots[i].id = i + 1 - window;   /* the first use adds window */
+        slots[i].state = S_FREE;
+        slots[i].pkt = pkts + i * SLOTSIZE;
+        free_slots[i] = window - 1 - i;
+    }
+    nfree = window;
+    return 0;
+}
+
+/*
+ * Keep no more than max packets in flight, as the broker asks. Only
+ * before anything has been sent.
+ */
+void qos_limit(int max) {
+    int i;
+
+    if (qos == 0 || max >= window || qos_pending() > 0) {
+        return;
+    }
+    window = max;
+    for (i = 0; i < window; i++) {
+        slots[i].id = i + 1 - window;
+        free_slots[i] = window - 1 - i;
+    }
+    nfree = window;
+}
+
+/* Is the window full? */
+int qos_full(void) {
+    return qos > 0 && nfree == 0;
+}
+
+/* The number of packets still unacknowledged */
+int qos_pending(void) {
+    return qos > 0 ? window - nfree : 0;
+}
+
+/*
+ * Encode a PUBLISH of length bytes of message at the chosen QoS into
+ * buffer, and keep a copy in a slot of the window, which must not be
+ * full. Returns the packet length, or -1 if it would not fit in size
+ * bytes.
+ */
+int qos_encode(uint8_t *buffer, int size, char *topic, char *message, int length) {
+    struct slot *s;
+    int id, n;
+
+    if (qos == 0) {
+        return encode_publish(buffer, size, topic, message, length, 0, 0);
+    }
+
+    /* Identifiers of a slot step by the window size, so id - 1 mod window finds it */
+    s = &slots[free_slots[nfree - 1]];
+    id = s->id + window;
+    if (id > 65535) {
+        id = (s - slots) + 1;
+    }
+    n = encode_publish(s->pkt, size < SLOTSIZE ? size : SLOTSIZE, topic, message, length, qos, id);
+    if (n < 0) {
+        return -1;
+    }
+    memcpy(buffer, s->pkt, n);
+    nfree--;
+    s->id = id;
+    s->state = S_ACK;
+    s->len = n;
+    s->sent = now_ms();
+    s->seq = seq++;
+    return n;
+}
+
+/* The slot waiting on packet id in the given state, or NULL */
+static struct slot *find_slot(int id, int state) {
+    struct slot *s;
+
+    if (qos == 0 || id == 0) {
+        return NULL;
+    }
+    s = &slots[(id - 1) % window];
+    return s->id == id && s->state == state ? s : NULL;
+}
+
+static void release(struct slot *s) {
+    s->state = S_FREE;
+    free_slots[nfree++] = s - slots;
+}
+
+/*
+ * Act on the acknowledgement of the given type for packet id from the
+ * broker. A PUBREC is answered with a PUBREL, put in reply; returns
+ * the number of bytes put there.
+ */
+int qos_ack(int type, int id, uint8_t *reply) {
+    struct slot *s;
+
+    switch (type & 0xF0) {
+        case 0x40: /* PUBACK */
+            if (qos == 1 && (s = find_slot(id, S_ACK)) != NULL) {
+                release(s);
+            }
+            break;
+        case 0x50: /* PUBREC */
+            if (qos == 2 && (s = find_slot(id, S_ACK)) != NULL) {
+                s->state = S_COMP;
+                s->pkt[0] = 0x62;       /* PUBREL, flags 0010 */
+                s->pkt[1] = 0x02;
+                s->pkt[2] = (id >> 8) & 0xFF;
+                s->pkt[3] = id & 0xFF;
+                s->len = 4;
+                s->sent = now_ms();
+                memcpy(reply, s->pkt, 4);
+                return 4;
+            }
+            break;
+        case 0x70: /* PUBCOMP */
+            if ((s = find_slot(id, S_COMP)) != NULL) {
+                release(s);
+            }
+            break;
+    }
+    return 0;
+}
+
+/*
+ * Read whatever the broker has sent without waiting, then send again
+ * what has gone unacknowledged too long. Returns -1 if the connection
+ * is gone, else what read_broker() reported.
+ */
+int qos_poll(int sock) {
+    struct timeval tv;
+    fd_set rfds;
+    double now;
+    int i, n, rc;
+
+    rc = 0;
+    for (;;) {
+        FD_ZERO(&rfds);
+        FD_SET(sock, &rfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+        if (select(sock + 1, &rfds, NULL, NULL, &tv) <= 0) {
+            break;
+        }
+        if ((n = read_broker(sock)) < 0) {
+            return -1;
+        }
+        rc |= n;
+    }
+
+    if (qos_pending() == 0) {
+        return rc;
+    }
+    now = now_ms();
+    for (i = 0; i < window; i++) {
+        if (slots[i].state == S_FREE || now - slots[i].sent < RETRY_MS) {
+            continue;
+        }
+        if (slots[i].state == S_ACK) {
+            slots[i].pkt[0] |= 0x08;    /* DUP */
+        }
+        slots[i].sent = now;
+        if (send_all(sock, slots[i].pkt, slots[i].len) != 0) {
+            return -1;
+        }
+    }
+    return rc;
+}
+
+/*
+ * The connection is gone: make each PUBLISH in flight name its topic
+ * rather than an alias, which will mean nothing on the next one. A
+ * packet the topic will not fit in is given up.
+ */
+void qos_unalias(void) {
+    int i, n;
+
+    if (qos == 0 || version != 5) {
+        return;
+    }
+    for (i = 0; i < window; i++) {
+        if (slots[i].state != S_ACK) {
+            continue;
+        }
+        if ((n = unalias_publish(slots[i].pkt, slots[i].len, SLOTSIZE)) < 0) {
+            fprintf(stderr, "Message %d given up on reconnecting.\n", slots[i].id);
+            release(&slots[i]);
+            continue;
+        }
+        slots[i].len = n;
+    }
+}
+
+static int by_seq(const void *a, const void *b) {
+    long d = (*(struct slot **)a)->seq - (*(struct slot **)b)->seq;
+
+    return d < 0 ? -1 : d > 0;
+}
+
+/*
+ * On a new connection, send again what was in flight on the last, in
+ * the order it first went. If the broker kept our session (present),
+ * everything goes as it was, a PUBLISH with DUP set. If not, a PUBLISH
+ * goes as new, and a PUBREL is dropped: the broker had its message,
+ * and what it knew of the delivery went with the session. Returns 0,
+ * or -1 if a send failed.
+ */
+int qos_resume(int sock, int present) {
+    struct slot **order;
+    int i, n;
+
+    if (qos_pending() == 0) {
+        return 0;
+    }
+    order = (struct slot **)malloc(window * sizeof(struct slot *));
+    if (order == NULL) {
+        return -1;
+    }
+    for (i = n = 0; i < window; i++) {
+        if (slots[i].state == S_COMP && !present) {
+            release(&slots[i]);
+        } else if (slots[i].state != S_FREE) {
+            order[n++] = &slots[i];
+        }
+    }
+    qsort((char *)order, n, sizeof(struct slot *), by_seq);
+    for (i = 0; i < n; i++) {
+        if (order[i]->state == S_ACK) {
+            if (present) {
+                order[i]->pkt[0] |= 0x08;       /* DUP */
+            } else {
+                order[i]->pkt[0] &= ~0x08;
+            }
+        }
+        order[i]->sent = now_ms();
+        if (send_all(sock, order[i]->pkt, order[i]->len) != 0) {
+            free((char *)order);
+            return -1;
+        }
+    }
+    free((char *)order);
+    return 0;
+}
+
+/*
+ * Wait up to ms for the broker to send something, and act on it.
+ * Returns -1 if the connection is gone, else what read_broker() reported.
+ */
+int qos_wait(int sock, int ms) {
+    struct timeval tv;
+    fd_set rfds;
+
+    FD_ZERO(&rfds);
+    FD_SET(sock, &rfds);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    if (select(sock + 1, &rfds, NULL, NULL, &tv) < 0) {
+        return 0;
+    }
+    return qos_poll(sock);
+}
+
+/*
+ * If the window is full, wait until half of it is free again, so that
+ * packets go out in runs rather than one per acknowledgement. Returns
+ * -1 if the connection is gone, or nothing has been acknowledged for
+ * a whole keep-alive interval.
+ */
+int qos_room(int sock) {
+    double since;
+    int pending;
+
+    if (!qos_full()) {
+        return 0;
+    }
+    since = now_ms();
+    while ((pending = qos_pending()) > window / 2) {
+        if (qos_wait(sock, 1000) < 0) {
+            return -1;
+        }
+        if (qos_pending() < pending) {
+            since = now_ms();
+        } else if (now_ms() - since >= KEEP_ALIVE * 1000.0) {
+            fprintf(stderr, "MQTT broker stopped acknowledging messages.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Wait up to ms for every packet in flight to be acknowledged.
+ * Returns 0, or -1 if some are not.
+ */
+int qos_drain(int sock, int ms) {
+    double end;
+
+    end = now_ms() + ms;
+    while (qos_pending() > 0 && now_ms() < end) {
+        if (qos_wait(sock, 100) < 0) {
+            break;
+        }
+    }
+    if (qos_pending() > 0) {
+        fprintf(stderr, "%d messages not acknowledged by the broker.\n", qos_pending());
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * qstress.c - many threads at once on the message queue of libmqtt
+ *
+ * Usage: qstress [-t threads] [-n count] [-s slots] [policy ...]
+ *
+ * For each policy (count, drop or block; all three by default) the
+ * threads each queue count messages, "<seq>" on topic "q/<thread>",
+ * while the main thread drains them into a client as its owner would.
+ * The client is never connected: what is drained into its arena is
+ * checked there and thrown away. Every PUBLISH must be whole, from a
+ * thread that exists, and later than that thread's last one, and the
+ * messages drained and dropped must add up to those queued, with none
+ * dropped under block. The queue is small, so that it is full most of
+ * the time and the overflow paths are the ones that run.
+ *
+ * "make tsan" builds it with -fsanitize=thread and runs it, so that an
+ * access to a slot that the queue's atomics do not order is reported.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "libmqtt.h"
+
+#define MAXTHREAD 64
+
+static struct mqtt_queue q;
+static int nthread = 8;
+static long count = 100000;
+static int finished;            /* threads done queueing */
+static long refused;            /* mqtt_enqueue() returned -1 */
+
+static void *producer(void *arg) {
+    char topic[16], text[24];
+    long i;
+    int n;
+
+    sprintf(topic, "q/%d", (int)(long)arg);
+    for (i = 0; i < count; i++) {
+        n = sprintf(text, "%ld", i);
+        if (mqtt_enqueue(&q, topic, text, n) != 0) {
+            __atomic_fetch_add(&refused, 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Check the packets drained into c and empty its arena. Returns the
+ * number of messages, or -1 if one is wrong.
+ */
+static long check(struct mqtt_client *c, long *last) {
+    unsigned char *p, *end;
+    char topic[16], text[24];
+    long rl, seq;
+    int i, tlen, id;
+
+    p = c->arena + c->head;
+    end = c->arena + c->tail;
+    for (i = 0; p < end; i++) {
+        if (p[0] != 0x30 || (p[1] & 0x80) || p + 2 + p[1] > end) {
+            fprintf(stderr, "Malformed PUBLISH at %ld.\n", (long)(p - c->arena));
+            return -1;
+        }
+        rl = p[1];
+        tlen = p[2] << 8 | p[3];
+        if (tlen >= sizeof(topic) || rl - 2 - tlen >= sizeof(text)) {
+            fprintf(stderr, "PUBLISH of %ld bytes, topic of %d.\n", rl, tlen);
+            return -1;
+        }
+        memcpy(topic, p + 4, tlen);
+        topic[tlen] = '\0';
+        memcpy(text, p + 4 + tlen, rl - 2 - tlen);
+        text[rl - 2 - tlen] = '\0';
+        if (sscanf(topic, "q/%d", &id) != 1 || id < 0 || id >= nthread ||
+            sscanf(text, "%ld", &seq) != 1 || seq <= last[id] || seq >= count) {
+            fprintf(stderr, "Message %s on %s out of order (last %ld).\n",
+                    text, topic, id >= 0 && id < nthread ? last[id] : -1L);
+            return -1;
+        }
+        last[id] = seq;
+        p += 2 + rl;
+    }
+    c->head = c->tail = 0;
+    return i;
+}
+
+/* One run under policy. Returns 0, or -1 if it went wrong */
+static int run(char *name, int policy, void *slots, long size) {
+    static unsigned char arena[65536];
+    struct mqtt_client c;
+    pthread_t threads[MAXTHREAD];
+    long last[MAXTHREAD], drained, dropped, n;
+    int i, moved, done;
+
+    mqtt_init(&c, arena, sizeof(arena), "qstress", NULL, NULL);
+    c.state = MQTT_READY;       /* as if open: nothing is sent */
+    if (mqtt_queue_init(&q, slots, size, policy) != 0) {
+        fprintf(stderr, "Queue of %ld bytes too small.\n", size);
+        return -1;
+    }
+    finished = 0;
+    refused = 0;
+    for (i = 0; i < nthread; i++) {
+        last[i] = -1;
+        if (pthread_create(&threads[i], NULL, producer, (void *)(long)i) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    /* Drain until every thread is done and the queue is empty after */
+    drained = 0;
+    do {
+        done = __atomic_load_n(&finished, __ATOMIC_ACQUIRE) == nthread;
+        moved = mqtt_drain(&q, &c, 0);
+        if ((n = check(&c, last)) < 0) {
+            exit(1);
+        }
+        drained += n;
+        if (moved == 0) {
+            sched_yield();
+        }
+    } while (!done || moved > 0);
+
+    for (i = 0; i < nthread; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    dropped = mqtt_dropped(&q);
+    printf("%-6s %ld queued, %ld drained, %ld dropped, %ld refused\n",
+           name, nthread * count, drained, dropped, refused);
+    if (drained + dropped != nthread * count ||
+        (policy == MQTT_COUNT && refused != dropped) ||
+        (policy != MQTT_COUNT && refused != 0) ||
+        (policy == MQTT_BLOCK && dropped != 0)) {
+        fprintf(stderr, "%s: messages lost or counted twice.\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static char *names[] = { "count", "drop", "block" };
+    static int policies[] = { MQTT_COUNT, MQTT_DROP_OLDEST, MQTT_BLOCK };
+    void *slots;
+    long nslot = 16;
+    int opt, i, k, want, rc;
+
+    while ((opt = getopt(argc, argv, "t:n:s:")) != -1) {
+        switch (opt) {
+            case 't':
+                nthread = atoi(optarg);
+                break;
+            case 'n':
+                count = atol(optarg);
+                break;
+            case 's':
+                nslot = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-n count] [-s slots] [count|drop|block ...]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+    if (nthread < 1 || nthread > MAXTHREAD || count < 1 || nslot < 2) {
+        fprintf(stderr, "Error: from 1 to %d threads, and at least 2 slots.\n", MAXTHREAD);
+        exit(1);
+    }
+    if ((slots = malloc(nslot * MQTT_SLOTSIZE)) == NULL) {
+        fprintf(stderr, "Cannot allocate the queue.\n");
+        exit(1);
+    }
+
+    for (k = optind; k < argc; k++) {
+        for (i = 0; i < 3 && strcmp(argv[k], names[i]) != 0; i++) {
+        }
+        if (i == 3) {
+            fprintf(stderr, "Error: unknown policy %s.\n", argv[k]);
+            exit(1);
+        }
+    }
+
+    rc = 0;
+    for (i = 0; i < 3; i++) {
+        want = optind == argc;
+        for (k = optind; k < argc; k++) {
+            if (strcmp(argv[k], names[i]) == 0) {
+                want = 1;
+            }
+        }
+        if (want && run(names[i], policies[i], slots, nslot * MQTT_SLOTSIZE) != 0) {
+            rc = 1;
+        }
+    }
+    return rc;
+}
@@ -0,0 +1,233 @@
+/*
+ * reconnect.c - keep publishing across broker restarts (-R seconds)
+ *
+ * Without -R the daemon (-d) and the collector (-c) give up the first
+ * time the connection fails. With it they connect again, and go on
+ * where they were: the session is opened with Clean Session off (in
+ * MQTT 5, Clean Start off and a Session Expiry Interval), so the broker
+ * keeps our state while we are away, and the QoS 1 and 2 packets still
+ * unacknowledged are sent again, in the order they first went, once
+ * the new CONNACK is in (see qos_resume()).
+ *
+ * Attempts are spaced by a delay that starts at BACKOFF_MIN and doubles
+ * after each failure up to the -R seconds; each wait is a random part
+ * of the delay, from half to all of it, so that many publishers cut
+ * off by the same restart do not all come back in the same instant and
+ * take the broker down again. A connection that fails again sooner
+ * than the -R seconds does not start the delay over.
+ *
+ * The new socket is put in place of the old one with dup2(), so callers
+ * holding the descriptor need not be told. Whatever was left unread from
+ * the old one is thrown away before the new CONNACK is looked for.
+ *
+ * A message that was not sent, and is not in flight to be sent again,
+ * is held until the next session: a QoS 0 PUBLISH whose write failed,
+ * or one that was waiting for room in the window. Without a spool up to
+ * HELDSIZE bytes of them are kept in memory.
+ *
+ * With -S, the daemon and the collector do not wait for the broker:
+ * they go on offline, each new message going to the spool (see
+ * spool.c), and try to connect whenever the delay is up. Once a session
+ * is open again the spool is sent before anything new.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "mqtt.h"
+
+#define BACKOFF_MIN 1000.0      /* ms: the first delay */
+#define HELDSIZE    8192        /* bytes of unsent messages kept */
+
+int reconnect_max;              /* -R: longest delay in seconds, or 0 */
+int session_present;            /* from the last CONNACK */
+int offline;                    /* the session is down until reconnect_try() */
+
+static char *host, *user, *pass;
+static int port_;
+static double delay = BACKOFF_MIN;
+static double connected;        /* when the last session opened */
+static double next_try;         /* when reconnect_try() may connect */
+static char held[HELDSIZE];     /* "topic\0message\0" of each unsent one */
+static int nheld;
+static long dropped;            /* unsent messages that did not fit */
+
+/*
+ * Remember where to connect again, and make this process's waits
+ * differ from those of any other.
+ */
+void reconnect_init(char *hostname, int port, char *username, char *password) {
+    host = hostname;
+    port_ = port;
+    user = username;
+    pass = password;
+    srand((unsigned)getpid() ^ (unsigned)time(NULL));
+    connected = now_ms();
+}
+
+/* Sleep for ms, or until *stop is set */
+void pause_ms(double ms, volatile int *stop) {
+    struct timeval tv;
+    double end;
+
+    end = now_ms() + ms;
+    while ((stop == NULL || !*stop) && (ms = end - now_ms()) > 0) {
+        if (ms > 200) {
+            ms = 200;
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = (long)(ms * 1000);
+        select(0, NULL, NULL, NULL, &tv);
+    }
+}
+
+/* Choose when to try next, and make the delay after that longer */
+static void schedule(void) {
+    double wait;
+
+    wait = delay / 2 + delay / 2 * (rand() / (RAND_MAX + 1.0));
+    fprintf(stderr, "Connecting again in %.1f seconds.\n", wait / 1000);
+    next_try = now_ms() + wait;
+    delay *= 2;
+    if (delay > reconnect_max * 1000.0) {
+        delay = reconnect_max * 1000.0;
+    }
+}
+
+/*
+ * The session has failed: go offline until reconnect_try() opens
+ * another.
+ */
+void reconnect_lost(void) {
+    qos_unalias();
+    if (now_ms() - connected > reconnect_max * 1000.0) {
+        delay = BACKOFF_MIN;
+    }
+    offline = 1;
+    schedule();
+}
+
+/* The ms until reconnect_try() will connect, or 0 if it is time */
+int reconnect_due(void) {
+    double ms = next_try - now_ms();
+
+    return ms > 0 ? (int)ms + 1 : 0;
+}
+
+/*
+ * Publish on sock what keep_unsent() held. Returns 0, or -1 if the
+ * session failed again, with what did not go held once more.
+ */
+static int send_held(int sock) {
+    static char copy[HELDSIZE];
+    char *p, *message;
+    int n, failed;
+
+    if (dropped > 0) {
+        fprintf(stderr, "%ld unsent messages lost for want of room.\n", dropped);
+        dropped = 0;
+    }
+    n = nheld;
+    memcpy(copy, held, n);
+    nheld = 0;
+    failed = 0;
+    for (p = copy; p < copy + n; p = message + strlen(message) + 1) {
+        message = p + strlen(p) + 1;
+        if (failed) {
+            keep_unsent(p, message);
+        } else if (publish_message(sock, p, message) != 0) {
+            failed = 1;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/*
+ * If the delay is up, try once to open a session in place of sock (or
+ * a new one, if it is -1), and send again what was in flight, then
+ * what was spooled or held. Returns the socket, or -1 if there is none
+ * yet.
+ */
+int reconnect_try(int sock) {
+    int fd;
+
+    if (reconnect_due() > 0) {
+        return -1;
+    }
+    decode_reset();
+    if ((fd = open_session(host, port_, user, pass)) >= 0) {
+        connected = now_ms();
+        if (sock >= 0 && fd != sock) {
+            dup2(fd, sock);
+            close(fd);
+            fd = sock;
+        }
+        offline = 0;
+        if (qos_resume(fd, session_present) == 0 && spool_drain(fd) == 0 && send_held(fd) == 0) {
+            fprintf(stderr, "Connected again%s.\n", session_present ? ", session resumed" : "");
+            return fd;
+        }
+        offline = 1;
+        fprintf(stderr, "Connection to MQTT broker lost.\n");
+        decode_reset();
+        qos_unalias();
+        if (sock < 0) {
+            close(fd);
+        }
+    }
+    schedule();
+    return -1;
+}
+
+/*
+ * The session on sock (or none, if it is -1) has failed: open another
+ * and send again what was in flight. Returns the socket, which is sock
+ * if that was one, or -1 if *stop was set first.
+ */
+int reconnect(int sock, volatile int *stop) {
+    int fd;
+
+    reconnect_lost();
+    while (stop == NULL || !*stop) {
+        pause_ms(reconnect_due(), stop);
+        if (stop != NULL && *stop) {
+            break;
+        }
+        if ((fd = reconnect_try(sock)) >= 0) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Keep a message that did not go out, and is not in flight to go again
+ * either, for the next session: in the spool, if there is one, or with
+ * -R in memory.
+ */
+void keep_unsent(char *topic, char *message) {
+    int t, m;
+
+    if (spooling) {
+        spool_put(topic, message);
+        spool_sync();
+        return;
+    }
+    if (reconnect_max == 0) {
+        return;
+    }
+    t = strlen(topic) + 1;
+    m = strlen(message) + 1;
+    if (nheld + t + m > HELDSIZE) {
+        dropped++;
+        return;
+    }
+    memcpy(held + nheld, topic, t);
+    memcpy(held + nheld + t, message, m);
+    nheld += t + m;
+}
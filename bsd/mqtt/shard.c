@@ -0,0 +1,297 @@
+/*
+ * shard.c - publish to a cluster of brokers (-d with -h a,b,c [-N n])
+ *
+ * Given a list of brokers, the daemon keeps a connection to each and
+ * sends every topic to the one that owns it, or with -N to n of them.
+ * Ownership is by consistent hashing: each broker has VNODES points on
+ * a ring of 32 bit hashes, and a topic goes to the broker of the first
+ * point at or after its own hash, then to the next different ones for
+ * its replicas. A topic always lands on the same broker, so its
+ * messages stay in order, and adding or losing a broker moves only
+ * the topics that were its own. While a broker is down, or still
+ * connecting, its topics go on round the ring to the next one whose
+ * session is open.
+ *
+ * The connections are those of libmqtt: each has its own arena and is
+ * written as its socket takes it, so a slow broker fills only its own
+ * arena, and what will not fit there is dropped and counted rather
+ * than held up for the others. Only QoS 0 is offered this way. A
+ * connection that fails is opened again every RETRY seconds; what was
+ * still in its arena is lost, and counted.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "mqtt.h"
+#include "libmqtt.h"
+
+#define MAXBROKER 16
+#define VNODES    100           /* points per broker on the ring */
+#define ARENA     262144        /* bytes of packets waiting per broker */
+#define RETRY     5             /* seconds between attempts to connect */
+
+struct broker {
+    char *host;
+    int port;
+    char id[64];                /* client id, ours with a suffix */
+    struct mqtt_client c;
+    time_t retry;               /* when to connect again, if closed */
+    long discarded;             /* bytes of packets lost when it failed */
+};
+
+struct point {
+    unsigned hash;
+    int broker;
+};
+
+int nshard;                     /* brokers, or 0 for the one session */
+int shard_replicas = 1;         /* -N */
+
+static struct broker brokers[MAXBROKER];
+static struct point ring[MAXBROKER * VNODES];
+static int npoint;
+static long lost;               /* messages with no broker up to take them */
+
+/*
+ * FNV-1a, with the final mix of MurmurHash3 so that names differing
+ * in the last character only are spread over the whole ring.
+ */
+static unsigned hash(char *s) {
+    unsigned h = 2166136261U;
+
+    while (*s != '\0') {
+        h = (h ^ (unsigned char)*s++) * 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static int by_hash(const void *a, const void *b) {
+    unsigned x = ((struct point *)a)->hash, y = ((struct point *)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+static void start(struct broker *b) {
+    if (mqtt_open(&b->c, b->host, b->port) != 0) {
+        fprintf(stderr, "Broker %s:%d: %s.\n", b->host, b->port, mqtt_error(&b->c));
+        b->retry = time(NULL) + RETRY;
+    }
+}
+
+/*
+ * Set up connections to each broker of the comma separated list hosts,
+ * each an address with an optional :port, and start opening them.
+ * Returns 0, or -1 if the list or memory is at fault.
+ */
+int shard_open(char *hosts, int port, char *username, char *password) {
+    struct broker *b;
+    unsigned char *arena;
+    char name[96], *p, *next;
+    int i;
+
+    for (p = hosts; p != NULL; p = next) {
+        if (nshard == MAXBROKER) {
+            fprintf(stderr, "Error: at most %d brokers.\n", MAXBROKER);
+            return -1;
+        }
+        b = &brokers[nshard];
+        if ((next = strchr(p, ',')) != NULL) {
+            *next++ = '\0';
+        }
+        b->host = p;
+        b->port = port;
+        if ((p = strchr(p, ':')) != NULL) {
+            *p++ = '\0';
+            b->port = atoi(p);
+        }
+        if (b->host[0] == '\0' || b->port <= 0) {
+            fprintf(stderr, "Error: invalid broker list.\n");
+            return -1;
+        }
+        sprintf(b->id, "%.50s-%d", client_id, nshard);
+        if ((arena = (unsigned char *)malloc(ARENA)) == NULL) {
+            fprintf(stderr, "Cannot allocate a buffer for broker %s.\n", b->host);
+            return -1;
+        }
+        mqtt_init(&b->c, arena, ARENA, b->id, username, password);
+        for (i = 0; i < VNODES; i++) {
+            sprintf(name, "%.60s:%d#%d", b->host, b->port, i);
+            ring[npoint].hash = hash(name);
+            ring[npoint].broker = nshard;
+            npoint++;
+        }
+        nshard++;
+    }
+    if (shard_replicas < 1 || shard_replicas > nshard) {
+        fprintf(stderr, "Error: -N must be from 1 to the number of brokers.\n");
+        return -1;
+    }
+    qsort((char *)ring, npoint, sizeof(struct point), by_hash);
+    for (i = 0; i < nshard; i++) {
+        start(&brokers[i]);
+    }
+    return 0;
+}
+
+/*
+ * Queue message on topic for the brokers that own it. Returns 0; what
+ * cannot be sent is counted instead.
+ */
+int shard_publish(char *topic, char *message) {
+    char seen[MAXBROKER];
+    struct broker *b;
+    unsigned h;
+    int lo, hi, mid, k, n;
+
+    /* The first point at or after the topic's hash, round the ring */
+    h = hash(topic);
+    lo = 0;
+    hi = npoint;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    memset(seen, 0, sizeof(seen));
+    for (k = n = 0; k < npoint && n < shard_replicas; k++) {
+        mid = ring[(lo + k) % npoint].broker;
+        if (seen[mid]) {
+            continue;
+        }
+        seen[mid] = 1;
+        b = &brokers[mid];
+        if (b->c.state == MQTT_READY) {
+            mqtt_publish(&b->c, topic, message, strlen(message));
+            n++;
+        }
+    }
+    if (n == 0) {
+        lost++;
+    }
+    return 0;
+}
+
+/*
+ * Add what each connection waits for to the sets, opening again those
+ * whose time has come, and return the longest the caller may sleep
+ * before shard_step(), in ms.
+ */
+int shard_fds(fd_set *rfds, fd_set *wfds, int *maxfd) {
+    struct broker *b;
+    time_t now = time(NULL);
+    int i, ev, ms, wait;
+
+    wait = RETRY * 1000;
+    for (i = 0; i < nshard; i++) {
+        b = &brokers[i];
+        if (b->c.state == MQTT_CLOSED && now >= b->retry) {
+            start(b);
+        }
+        if (b->c.state == MQTT_CLOSED) {
+            continue;
+        }
+        ev = mqtt_events(&b->c);
+        if (ev & MQTT_READ) {
+            FD_SET(mqtt_fd(&b->c), rfds);
+        }
+        if (ev & MQTT_WRITE) {
+            FD_SET(mqtt_fd(&b->c), wfds);
+        }
+        if (mqtt_fd(&b->c) > *maxfd) {
+            *maxfd = mqtt_fd(&b->c);
+        }
+        if ((ms = mqtt_timeout(&b->c)) >= 0 && ms < wait) {
+            wait = ms;
+        }
+    }
+    return wait;
+}
+
+/* Let each connection read, write and ping as select() found it can */
+void shard_step(fd_set *rfds, fd_set *wfds) {
+    struct broker *b;
+    int i, fd;
+
+    for (i = 0; i < nshard; i++) {
+        b = &brokers[i];
+        if (b->c.state == MQTT_CLOSED) {
+            continue;
+        }
+        fd = mqtt_fd(&b->c);
+        if (mqtt_step(&b->c, FD_ISSET(fd, rfds), FD_ISSET(fd, wfds)) < 0) {
+            fprintf(stderr, "Broker %s:%d: %s.\n", b->host, b->port, mqtt_error(&b->c));
+            b->discarded += b->c.tail - b->c.head;
+            mqtt_close(&b->c);
+            b->retry = time(NULL) + RETRY;
+        }
+    }
+}
+
+/*
+ * Give the connections up to ms to send what they hold, then close
+ * them, and say what could not be sent.
+ */
+void shard_close(int ms) {
+    struct timeval tv;
+    fd_set rfds, wfds;
+    double end;
+    int i, maxfd, busy;
+
+    end = now_ms() + ms;
+    do {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        maxfd = -1;
+        busy = 0;
+        for (i = 0; i < nshard; i++) {
+            if (brokers[i].c.state == MQTT_READY && brokers[i].c.tail > brokers[i].c.head) {
+                FD_SET(mqtt_fd(&brokers[i].c), &wfds);
+                if (mqtt_fd(&brokers[i].c) > maxfd) {
+                    maxfd = mqtt_fd(&brokers[i].c);
+                }
+                busy = 1;
+            }
+        }
+        if (!busy) {
+            break;
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        if (select(maxfd + 1, &rfds, &wfds, NULL, &tv) > 0) {
+            shard_step(&rfds, &wfds);
+        }
+    } while (now_ms() < end);
+
+    for (i = 0; i < nshard; i++) {
+        if (brokers[i].c.dropped > 0) {
+            fprintf(stderr, "Broker %s:%d: %ld messages dropped for want of room.\n",
+                    brokers[i].host, brokers[i].port, brokers[i].c.dropped);
+        }
+        if (brokers[i].c.tail > brokers[i].c.head) {
+            fprintf(stderr, "Broker %s:%d: %d bytes left unsent.\n",
+                    brokers[i].host, brokers[i].port, brokers[i].c.tail - brokers[i].c.head);
+        }
+        if (brokers[i].discarded > 0) {
+            fprintf(stderr, "Broker %s:%d: %ld bytes of messages lost when it failed.\n",
+                    brokers[i].host, brokers[i].port, brokers[i].discarded);
+        }
+        mqtt_close(&brokers[i].c);
+    }
+    if (lost > 0) {
+        fprintf(stderr, "%ld messages found no broker up.\n", lost);
+    }
+}
@@ -0,0 +1,325 @@
+/*
+ * spool.c - keep messages on disk while the broker is away (-S file)
+ *
+ * The spool is a ring of records in a file of fixed size, mapped into
+ * memory. A message that cannot be delivered because the broker is
+ * unreachable is appended to it; on the next connection, before
+ * anything new, the spooled messages are sent oldest first in large
+ * writes and then dropped from the ring.
+ *
+ * The first page of the file holds two copies of the header with the
+ * ring's head and tail. They are written in turn, each with a
+ * sequence number and a CRC, and the valid copy with the higher
+ * number wins when the file is opened; a header half written when the
+ * process died is simply ignored. Records are written before the
+ * header that covers them, so a record the header counts is whole.
+ * Each record carries a CRC of its own as well.
+ *
+ * Record: length (4 bytes), CRC-32 (4), "topic\0value", padded to 4.
+ * A length of WRAP says the rest of the ring up to its end is unused.
+ * When the ring is full new messages are refused, so that what is
+ * kept is a run of the time series without holes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mqtt.h"
+
+#define SPOOL_MAGIC 0x4d515331UL        /* "MQS1" */
+#define SPOOL_DATA  4096                /* the ring starts after a page */
+#define WRAP        0xFFFFFFFFUL
+#define RECSIZE(n)  (8 + (((n) + 3) & ~3))
+
+/* One copy of the header */
+struct spool_head {
+    uint32_t magic;
+    uint32_t size;              /* bytes in the ring */
+    uint32_t head;              /* oldest record */
+    uint32_t tail;              /* where the next one goes */
+    uint32_t seq;               /* the newer copy has the higher number */
+    uint32_t crc;               /* of the fields above */
+};
+
+int spooling;                   /* a spool is open (-S) */
+
+static uint8_t *map;            /* the whole file */
+static uint8_t *ring;           /* map + SPOOL_DATA */
+static uint32_t size, head, tail, seq;
+static long mapsize;
+static long refused;
+static uint32_t crc_table[256];
+
+static uint32_t crc32(uint32_t crc, uint8_t *p, long n) {
+    int i, j;
+    uint32_t c;
+
+    if (crc_table[1] == 0) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (j = 0; j < 8; j++) {
+                c = c & 1 ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (n-- > 0) {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t head_crc(struct spool_head *h) {
+    return crc32(0, (uint8_t *)h, (long)((char *)&h->crc - (char *)h));
+}
+
+static uint32_t get32(uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+/* Flush len bytes of the map from p to the disk */
+static void sync_range(uint8_t *p, long len) {
+    long page = getpagesize();
+    long off = (p - map) & ~(page - 1);
+
+    msync((char *)map + off, (p - map) + len - off, MS_SYNC);
+}
+
+/*
+ * Write head and tail into the older copy of the header. The records
+ * must be on the disk first.
+ */
+static void spool_commit(void) {
+    struct spool_head *h;
+
+    seq++;
+    h = (struct spool_head *)map + (seq & 1);
+    h->magic = SPOOL_MAGIC;
+    h->size = size;
+    h->head = head;
+    h->tail = tail;
+    h->seq = seq;
+    h->crc = head_crc(h);
+    sync_range((uint8_t *)h, sizeof(*h));
+}
+
+/*
+ * Open the spool at path, making it with a ring of ring_size bytes if
+ * it does not exist. Returns 0, or -1 on error.
+ */
+int spool_open(char *path, long ring_size) {
+    struct spool_head *h, *best;
+    struct stat st;
+    int fd, i;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    if (st.st_size < SPOOL_DATA + 64) {
+        /* New: a header page and the ring, all zero */
+        mapsize = SPOOL_DATA + (ring_size & ~3L);
+        if (ftruncate(fd, mapsize) != 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    } else {
+        mapsize = st.st_size;
+    }
+    map = (uint8_t *)mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == (uint8_t *)MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    ring = map + SPOOL_DATA;
+
+    best = NULL;
+    for (i = 0; i < 2; i++) {
+        h = (struct spool_head *)map + i;
+        if (h->magic == SPOOL_MAGIC && h->crc == head_crc(h) &&
+            h->size == mapsize - SPOOL_DATA && h->head < h->size && h->tail < h->size &&
+            (best == NULL || h->seq > best->seq)) {
+            best = h;
+        }
+    }
+    size = mapsize - SPOOL_DATA;
+    if (best != NULL) {
+        head = best->head;
+        tail = best->tail;
+        seq = best->seq;
+    } else {
+        head = tail = seq = 0;
+        spool_commit();
+    }
+    spooling = 1;
+    return 0;
+}
+
+/* The number of bytes of records in the ring */
+static uint32_t used(void) {
+    return tail >= head ? tail - head : size - head + tail;
+}
+
+/*
+ * Append "topic value" to the ring; spool_sync() makes it stick.
+ * Returns 0, or -1 if the ring is full.
+ */
+int spool_put(char *topic, char *value) {
+    uint32_t tlen, len, need, at;
+
+    tlen = strlen(topic) + 1;
+    len = tlen + strlen(value) + 1;
+    need = RECSIZE(len);
+
+    /* Keep one byte free, so a full ring is not taken for an empty one */
+    at = tail;
+    if (size - at < need) {
+        if (used() + (size - at) + need >= size) {
+            refused++;
+            return -1;
+        }
+        if (size - at >= 8) {
+            put32(ring + at, WRAP);
+        }
+        at = 0;
+    } else if (used() + need >= size) {
+        refused++;
+        return -1;
+    }
+
+    memcpy(ring + at + 8, topic, tlen);
+    memcpy(ring + at + 8 + tlen, value, len - tlen);
+    put32(ring + at, len);
+    put32(ring + at + 4, crc32(0, ring + at + 8, len));
+    tail = at + need;
+    if (tail == size) {
+        tail = 0;
+    }
+    return 0;
+}
+
+/*
+ * Put what spool_put() appended on the disk, and the header after it.
+ */
+void spool_sync(void) {
+    if (refused > 0) {
+        fprintf(stderr, "Spool full, %ld messages lost.\n", refused);
+        refused = 0;
+    }
+    msync((char *)ring, size, MS_SYNC);
+    spool_commit();
+}
+
+/*
+ * The record at head, with topic and value set, or 0 if the ring is
+ * empty. A damaged record ends the ring there.
+ */
+static uint32_t next_record(char **topic, char **value) {
+    uint32_t len;
+
+    for (;;) {
+        if (head == tail) {
+            return 0;
+        }
+        if (size - head < 8 || get32(ring + head) == WRAP) {
+            head = 0;
+            continue;
+        }
+        len = get32(ring + head);
+        if (len < 2 || RECSIZE(len) > used() || RECSIZE(len) > size - head ||
+            get32(ring + head + 4) != crc32(0, ring + head + 8, len) ||
+            ring[head + 8 + len - 1] != '\0') {
+            fprintf(stderr, "Spool damaged, %lu bytes dropped.\n", (unsigned long)used());
+            head = tail;
+            return 0;
+        }
+        *topic = (char *)ring + head + 8;
+        *value = *topic + strlen(*topic) + 1;
+        return RECSIZE(len);
+    }
+}
+
+/*
+ * Publish everything in the spool on sock, oldest first, in writes of
+ * up to a batch of packets. Each batch leaves the ring once it is
+ * sent, or at QoS 1 and 2 acknowledged. Without a spool there is
+ * nothing to do. Returns 0, or -1 on error.
+ */
+int spool_drain(int sock) {
+    static uint8_t buf[8192];
+    char *topic, *value;
+    uint32_t at, rec;
+    long sent;
+    int len, n;
+
+    if (!spooling) {
+        return 0;
+    }
+    sent = 0;
+    at = head;
+    len = 0;
+    for (;;) {
+        rec = next_record(&topic, &value);
+        if (rec > 0 && len == 0 && qos_full() && qos_room(sock) != 0) {
+            /* What qos_resume() sent again still fills the window */
+            head = at;
+            return -1;
+        }
+        n = -1;
+        if (rec > 0 && !qos_full()) {
+            n = qos_encode(buf + len, sizeof(buf) - len, topic, value, strlen(value));
+        }
+        if (n < 0 && len > 0) {
+            /* The batch is full or the spool is empty: send it, then drop it */
+            if (send_all(sock, buf, len) != 0 ||
+                (qos_pending() > 0 && qos_drain(sock, KEEP_ALIVE * 1000) != 0)) {
+                head = at;
+                return -1;
+            }
+            len = 0;
+            at = head;
+            spool_commit();
+            continue;
+        }
+        if (rec == 0) {
+            break;
+        }
+        if (n < 0) {
+            /* It did not fit an empty buffer with the window open */
+            fprintf(stderr, "Spooled message for %s too long, dropped.\n", topic);
+        } else {
+            len += n;
+            sent++;
+        }
+        head += rec;
+        if (head == size) {
+            head = 0;
+        }
+        if (n < 0) {
+            at = head;
+        }
+    }
+    if (sent > 0) {
+        spool_commit();
+        printf("Published %ld spooled messages.\n", sent);
+    }
+    return 0;
+}
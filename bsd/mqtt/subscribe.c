@@ -0,0 +1,154 @@
+/*
+ * subscribe.c - print the messages on topics we subscribe to (-s)
+ *
+ * Each -s names a topic filter ("pdp11/#", "+/cpu_usage"); the
+ * subscription asks for the QoS given with -q. Every message that
+ * arrives is written to stdout as a "topic payload" line, the same
+ * form the -d and -b modes take in, so a stream can be tapped for
+ * local alerting or piped on to another mqtt. Output is buffered and
+ * flushed once per read from the broker, so a busy stream costs a
+ * write per read rather than per message.
+ *
+ * A PINGREQ goes out every half keep-alive interval, as nothing else
+ * does; with no answer within the interval the broker is gone.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "mqtt.h"
+
+static long received;
+static volatile int stop;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static void print_message(char *topic, int topic_length, uint8_t *payload, long length) {
+    fwrite(topic, 1, topic_length, stdout);
+    putchar(' ');
+    fwrite(payload, 1, length, stdout);
+    putchar('\n');
+    received++;
+}
+
+/*
+ * Send a SUBSCRIBE for the n filters. Returns 0, or -1 on error.
+ */
+static int send_subscribe(int sock, char **filters, int n) {
+    uint8_t *packet;
+    uint8_t remaining_length_encoded[4];
+    int remaining_length, rl_len, index, len, i, rc;
+
+    remaining_length = version == 5 ? 3 : 2;
+    for (i = 0; i < n; i++) {
+        remaining_length += 2 + strlen(filters[i]) + 1;
+    }
+    packet = (uint8_t *)malloc(5 + remaining_length);
+    if (packet == NULL) {
+        fprintf(stderr, "Cannot allocate a SUBSCRIBE packet.\n");
+        return -1;
+    }
+
+    /* Fixed Header */
+    index = 0;
+    packet[index++] = 0x82; /* SUBSCRIBE, flags 0010 */
+    rl_len = encode_remaining_length(remaining_length, remaining_length_encoded);
+    memcpy(&packet[index], remaining_length_encoded, rl_len);
+    index += rl_len;
+
+    /* Packet Identifier */
+    packet[index++] = 0x00;
+    packet[index++] = 0x01;
+
+    /* Properties (MQTT 5): none */
+    if (version == 5) {
+        packet[index++] = 0x00;
+    }
+
+    /* Topic Filters, each with the QoS asked for */
+    for (i = 0; i < n; i++) {
+        len = strlen(filters[i]);
+        packet[index++] = (len >> 8) & 0xFF;
+        packet[index++] = len & 0xFF;
+        memcpy(&packet[index], filters[i], len);
+        index += len;
+        packet[index++] = qos;
+    }
+
+    rc = send_all(sock, packet, index);
+    free(packet);
+    return rc;
+}
+
+/*
+ * Subscribe to the n filters and print what arrives until SIGINT or
+ * SIGTERM. Returns 0, or -1 on error.
+ */
+int run_subscribe(int sock, char **filters, int n) {
+    static char out[65536];
+    struct timeval tv;
+    fd_set rfds;
+    double last, ping_sent, now, due;    /* last: when we last sent */
+    int got;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+    if (send_subscribe(sock, filters, n) != 0) {
+        return -1;
+    }
+    on_publish = print_message;
+
+    last = now_ms();
+    ping_sent = 0;
+    while (!stop) {
+        now = now_ms();
+        due = ping_sent > 0 ? ping_sent + KEEP_ALIVE * 1000.0 : last + KEEP_ALIVE * 500.0;
+        if (due < now) {
+            due = now;
+        }
+        tv.tv_sec = (long)(due - now) / 1000;
+        tv.tv_usec = ((long)(due - now) % 1000) * 1000;
+        FD_ZERO(&rfds);
+        FD_SET(sock, &rfds);
+        if (select(sock + 1, &rfds, NULL, NULL, &tv) > 0) {
+            got = read_broker(sock);
+            if (got < 0) {
+                fflush(stdout);
+                fprintf(stderr, "Connection to MQTT broker lost.\n");
+                return -1;
+            }
+            if (got & GOT_PINGRESP) {
+                ping_sent = 0;
+            }
+            if (fflush(stdout) == EOF) {
+                return -1;      /* the reader went away */
+            }
+        }
+
+        now = now_ms();
+        if (ping_sent > 0 && now - ping_sent >= KEEP_ALIVE * 1000.0) {
+            fprintf(stderr, "No PINGRESP from MQTT broker.\n");
+            return -1;
+        }
+        if (ping_sent == 0 && now - last >= KEEP_ALIVE * 500.0) {
+            if (send_pingreq(sock) != 0) {
+                return -1;
+            }
+            ping_sent = last = now;
+        }
+    }
+    fprintf(stderr, "Received %ld messages.\n", received);
+    return 0;
+}
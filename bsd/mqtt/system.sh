@@ -1,7 +1,7 @@
 #!/bin/sh
 
 # Define MQTT server details
-MQTT_BROKER="192.168.1.194" # Replace with your MQTT broker address
+MQTT_BROKER=${MQTT_BROKER-localhost} # Replace with your MQTT broker address
 MQTT_USERNAME="MQTT"        # Replace with your MQTT username, if required
 MQTT_PASSWORD="asdasdasd"   # Replace with your MQTT password, if required
 MQTT_TOPIC_PREFIX="pdp11"   # Prefix for MQTT topics
@@ -79,7 +79,7 @@ echo "Publishing: CPU Usage Idle ($ID) to topic pdp11/cpu_usage_idle"
 mqtt -h "$MQTT_BROKER" -u "$MQTT_USERNAME" -p "$MQTT_PASSWORD" -t "$MQTT_TOPIC_PREFIX/cpu_usage" -v "$CPU_USAGE"#!/bin/sh
 
 # Define MQTT server details
-MQTT_BROKER="192.168.1.194" # Replace with your MQTT broker address
+MQTT_BROKER=${MQTT_BROKER-localhost} # Replace with your MQTT broker address
 MQTT_USERNAME="MQTT"        # Replace with your MQTT username, if required
 MQTT_PASSWORD="Smone2326"   # Replace with your MQTT password, if required
 MQTT_TOPIC_PREFIX="pdp11"   # Prefix for MQTT topics
@@ -0,0 +1,284 @@
+/*
+ * cache.c - conditional fetches for repeated runs (-C index)
+ *
+ * The index file has a line for each URL that was fetched into a file:
+ *
+ *      url size mtime crc etag<TAB>last-modified
+ *
+ * When a URL in the index is asked for again and its file is still on
+ * disk as it was left, the request carries "If-None-Match:" and
+ * "If-Modified-Since:" with the saved validators. A 304 answer then
+ * leaves the file alone, and only the two headers cross the wire.
+ *
+ * The file's size is checked on every run. If its modification time
+ * has moved as well, its CRC-32 is worked out again and must match
+ * the saved one; a copy touched but not changed still counts.
+ *
+ * The index is read in whole on first use and written back, by way
+ * of a temporary file and rename(), by chsave() at exit.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wget.h"
+
+#define LINESIZE (BUFSIZE + 256)
+
+/* What the index knows about one URL */
+struct centry {
+    unsigned long hash;
+    long size, mtime;
+    unsigned long crc;
+    char *etag;         /* "" if none */
+    char *lastmod;
+    char url[1];        /* the rest of the block */
+};
+
+char *cachefile;            /* -C: the index, 0 if not caching */
+
+static struct centry **ctab;
+static unsigned csize, cused;
+static int loaded, dirty;
+
+/* FNV-1a */
+static unsigned long hashkey(p)
+char *p;
+{
+    unsigned long h = 2166136261UL;
+
+    while (*p) {
+        h ^= (unsigned char)*p++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static void cgrow()
+{
+    struct centry **old;
+    unsigned osize, i, j;
+
+    old = ctab;
+    osize = csize;
+    csize = osize ? osize * 2 : 1024;
+    ctab = (struct centry **)calloc(csize, sizeof(struct centry *));
+    if (!ctab) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < osize; i++) {
+        if (!old[i])
+            continue;
+        j = old[i]->hash & (csize - 1);
+        while (ctab[j])
+            j = (j + 1) & (csize - 1);
+        ctab[j] = old[i];
+    }
+    free((char *)old);
+}
+
+/* The slot for url: holding its entry, or empty */
+static struct centry **slot(url, h)
+char *url;
+unsigned long h;
+{
+    unsigned i;
+
+    if ((cused + 1) * 2 > csize)
+        cgrow();
+    i = h & (csize - 1);
+    while (ctab[i] && (ctab[i]->hash != h || strcmp(ctab[i]->url, url)))
+        i = (i + 1) & (csize - 1);
+    return &ctab[i];
+}
+
+/* Enter url in the index, replacing what was there */
+static void cput(url, size, mtime, crc, etag, lastmod)
+char *url;
+long size, mtime;
+unsigned long crc;
+char *etag, *lastmod;
+{
+    struct centry *e, **s;
+    unsigned long h;
+    int n;
+
+    n = sizeof(struct centry) + strlen(url) + strlen(etag) +
+        strlen(lastmod) + 2;
+    if (!(e = (struct centry *)malloc(n)))
+        return;
+    e->hash = h = hashkey(url);
+    e->size = size;
+    e->mtime = mtime;
+    e->crc = crc;
+    strcpy(e->url, url);
+    e->etag = e->url + strlen(url) + 1;
+    strcpy(e->etag, etag);
+    e->lastmod = e->etag + strlen(etag) + 1;
+    strcpy(e->lastmod, lastmod);
+
+    s = slot(url, h);
+    if (*s)
+        free((char *)*s);
+    else
+        cused++;
+    *s = e;
+}
+
+static void cload()
+{
+    char line[LINESIZE], url[LINESIZE], *v, *t;
+    long size, mtime;
+    unsigned long crc;
+    int n;
+    FILE *fp;
+
+    loaded = 1;
+    if (!(fp = fopen(cachefile, "r")))
+        return;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%s %ld %ld %lx %n", url, &size, &mtime, &crc,
+                   &n) < 4)
+            continue;
+        v = line + n;
+        if (!(t = strchr(v, '\t')))
+            continue;
+        *t++ = '\0';
+        /* No response has validators this long: the line is corrupt */
+        if (strlen(v) >= 128 || strlen(t) >= 64)
+            continue;
+        cput(url, size, mtime, crc, v, t);
+    }
+    fclose(fp);
+}
+
+static struct centry *cfind(url)
+char *url;
+{
+    if (!loaded)
+        cload();
+    if (!csize)
+        return (struct centry *)0;
+    return *slot(url, hashkey(url));
+}
+
+/* CRC-32 of the whole of file, or 0 if it cannot be read */
+static unsigned long filecrc(file)
+char *file;
+{
+    char buf[8192];
+    unsigned long crc;
+    int fd, n;
+
+    if ((fd = open(file, O_RDONLY)) < 0)
+        return 0;
+    crc = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        crc = zcrc(crc, buf, n);
+    close(fd);
+    return n < 0 ? 0 : crc;
+}
+
+/* Put the index key for host:port/path into key (BUFSIZE bytes) */
+void chkey(key, host, port, path)
+char *key, *host;
+int port;
+char *path;
+{
+    char *p;
+
+    sprintf(key, "http://%.255s:%d%.*s", host, port, BUFSIZE - 280, path);
+    for (p = key + 7; *p != ':'; p++)
+        *p |= 0x20;     /* host names are case blind */
+}
+
+/*
+ * If the index has url and file is still as it was fetched, add the
+ * conditional headers to extra, which must hold RSEXTRA bytes.
+ */
+void chprep(url, file, extra)
+char *url, *file, *extra;
+{
+    struct centry *e;
+    struct stat st;
+    char *p;
+
+    if (!cachefile || !(e = cfind(url)) || (!e->etag[0] && !e->lastmod[0]))
+        return;
+    if (stat(file, &st) < 0 || (long)st.st_size != e->size)
+        return;
+    if ((long)st.st_mtime != e->mtime) {
+        if (filecrc(file) != e->crc)
+            return;
+        /* Same bytes: save the new time to spare the next check */
+        e->mtime = (long)st.st_mtime;
+        dirty = 1;
+    }
+    p = extra + strlen(extra);
+    if (e->etag[0]) {
+        sprintf(p, "If-None-Match: %.127s\r\n", e->etag);
+        p += strlen(p);
+    }
+    if (e->lastmod[0])
+        sprintf(p, "If-Modified-Since: %.63s\r\n", e->lastmod);
+}
+
+/*
+ * The body of r for url is complete in file: index it, or, if the
+ * response had no validators, forget what was known about it.
+ */
+void chdone(url, file, r)
+char *url, *file;
+struct resp *r;
+{
+    struct stat st;
+
+    if (!cachefile)
+        return;
+    if (!loaded)
+        cload();
+    if (!r->etag[0] && !r->lastmod[0]) {
+        if (cfind(url))
+            cput(url, 0L, 0L, 0UL, "", "");
+    } else if (stat(file, &st) == 0)
+        cput(url, (long)st.st_size, (long)st.st_mtime, filecrc(file),
+             r->etag, r->lastmod);
+    dirty = 1;
+}
+
+/* Write the index back if it changed; returns 0 or -1 */
+int chsave()
+{
+    char tmp[PATHSIZE];
+    struct centry *e;
+    unsigned i;
+    FILE *fp;
+
+    if (!cachefile || !dirty)
+        return 0;
+    sprintf(tmp, "%.*s.tmp", PATHSIZE - 5, cachefile);
+    if (!(fp = fopen(tmp, "w"))) {
+        perror(tmp);
+        return -1;
+    }
+    for (i = 0; i < csize; i++)
+        if ((e = ctab[i]) && (e->etag[0] || e->lastmod[0]))
+            fprintf(fp, "%s %ld %ld %lx %s\t%s\n", e->url, e->size,
+                    e->mtime, e->crc, e->etag, e->lastmod);
+    if (fclose(fp) == EOF || rename(tmp, cachefile) < 0) {
+        perror(cachefile);
+        unlink(tmp);
+        return -1;
+    }
+    dirty = 0;
+    return 0;
+}
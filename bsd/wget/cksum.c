@@ -0,0 +1,322 @@
+/*
+ * cksum.c - checksums worked out as the body streams in (-V, -M)
+ *
+ * The decoded body is run through CRC-32 (the table from rzsz) or
+ * SHA-256 on its way to the file, so a download is verified without
+ * reading it back. The expected sum comes from -V, for the one file
+ * of a single fetch, or from a manifest (-M) of "sum  name" lines as
+ * written by sha256sum or crc32; an 8 digit sum is a CRC-32, a 64
+ * digit one a SHA-256. -V crc32 or -V sha256 just prints the sum.
+ *
+ * A body being summed is not spliced (see sink.c): its bytes have to
+ * pass through here. A resumed file is summed from its start, so the
+ * part already on disk is read once before the rest arrives.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wget.h"
+
+#define M32 0xffffffffUL
+#define ROR(x, n) (((x) >> (n) | (x) << (32 - (n))) & M32)
+
+/* One manifest line */
+struct msum {
+    char *name;
+    char sum[65];
+    struct msum *next;
+};
+
+static char *vsum;              /* -V */
+static struct msum **mtab;      /* -M, hashed on the name */
+static unsigned msize;
+
+static unsigned long k256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Run one 64 byte block through the SHA-256 state */
+static void shablock(k, p)
+struct cksum *k;
+unsigned char *p;
+{
+    unsigned long w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++, p += 4)
+        w[i] = (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16 |
+               (unsigned long)p[2] << 8 | p[3];
+    for (; i < 64; i++) {
+        t1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10;
+        t2 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3;
+        w[i] = (t1 + w[i - 7] + t2 + w[i - 16]) & M32;
+    }
+    a = k->h[0]; b = k->h[1]; c = k->h[2]; d = k->h[3];
+    e = k->h[4]; f = k->h[5]; g = k->h[6]; h = k->h[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+             ((e & f) ^ (~e & g)) + k256[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+             ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = (d + t1) & M32;
+        d = c;
+        c = b;
+        b = a;
+        a = (t1 + t2) & M32;
+    }
+    k->h[0] = (k->h[0] + a) & M32; k->h[1] = (k->h[1] + b) & M32;
+    k->h[2] = (k->h[2] + c) & M32; k->h[3] = (k->h[3] + d) & M32;
+    k->h[4] = (k->h[4] + e) & M32; k->h[5] = (k->h[5] + f) & M32;
+    k->h[6] = (k->h[6] + g) & M32; k->h[7] = (k->h[7] + h) & M32;
+}
+
+/* Add n bytes of the body to the sum */
+void ckfeed(k, buf, n)
+struct cksum *k;
+char *buf;
+int n;
+{
+    unsigned char *p;
+    int m;
+
+    k->lo = (k->lo + n) & M32;
+    if (k->lo < (unsigned long)n)
+        k->hi++;
+    if (k->type == CK_CRC) {
+        k->crc = zcrc(k->crc, buf, n);
+        return;
+    }
+    p = (unsigned char *)buf;
+    if (k->nblk > 0) {
+        m = 64 - k->nblk < n ? 64 - k->nblk : n;
+        bcopy((char *)p, (char *)k->blk + k->nblk, m);
+        k->nblk += m;
+        p += m;
+        n -= m;
+        if (k->nblk < 64)
+            return;
+        shablock(k, k->blk);
+        k->nblk = 0;
+    }
+    for (; n >= 64; p += 64, n -= 64)
+        shablock(k, p);
+    bcopy((char *)p, (char *)k->blk, n);
+    k->nblk = n;
+}
+
+/* Finish the sum and put it in hex into out */
+static void ckhex(k, out)
+struct cksum *k;
+char *out;
+{
+    unsigned char pad[72];
+    unsigned long hi, lo;
+    int i, n;
+
+    if (k->type == CK_CRC) {
+        sprintf(out, "%08lx", k->crc);
+        return;
+    }
+    /* A 1 bit, zeros to 56 mod 64, the length in bits */
+    hi = (k->hi << 3 | k->lo >> 29) & M32;
+    lo = k->lo << 3 & M32;
+    n = (k->nblk < 56 ? 56 : 120) - k->nblk;
+    bzero((char *)pad, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 4; i++) {
+        pad[n + i] = hi >> (24 - 8 * i) & 0xff;
+        pad[n + 4 + i] = lo >> (24 - 8 * i) & 0xff;
+    }
+    ckfeed(k, (char *)pad, n + 8);
+    for (i = 0; i < 8; i++)
+        sprintf(out + 8 * i, "%08lx", k->h[i]);
+}
+
+/* Is s a sum: 8 or 64 hex digits? Returns its type, or 0 */
+static int sumtype(s, n)
+char *s;
+int n;
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (!isxdigit((unsigned char)s[i]))
+            return 0;
+    return n == 8 ? CK_CRC : n == 64 ? CK_SHA : 0;
+}
+
+/* -V sum: returns 0, or -1 if sum is not a sum or a sum's name */
+int ckset(s)
+char *s;
+{
+    if (strcmp(s, "crc32") && strcmp(s, "sha256") &&
+        !sumtype(s, strlen(s)))
+        return -1;
+    vsum = s;
+    return 0;
+}
+
+static unsigned namehash(s)
+char *s;
+{
+    unsigned h;
+
+    for (h = 0; *s; s++)
+        h = h * 31 + (unsigned char)*s;
+    return h;
+}
+
+/* -M file: read the manifest; returns 0, or -1 after an error message */
+int ckload(file)
+char *file;
+{
+    char line[PATHSIZE + 80], *s, *e;
+    struct msum *m, *list;
+    unsigned n, h;
+    FILE *fp;
+
+    if (!(fp = fopen(file, "r"))) {
+        perror(file);
+        return -1;
+    }
+    list = (struct msum *)0;
+    n = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        e = line + strcspn(line, " \t");
+        s = e + strspn(e, " \t");
+        if (*s == '*')
+            s++;        /* sha256sum's binary mode mark */
+        if (!sumtype(line, e - line) || !*s)
+            continue;
+        m = (struct msum *)malloc(sizeof(struct msum) + strlen(s) + 1);
+        if (!m) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+        bcopy(line, m->sum, e - line);
+        m->sum[e - line] = '\0';
+        m->name = (char *)(m + 1);
+        strcpy(m->name, s);
+        m->next = list;
+        list = m;
+        n++;
+    }
+    fclose(fp);
+
+    for (msize = 64; msize < n; msize *= 2)
+        ;
+    mtab = (struct msum **)calloc(msize, sizeof(struct msum *));
+    if (!mtab) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    while ((m = list)) {
+        list = m->next;
+        h = namehash(m->name) & (msize - 1);
+        m->next = mtab[h];
+        mtab[h] = m;
+    }
+    return 0;
+}
+
+/* The expected sum for file name, or a sum's name, or 0 */
+static char *wanted(name)
+char *name;
+{
+    struct msum *m;
+
+    if (vsum)
+        return vsum;
+    if (!mtab || !name)
+        return (char *)0;
+    for (m = mtab[namehash(name) & (msize - 1)]; m; m = m->next)
+        if (!strcmp(m->name, name))
+            return m->sum;
+    return (char *)0;
+}
+
+/*
+ * Set k up for the body of file name (0 for stdout), which already
+ * has have bytes on disk (-1: all of it). Returns k, or 0 if there is
+ * nothing to check for it.
+ */
+struct cksum *ckprep(k, name, have)
+struct cksum *k;
+char *name;
+long have;
+{
+    char buf[8192], *s;
+    long done;
+    int fd, n;
+
+    if (!(s = wanted(name)))
+        return (struct cksum *)0;
+    k->want = s;
+    k->type = !strcmp(s, "crc32") ? CK_CRC : !strcmp(s, "sha256") ?
+              CK_SHA : sumtype(s, strlen(s));
+    k->crc = 0;
+    k->h[0] = 0x6a09e667; k->h[1] = 0xbb67ae85;
+    k->h[2] = 0x3c6ef372; k->h[3] = 0xa54ff53a;
+    k->h[4] = 0x510e527f; k->h[5] = 0x9b05688c;
+    k->h[6] = 0x1f83d9ab; k->h[7] = 0x5be0cd19;
+    k->lo = k->hi = 0;
+    k->nblk = 0;
+    if (have == 0 || !name)
+        return k;
+
+    /* Sum what is on disk already */
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return k;
+    for (done = 0; have < 0 || done < have; done += n) {
+        n = have < 0 || have - done > sizeof(buf) ? sizeof(buf) :
+            (int)(have - done);
+        if ((n = read(fd, buf, n)) <= 0)
+            break;
+        ckfeed(k, buf, n);
+    }
+    close(fd);
+    return k;
+}
+
+/* The body summed in k is complete: returns 0 if its sum is right */
+int ckdone(k, name)
+struct cksum *k;
+char *name;
+{
+    char sum[65];
+
+    ckhex(k, sum);
+    if (!sumtype(k->want, strlen(k->want))) {
+        /* -V crc32 or -V sha256: just say what it is */
+        fprintf(stderr, "%s  %s\n", sum, name ? name : "-");
+        return 0;
+    }
+    if (strcasecmp(sum, k->want) == 0)
+        return 0;
+    fprintf(stderr, "Error: %s: %s mismatch: got %s, expected %s\n",
+            name ? name : "(stdout)", k->type == CK_CRC ? "CRC-32" :
+            "SHA-256", sum, k->want);
+    return -1;
+}
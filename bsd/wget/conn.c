@@ -0,0 +1,156 @@
+/*
+ * conn.c - buffered connections for kept-alive HTTP/1.1
+ *
+ * A kept-alive or pipelined connection delivers responses back to
+ * back, so reads go through a per-connection buffer and each body is
+ * cut out of the stream by the response parser (see http.c) following
+ * its framing: Content-Length, chunked, or (for a connection that is
+ * closing anyway) everything up to EOF.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wget.h"
+
+/* Connect c to its address; returns 0 or -1. */
+int copen(c)
+struct conn *c;
+{
+    c->rpos = c->rlen = 0;
+    c->sock = dial(&c->sa, 0);
+    return c->sock < 0 ? -1 : 0;
+}
+
+void cclose(c)
+struct conn *c;
+{
+    if (c->sock >= 0)
+        close(c->sock);
+    c->sock = -1;
+    c->rpos = c->rlen = 0;
+}
+
+/* Refill the empty buffer; returns bytes read, 0 at EOF, -1 on error. */
+static int cfill(c)
+struct conn *c;
+{
+    int n;
+
+    c->rpos = 0;
+    n = read(c->sock, c->buf, CONNBUF);
+    c->rlen = n > 0 ? n : 0;
+    return n;
+}
+
+/* Read one line, without its CR LF, into line; returns length or -1. */
+static int cgetline(c, line, size)
+struct conn *c;
+char *line;
+int size;
+{
+    int n;
+    char ch;
+
+    n = 0;
+    for (;;) {
+        if (c->rpos == c->rlen && cfill(c) <= 0)
+            return -1;
+        ch = c->buf[c->rpos++];
+        if (ch == '\n')
+            break;
+        if (n < size - 1)
+            line[n++] = ch;
+    }
+    if (n > 0 && line[n - 1] == '\r')
+        n--;
+    line[n] = '\0';
+    return n;
+}
+
+/*
+ * Read a response header into hdr, including the blank line, and
+ * NUL-terminate it. Returns its length, 0 if the connection was closed
+ * before a response began, or -1 on error or overflow.
+ */
+int cgethdr(c, hdr, size)
+struct conn *c;
+char *hdr;
+int size;
+{
+    int n, len;
+
+    if (c->rpos == c->rlen && (n = cfill(c)) <= 0)
+        return n;
+    len = 0;
+    for (;;) {
+        if (len + 3 >= size)
+            return -1;
+        n = cgetline(c, hdr + len, size - len - 2);
+        if (n < 0)
+            return -1;
+        /* Tolerate stray blank lines between pipelined responses */
+        if (n == 0 && len == 0)
+            continue;
+        len += n;
+        hdr[len++] = '\r';
+        hdr[len++] = '\n';
+        if (n == 0)
+            break;
+    }
+    hdr[len] = '\0';
+    return len;
+}
+
+/* Sink for cbody(): write to the descriptor at arg, unless it is -1 */
+static int fdsink(arg, buf, n)
+char *arg;
+char *buf;
+int n;
+{
+    int fd;
+
+    fd = *(int *)arg;
+    return fd >= 0 ? writeall(fd, buf, n) : 0;
+}
+
+/*
+ * Copy the body of the response in h, whose header has been read and
+ * hpbody() started, to fd (-1 discards it). Returns the body length
+ * as sent, or -1 on error; afterwards c is positioned at the next
+ * response, unless h->r.keep is clear.
+ */
+long cbody(c, h, fd)
+struct conn *c;
+struct hparse *h;
+int fd;
+{
+    long n;
+
+    while (h->state != HP_DONE) {
+        if (c->rpos == c->rlen && h->state == HP_BODY && !h->r.gzip &&
+            !h->ck && fd >= 0) {
+            /* Nothing buffered: the rest can go straight to fd */
+            if ((n = skcopy(c->sock, fd, h->left)) < 0)
+                return -1;
+            h->body += n;
+            if (h->left >= 0 && (h->left -= n) > 0)
+                return -1;
+            h->state = HP_DONE;
+            break;
+        }
+        if (c->rpos == c->rlen && (n = cfill(c)) <= 0)
+            return n == 0 && hpeof(h) == 0 ? h->body : -1;
+        n = hpfeed(h, c->buf + c->rpos, c->rlen - c->rpos, fdsink,
+                   (char *)&fd);
+        if (n < 0)
+            return -1;
+        c->rpos += n;
+    }
+    return h->body;
+}
@@ -0,0 +1,590 @@
+/*
+ * crawl.c - recursive mirror of a web site (-r)
+ *
+ * Starting from the URLs given, every HTML page is scanned for links
+ * while its body streams in. Links that stay on the starting hosts
+ * are resolved against the page, put in a canonical form and looked
+ * up in the set of URLs already seen; new ones go straight to the
+ * mass engine (mass.c), which fetches them concurrently, breadth
+ * first, within its per host limits. Each page is saved as
+ * host/path under the current directory.
+ *
+ * The seen set is an open hash table of the URLs. For very large
+ * crawls -B gives a Bloom filter of that many kilobytes instead:
+ * memory stays fixed, at the price of now and then skipping a page
+ * that was never fetched.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wget.h"
+
+#define MAXLINK (BUFSIZE - 128)     /* longest path mkreq() takes */
+#define NBLOOM  4                   /* Bloom filter probes */
+
+/* Link scanner states */
+#define L_TEXT 0
+#define L_OPEN 1            /* just after '<' */
+#define L_BANG 2            /* after "<!", perhaps a comment */
+#define L_CMT  3            /* inside <!-- --> */
+#define L_TAG  4            /* between attributes */
+#define L_NAME 5            /* tag or attribute name */
+#define L_EQ   6            /* after a name, looking for '=' */
+#define L_VAL0 7            /* after '=' */
+#define L_VAL  8            /* attribute value */
+
+struct scan {
+    int state;
+    int quote;              /* quote ending the value, 0 if unquoted */
+    int dash;               /* '-' in a row, in a comment */
+    int nlen, vlen;
+    char name[8];
+    char val[MAXLINK];
+};
+
+struct skey {
+    unsigned long hash;
+    unsigned klen;
+    char *key;
+};
+
+static struct url *seeds;
+static int nseed, maxdep;
+
+/* The set of URLs seen: a hash table, or a Bloom filter */
+static struct skey *stab;
+static unsigned ssize, sused;
+static char *arena;
+static unsigned aleft;
+static unsigned char *bloom;
+static unsigned long bloombits;
+
+static long npage, nlink, nnew;
+static char lastdir[PATHSIZE];
+
+static void *xalloc(n)
+unsigned n;
+{
+    void *p;
+
+    p = calloc(1, n);
+    if (!p) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* FNV-1a */
+static unsigned long hashkey(p, n)
+char *p;
+unsigned n;
+{
+    unsigned long h = 2166136261UL;
+
+    while (n--) {
+        h ^= (unsigned char)*p++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static void sgrow()
+{
+    struct skey *old;
+    unsigned osize, i, j;
+
+    old = stab;
+    osize = ssize;
+    ssize = osize ? osize * 2 : 4096;
+    stab = (struct skey *)xalloc(ssize * sizeof(struct skey));
+    for (i = 0; i < osize; i++) {
+        if (!old[i].key)
+            continue;
+        j = old[i].hash & (ssize - 1);
+        while (stab[j].key)
+            j = (j + 1) & (ssize - 1);
+        stab[j] = old[i];
+    }
+    free((char *)old);
+}
+
+/* Add key to the seen set; returns 1 if it was new */
+static int seen(key, klen)
+char *key;
+unsigned klen;
+{
+    unsigned long h, h2, b;
+    unsigned i;
+    int isnew;
+    struct skey *e;
+
+    h = hashkey(key, klen);
+    if (bloom) {
+        /* Double hashing: probe i is h + i * h2 */
+        h2 = (h >> 16 | h << 16) * 2654435761UL | 1;
+        isnew = 0;
+        for (i = 0; i < NBLOOM; i++) {
+            b = (h + i * h2) % bloombits;
+            if (!(bloom[b >> 3] & 1 << (b & 7))) {
+                bloom[b >> 3] |= 1 << (b & 7);
+                isnew = 1;
+            }
+        }
+        return isnew;
+    }
+
+    if ((sused + 1) * 2 > ssize)
+        sgrow();
+    i = h & (ssize - 1);
+    for (;;) {
+        e = &stab[i];
+        if (!e->key)
+            break;
+        if (e->hash == h && e->klen == klen && !memcmp(e->key, key, klen))
+            return 0;
+        i = (i + 1) & (ssize - 1);
+    }
+    if (klen + 1 > aleft) {
+        aleft = klen + 1 > 32768 ? klen + 1 : 32768;
+        arena = (char *)xalloc(aleft);
+    }
+    e->key = arena;
+    bcopy(key, e->key, klen);
+    arena += klen + 1;
+    aleft -= klen + 1;
+    e->klen = klen;
+    e->hash = h;
+    sused++;
+    return 1;
+}
+
+/* The seen set key for host:port/path; returns its length */
+static int urlkey(key, host, port, path)
+char *key, *host;
+int port;
+char *path;
+{
+    char *p;
+
+    sprintf(key, "%.255s:%d%s", host, port, path);
+    for (p = key; *p != ':'; p++)
+        *p |= 0x20;     /* host names are case blind */
+    return strlen(key);
+}
+
+/* Make the directories leading to file */
+static void mkdirs(file)
+char *file;
+{
+    char *p;
+    int n;
+
+    p = strrchr(file, '/');
+    if (!p)
+        return;
+    n = p - file;
+    /* Pages come in bunches from one directory */
+    if (!strncmp(lastdir, file, n) && lastdir[n] == '\0')
+        return;
+    for (p = strchr(file, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(file, 0755) < 0 && errno != EEXIST)
+            perror(file);
+        *p = '/';
+    }
+    if (n < sizeof(lastdir)) {
+        bcopy(file, lastdir, n);
+        lastdir[n] = '\0';
+    }
+}
+
+/* Local name of host:port/path: host[:port]/path, index.html for a directory */
+static int localname(name, host, port, path)
+char *name, *host;
+int port;
+char *path;
+{
+    char *p;
+    int n;
+
+    if (port != 80)
+        sprintf(name, "%s:%d", host, port);
+    else
+        strcpy(name, host);
+    n = strlen(name);
+    if (n + strlen(path) + 11 > PATHSIZE)
+        return -1;
+    strcpy(name + n, path);
+    for (p = name + n; *p; p++)
+        if (*p == '?')
+            *p = '@';
+    if (p[-1] == '/')
+        strcpy(p, "index.html");
+    return 0;
+}
+
+/* Remove "." and ".." segments from the path part of p, in place */
+static void cleanpath(p)
+char *p;
+{
+    char *r, *w, *q;
+    int n;
+
+    q = p + strcspn(p, "?");
+    r = w = p;
+    while (r < q) {
+        /* r is at a '/'; the segment runs to the next one */
+        n = 1;
+        while (r + n < q && r[n] != '/')
+            n++;
+        if (n == 2 && r[1] == '.') {
+            if (r + n == q)
+                *w++ = '/';
+        } else if (n == 3 && r[1] == '.' && r[2] == '.') {
+            while (w > p && *--w != '/')
+                ;
+            if (r + n == q)
+                *w++ = '/';
+        } else {
+            if (w != r)
+                memmove(w, r, n);
+            w += n;
+        }
+        r += n;
+    }
+    if (w == p)
+        *w++ = '/';
+    if (w != q)
+        memmove(w, q, strlen(q) + 1);
+}
+
+/*
+ * Resolve link, found on page base, into an absolute path in path.
+ * Returns the starting URL whose host it is on, or 0 if it leads off
+ * those hosts or is not an http link at all.
+ */
+static struct url *resolve(base, link, path)
+struct url *base;
+char *link, *path;
+{
+    struct url *s;
+    char *h, *p, *q;
+    int n, hlen, port;
+
+    n = strspn(link, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+.-");
+    if (link[n] == ':' || !strncmp(link, "//", 2)) {
+        if (link[n] == ':') {
+            if (n != 4 || strncasecmp(link, "http", 4))
+                return (struct url *)0;
+            link += 5;
+        }
+        if (strncmp(link, "//", 2))
+            return (struct url *)0;
+        h = link + 2;
+        hlen = strcspn(h, ":/?");
+        p = h + hlen;
+        port = 80;
+        if (*p == ':') {
+            port = atoi(p + 1);
+            p += 1 + strspn(p + 1, "0123456789");
+        }
+        for (s = seeds; s < seeds + nseed; s++)
+            if (s->port == port && strlen(s->host) == hlen &&
+                !strncasecmp(s->host, h, hlen))
+                break;
+        if (s == seeds + nseed)
+            return (struct url *)0;
+        if (strlen(p) + 2 > MAXLINK)
+            return (struct url *)0;
+        if (*p != '/')
+            *path++ = '/';
+        strcpy(path, p);
+    } else {
+        /* On the page's own host */
+        for (s = seeds; s < seeds + nseed; s++)
+            if (s->port == base->port && !strcasecmp(s->host, base->host))
+                break;
+        if (s == seeds + nseed)
+            return (struct url *)0;
+        if (*link == '/')
+            n = 0;
+        else {
+            q = base->path + strcspn(base->path, "?");
+            if (*link != '?')
+                while (q > base->path && q[-1] != '/')
+                    q--;
+            n = q - base->path;
+        }
+        if (n + strlen(link) + 1 > MAXLINK)
+            return (struct url *)0;
+        bcopy(base->path, path, n);
+        strcpy(path + n, link);
+    }
+    cleanpath(path);
+    return s;
+}
+
+/* Queue link from page base, at the given depth, unless seen before */
+static void addlink(base, link, depth)
+struct url *base;
+char *link;
+int depth;
+{
+    char path[MAXLINK], key[MAXLINK + 300], name[PATHSIZE];
+    struct url *s, *u;
+    char *p, *q;
+    int n;
+
+    /* Undo "&amp;", and drop the fragment */
+    for (p = q = link; *p; p++) {
+        *q++ = *p;
+        if (!strncmp(p, "&amp;", 5))
+            p += 4;
+    }
+    *q = '\0';
+    link[strcspn(link, "#")] = '\0';
+    if (*link == '\0')
+        return;
+    nlink++;
+
+    s = resolve(base, link, path);
+    if (!s)
+        return;
+    if (!seen(key, (unsigned)urlkey(key, s->host, s->port, path)))
+        return;
+    if (localname(name, s->host, s->port, path) < 0)
+        return;
+
+    /* The URL and its strings in one block, freed by pgdone() */
+    n = sizeof(struct url) + strlen(path) + 1 + strlen(name) + 1;
+    u = (struct url *)xalloc((unsigned)n);
+    u->host = s->host;
+    u->port = s->port;
+    u->path = (char *)(u + 1);
+    strcpy(u->path, path);
+    u->file = u->path + strlen(path) + 1;
+    strcpy(u->file, name);
+    u->depth = depth;
+    mkdirs(u->file);
+    nnew++;
+    massadd(u);
+}
+
+/* Feed n bytes of u's HTML to its link scanner */
+static void lscan(u, buf, n)
+struct url *u;
+char *buf;
+int n;
+{
+    struct scan *sc;
+    int c;
+
+    sc = (struct scan *)u->scan;
+    while (n-- > 0) {
+        c = *buf++ & 0xff;
+        switch (sc->state) {
+        case L_TEXT:
+            if (c == '<')
+                sc->state = L_OPEN;
+            break;
+
+        case L_OPEN:
+            sc->state = c == '!' ? L_BANG : L_TAG;
+            sc->dash = 0;
+            if (c != '!')
+                goto tag;
+            break;
+
+        case L_BANG:
+            /* "<!--" starts a comment; other "<!" things are tags */
+            if (c == '-' && ++sc->dash == 2) {
+                sc->state = L_CMT;
+                sc->dash = 0;
+            } else if (c != '-') {
+                sc->state = L_TAG;
+                goto tag;
+            }
+            break;
+
+        case L_CMT:
+            if (c == '>' && sc->dash >= 2)
+                sc->state = L_TEXT;
+            sc->dash = c == '-' ? sc->dash + 1 : 0;
+            break;
+
+        case L_NAME:
+            if (isalnum(c) || c == '-' || c == ':') {
+                if (sc->nlen < sizeof(sc->name) - 1)
+                    sc->name[sc->nlen] = c | 0x20;
+                sc->nlen++;
+                break;
+            }
+            sc->name[sc->nlen < sizeof(sc->name) ? sc->nlen : 0] = '\0';
+            sc->state = L_EQ;
+            /* FALLTHROUGH */
+        case L_EQ:
+            if (c == '=') {
+                sc->state = L_VAL0;
+                break;
+            }
+            if (isspace(c))
+                break;
+            sc->state = L_TAG;
+            /* FALLTHROUGH */
+        case L_TAG:
+        tag:
+            if (c == '>')
+                sc->state = L_TEXT;
+            else if (isalpha(c)) {
+                sc->name[0] = c | 0x20;
+                sc->nlen = 1;
+                sc->state = L_NAME;
+            }
+            break;
+
+        case L_VAL0:
+            if (isspace(c))
+                break;
+            if (c == '>') {
+                sc->state = L_TEXT;
+                break;
+            }
+            sc->vlen = 0;
+            sc->state = L_VAL;
+            if (c == '"' || c == '\'') {
+                sc->quote = c;
+                break;
+            }
+            sc->quote = 0;
+            /* FALLTHROUGH */
+        case L_VAL:
+            if (sc->quote ? c != sc->quote : !isspace(c) && c != '>') {
+                if (sc->vlen < sizeof(sc->val) - 1)
+                    sc->val[sc->vlen++] = c;
+                else
+                    sc->vlen = sizeof(sc->val);     /* too long: drop */
+                break;
+            }
+            if (sc->vlen < sizeof(sc->val) &&
+                (!strcmp(sc->name, "href") || !strcmp(sc->name, "src"))) {
+                sc->val[sc->vlen] = '\0';
+                addlink(u, sc->val + strspn(sc->val, " \t\r\n"), u->depth + 1);
+            }
+            sc->state = c == '>' ? L_TEXT : L_TAG;
+            break;
+        }
+    }
+}
+
+/* With no Content-Type, go by the name */
+static int ishtml(path)
+char *path;
+{
+    char *e;
+    int n;
+
+    n = strcspn(path, "?");
+    for (e = path + n; e > path && e[-1] != '.' && e[-1] != '/'; e--)
+        ;
+    n = path + n - e;
+    return e[-1] == '/' || (n == 4 && !strncasecmp(e, "html", 4)) ||
+           (n == 3 && !strncasecmp(e, "htm", 3));
+}
+
+/* Body bytes of u: scan them for links if it is HTML worth following */
+static void pgbody(u, r, buf, n)
+struct url *u;
+struct resp *r;
+char *buf;
+int n;
+{
+    if (u->depth >= maxdep || r->status != 200 || !r->html)
+        return;
+    if (r->html < 0 && !ishtml(u->path))
+        return;
+    if (!u->scan)
+        u->scan = (char *)xalloc(sizeof(struct scan));
+    lscan(u, buf, n);
+}
+
+/* A redirect is followed like a link, but costs no depth */
+static void pgredir(u, loc)
+struct url *u;
+char *loc;
+{
+    char link[MAXLINK];
+
+    strcpy(link, loc);
+    addlink(u, link, u->depth);
+}
+
+/* u is finished (st 1 ok, 0 failed) or will be tried again (st -1) */
+static void pgdone(u, st)
+struct url *u;
+int st;
+{
+    if (u->scan) {
+        free(u->scan);
+        u->scan = (char *)0;
+    }
+    if (st > 0)
+        npage++;
+    if (st >= 0 && (u < seeds || u >= seeds + nseed))
+        free((char *)u);
+}
+
+/*
+ * Mirror the sites of the n URLs in urls, following links up to
+ * maxdepth deep over at most maxconn connections, perhost per host.
+ * A non-zero bloomkb is the size in kilobytes of a Bloom filter to use
+ * for the seen set. Returns the number of pages that failed.
+ */
+int crawl(urls, n, maxconn, perhost, maxdepth, bloomkb)
+struct url *urls;
+int n, maxconn, perhost, maxdepth;
+long bloomkb;
+{
+    char name[PATHSIZE], key[MAXLINK + 300];
+    struct url *u;
+    int nerr;
+
+    seeds = urls;
+    nseed = n;
+    maxdep = maxdepth;
+    if (bloomkb > 0) {
+        bloombits = bloomkb * 8192L;
+        bloom = (unsigned char *)xalloc((unsigned)(bloombits / 8));
+    }
+    if (massinit(maxconn, perhost) < 0)
+        return n;
+    mbody = pgbody;
+    mredir = pgredir;
+    mdone = pgdone;
+
+    for (u = urls; u < urls + n; u++) {
+        if (!seen(key, (unsigned)urlkey(key, u->host, u->port, u->path)))
+            continue;
+        if (localname(name, u->host, u->port, u->path) < 0 ||
+            !(u->file = strdup(name))) {
+            fprintf(stderr, "Error: %s: name too long\n", u->path);
+            continue;
+        }
+        mkdirs(u->file);
+        nnew++;
+        massadd(u);
+    }
+
+    nerr = massrun();
+    fprintf(stderr, "%s: %ld pages saved, %ld links, %ld distinct URLs\n",
+            progname, npage, nlink, nnew);
+    return nerr < 0 ? n : nerr;
+}
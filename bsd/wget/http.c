@@ -0,0 +1,274 @@
+/*
+ * http.c - incremental HTTP response parser
+ *
+ * For non-blocking connections the response arrives in arbitrary
+ * pieces. hpfeed() takes each piece as it comes, collects the header,
+ * then follows the body framing (Content-Length, chunked, or to EOF)
+ * and passes body bytes to a sink. It stops at the end of the
+ * response, so whatever follows on a kept-alive connection is left for
+ * the next parser.
+ *
+ * A header that arrives whole is parsed where it lies in the caller's
+ * buffer; only one split across reads is copied aside. Chunk framing
+ * is removed in place, the data of each chunk moved down over the
+ * framing before it, so a buffer full of small chunks still reaches
+ * the sink in one piece. A gzip Content-Encoding is undone on the way
+ * (see inflate.c).
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wget.h"
+
+int showhdr;            /* -S: copy response headers to stderr */
+
+/* h->z must be 0, or a decoder from an earlier response, on the first call */
+void hpinit(h)
+struct hparse *h;
+{
+    h->state = HP_HDR;
+    h->r.status = 0;
+    h->ck = (struct cksum *)0;
+    h->hlen = 0;
+    h->llen = 0;
+    h->left = 0;
+    h->body = 0;
+}
+
+/* Free what the parser allocated */
+void hpfree(h)
+struct hparse *h;
+{
+    if (h->z)
+        free((char *)h->z);
+    h->z = (struct inflate *)0;
+}
+
+/*
+ * Decoded body bytes on their way to the caller's sink, which may be
+ * what sets h->ck: they are summed once it has taken them.
+ */
+static int hpsum(arg, buf, n)
+char *arg;
+char *buf;
+int n;
+{
+    struct hparse *h;
+
+    h = (struct hparse *)arg;
+    if ((*h->sink)(h->sarg, buf, n) < 0)
+        return -1;
+    if (h->ck)
+        ckfeed(h->ck, buf, n);
+    return 0;
+}
+
+/* Body bytes: decode them if need be and hand them on */
+static int hpsink(h, buf, n, sink, arg)
+struct hparse *h;
+char *buf;
+int n;
+int (*sink)();
+char *arg;
+{
+    if (n <= 0 || !sink)
+        return 0;
+    h->sink = sink;
+    h->sarg = arg;
+    sink = hpsum;
+    arg = (char *)h;
+    if (h->r.gzip)
+        return zfeed(h->z, buf, n, sink, arg);
+    return (*sink)(arg, buf, n) < 0 ? -1 : 0;
+}
+
+/* The header hdr, len bytes, is complete: parse it and start the body */
+static int hpstart(h, hdr, len)
+struct hparse *h;
+char *hdr;
+int len;
+{
+    char c;
+    int r;
+
+    /* Cut it off at the final newline for parseresp() */
+    c = hdr[len - 1];
+    hdr[len - 1] = '\0';
+    r = parseresp(hdr, &h->r);
+    hdr[len - 1] = c;
+    if (r < 0)
+        return -1;
+    if (showhdr)
+        fwrite(hdr, 1, len, stderr);
+    return hpbody(h);
+}
+
+/*
+ * Start on the body of the response whose header is already in h->r;
+ * returns 0, or -1 if out of memory.
+ */
+int hpbody(h)
+struct hparse *h;
+{
+    struct resp *r;
+
+    r = &h->r;
+    if (r->gzip) {
+        if (!h->z && !(h->z = zopen()))
+            return -1;
+        zreset(h->z);
+    }
+    if (r->status == 204 || r->status == 304 ||
+        (r->status >= 100 && r->status < 200))
+        h->state = HP_DONE;
+    else if (r->chunked)
+        h->state = HP_CSIZE;
+    else if (r->clen >= 0) {
+        h->left = r->clen;
+        h->state = r->clen ? HP_BODY : HP_DONE;
+    } else {
+        h->left = -1;       /* until EOF */
+        r->keep = 0;
+        h->state = HP_BODY;
+    }
+    return 0;
+}
+
+/* The response is complete: was a compressed body complete too? */
+static int hpend(h)
+struct hparse *h;
+{
+    return h->r.gzip && h->body > 0 && zdone(h->z) < 0 ? -1 : 0;
+}
+
+/*
+ * Feed n bytes of response. Body bytes go to (*sink)(arg, p, len).
+ * Returns how many bytes were consumed: fewer than n only if the
+ * response ended inside buf. Returns -1 on a malformed response or
+ * if the sink fails. The consumed part of buf may be overwritten.
+ */
+int hpfeed(h, buf, n, sink, arg)
+struct hparse *h;
+char *buf;
+int n;
+int (*sink)();
+char *arg;
+{
+    char *p, *e, *end, *o, *q;
+    int k, old;
+
+    p = buf;
+    end = buf + n;
+    o = q = (char *)0;      /* body gathered so far at o..q */
+    while (p < end && h->state != HP_DONE) {
+        switch (h->state) {
+        case HP_HDR:
+            old = h->hlen;
+            if (old == 0 && (e = hdrend(p, end - p))) {
+                /* All here: no need to copy it */
+                if (hpstart(h, p, e - p) < 0)
+                    return -1;
+                p = e;
+                break;
+            }
+            k = end - p;
+            if (k > HDRSIZE - 1 - old)
+                k = HDRSIZE - 1 - old;
+            bcopy(p, h->hdr + old, k);
+            h->hlen += k;
+            h->hdr[h->hlen] = '\0';
+            /* Search from just before the new bytes for the blank line */
+            e = hdrend(h->hdr + (old > 3 ? old - 3 : 0),
+                       h->hlen - (old > 3 ? old - 3 : 0));
+            if (!e) {
+                if (h->hlen == HDRSIZE - 1)
+                    return -1;
+                p += k;
+                break;
+            }
+            p += e - (h->hdr + old);
+            h->hlen = e - h->hdr;
+            h->hdr[h->hlen] = '\0';
+            if (hpstart(h, h->hdr, h->hlen) < 0)
+                return -1;
+            break;
+
+        case HP_BODY:
+        case HP_CDATA:
+            k = end - p;
+            if (h->left >= 0 && k > h->left)
+                k = h->left;
+            if (!o)
+                o = q = p;
+            else if (q != p)
+                memmove(q, p, k);
+            q += k;
+            p += k;
+            h->body += k;
+            if (h->left < 0)
+                break;
+            h->left -= k;
+            if (h->left == 0)
+                h->state = h->state == HP_BODY ? HP_DONE : HP_CEND;
+            break;
+
+        case HP_CSIZE:
+        case HP_CEND:
+        case HP_TRAIL:
+            /* Line oriented states */
+            if (*p != '\n') {
+                if (h->llen < sizeof(h->line) - 1)
+                    h->line[h->llen++] = *p;
+                p++;
+                break;
+            }
+            p++;
+            if (h->llen > 0 && h->line[h->llen - 1] == '\r')
+                h->llen--;
+            h->line[h->llen] = '\0';
+            k = h->llen;
+            h->llen = 0;
+            if (h->state == HP_CEND) {
+                if (k != 0)
+                    return -1;
+                h->state = HP_CSIZE;
+            } else if (h->state == HP_TRAIL) {
+                if (k == 0)
+                    h->state = HP_DONE;
+            } else {
+                if (k == 0)
+                    return -1;
+                h->left = strtol(h->line, (char **)0, 16);
+                h->state = h->left > 0 ? HP_CDATA : HP_TRAIL;
+            }
+            break;
+        }
+    }
+    if (o) {
+        tmbytes((long)(q - o));
+        if (hpsink(h, o, q - o, sink, arg) < 0)
+            return -1;
+    }
+    if (h->state == HP_DONE && hpend(h) < 0)
+        return -1;
+    return p - buf;
+}
+
+/*
+ * The connection hit EOF. Returns 0 if that completes the response
+ * (it was delimited by EOF, or was already done), -1 if it was cut short.
+ */
+int hpeof(h)
+struct hparse *h;
+{
+    if (h->state == HP_BODY && h->left < 0) {
+        h->state = HP_DONE;
+        return hpend(h);
+    }
+    return h->state == HP_DONE ? 0 : -1;
+}
@@ -0,0 +1,642 @@
+/*
+ * inflate.c - streaming gzip decoder (RFC 1951, RFC 1952)
+ *
+ * Compressed bytes are fed in pieces of any size, exactly as they come
+ * off the connection, and the decoded bytes are passed to a sink as
+ * the 32K history window fills. Everything is decoded in small units
+ * (a block header, a code table, one literal or match): when the
+ * input runs out part way through one, the unit is undone and the few
+ * bytes it had started on are held over for the next call.
+ *
+ * Literal/length and distance codes are decoded through a 9 bit
+ * lookup table, falling back to a bit at a time walk for longer codes.
+ * The gzip trailer's CRC-32 and length are checked.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wget.h"
+#include "crc32.h"
+
+#define WSIZE    32768      /* history window; a power of two */
+#define HOLDSIZE 1024       /* input kept over: a code table at most */
+#define FASTBITS 9
+#define MAXBITS  15
+
+/* Decoder states */
+#define Z_ID      0         /* fixed part of the gzip header */
+#define Z_XLEN    1
+#define Z_EXTRA   2
+#define Z_NAME    3
+#define Z_COMMENT 4
+#define Z_HCRC    5
+#define Z_BLOCK   6         /* deflate block header */
+#define Z_STORED  7         /* stored block data */
+#define Z_DATA    8         /* compressed block data */
+#define Z_TRAIL   9         /* gzip CRC-32 and size */
+#define Z_DONE    10
+
+/* gzip header flags */
+#define F_HCRC    2
+#define F_EXTRA   4
+#define F_NAME    8
+#define F_COMMENT 16
+
+struct huff {
+    short count[MAXBITS + 1];       /* codes of each length */
+    short symbol[288];              /* symbols in canonical order */
+    unsigned short fast[1 << FASTBITS]; /* symbol | length << 9, or 0 */
+};
+
+struct inflate {
+    int state;
+    int flags;
+    int count;                  /* bytes left in the current field */
+    int last;                   /* this is the final block */
+    long stored;                /* bytes left in a stored block */
+    unsigned char hdr[10];
+    unsigned long crc, size;    /* of the output so far */
+    unsigned long trail[2];     /* the CRC-32 and size from the trailer */
+
+    /* Input: the bytes held over, then the caller's */
+    unsigned long bitbuf;
+    int bitcnt;
+    unsigned char *ip, *iend;
+    unsigned char *next, *nend; /* the second segment, once in the first */
+    unsigned char hold[HOLDSIZE];
+    int nhold;
+
+    /* Output window */
+    unsigned char win[WSIZE];
+    unsigned wpos, wdone;       /* next byte; first not yet sunk */
+    unsigned long total;        /* bytes ever output */
+    int (*sink)();
+    char *arg;
+
+    struct huff lencode, distcode, lenlen;
+};
+
+static short lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static short lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static short dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static short dext[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* Order of the code length code lengths */
+static unsigned char clorder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+struct inflate *zopen()
+{
+    struct inflate *z;
+
+    z = (struct inflate *)malloc(sizeof(struct inflate));
+    if (z)
+        zreset(z);
+    return z;
+}
+
+/* Get ready for a new stream */
+void zreset(z)
+struct inflate *z;
+{
+    z->state = Z_ID;
+    z->count = 0;
+    z->crc = 0xffffffffUL;
+    z->size = 0;
+    z->trail[0] = z->trail[1] = 0;
+    z->bitbuf = 0;
+    z->bitcnt = 0;
+    z->nhold = 0;
+    z->wpos = z->wdone = 0;
+    z->total = 0;
+}
+
+/* Make sure n bits are in bitbuf; returns 0 if the input ran out */
+static int need(z, n)
+struct inflate *z;
+int n;
+{
+    while (z->bitcnt < n) {
+        if (z->ip == z->iend) {
+            if (!z->next)
+                return 0;
+            z->ip = z->next;
+            z->iend = z->nend;
+            z->next = (unsigned char *)0;
+            continue;
+        }
+        z->bitbuf |= (unsigned long)*z->ip++ << z->bitcnt;
+        z->bitcnt += 8;
+    }
+    return 1;
+}
+
+static unsigned bits(z, n)
+struct inflate *z;
+int n;
+{
+    unsigned v;
+
+    v = z->bitbuf & ((1UL << n) - 1);
+    z->bitbuf >>= n;
+    z->bitcnt -= n;
+    return v;
+}
+
+/* CRC-32 of n more bytes of a stream whose CRC so far is crc (0 at first) */
+unsigned long zcrc(crc, buf, n)
+unsigned long crc;
+char *buf;
+int n;
+{
+    unsigned char *p, *e;
+
+    crc ^= 0xffffffffUL;
+    for (p = (unsigned char *)buf, e = p + n; p < e; p++)
+        crc = UPDC32(*p, crc);
+    return crc ^ 0xffffffffUL;
+}
+
+/* Pass the new part of the window to the sink */
+static int zflush(z)
+struct inflate *z;
+{
+    unsigned char *p, *e;
+    unsigned long crc;
+    int n;
+
+    n = z->wpos - z->wdone;
+    if (n == 0)
+        return 0;
+    crc = z->crc;
+    for (p = z->win + z->wdone, e = p + n; p < e; p++)
+        crc = UPDC32(*p, crc);
+    z->crc = crc;
+    z->size += n;
+    p = z->win + z->wdone;
+    z->wdone = z->wpos == WSIZE ? 0 : z->wpos;
+    if (z->wpos == WSIZE)
+        z->wpos = 0;
+    return (*z->sink)(z->arg, (char *)p, n) < 0 ? -1 : 0;
+}
+
+#define PUTBYTE(z, c) \
+    if (((z)->win[(z)->wpos++] = (c)), (z)->wpos == WSIZE && zflush(z) < 0) \
+        return -1; else
+
+/*
+ * Build the decoding tables for n code lengths len[]. Returns 0, or -1
+ * if the lengths are over-subscribed.
+ */
+static int build(h, len, n)
+struct huff *h;
+unsigned char *len;
+int n;
+{
+    short offs[MAXBITS + 1];
+    unsigned code, rev, i, k;
+    int s, left, l;
+
+    for (l = 0; l <= MAXBITS; l++)
+        h->count[l] = 0;
+    for (s = 0; s < n; s++)
+        h->count[len[s]]++;
+    h->count[0] = 0;
+    left = 1;
+    for (l = 1; l <= MAXBITS; l++) {
+        left <<= 1;
+        left -= h->count[l];
+        if (left < 0)
+            return -1;
+    }
+
+    offs[1] = 0;
+    for (l = 1; l < MAXBITS; l++)
+        offs[l + 1] = offs[l] + h->count[l];
+    for (s = 0; s < n; s++)
+        if (len[s])
+            h->symbol[offs[len[s]]++] = s;
+
+    /* Canonical codes, reversed for LSB first lookup */
+    bzero((char *)h->fast, sizeof(h->fast));
+    code = 0;
+    s = 0;
+    for (l = 1; l <= FASTBITS; l++) {
+        for (i = 0; i < h->count[l]; i++, code++, s++) {
+            rev = 0;
+            for (k = 0; k < l; k++)
+                rev |= (code >> k & 1) << (l - 1 - k);
+            for (k = rev; k < 1 << FASTBITS; k += 1 << l)
+                h->fast[k] = h->symbol[s] | l << 9;
+        }
+        code <<= 1;
+    }
+    return 0;
+}
+
+/* Decode one symbol with h; returns it, -1 for a bad code, -2 for no input */
+static int decode(z, h)
+struct inflate *z;
+struct huff *h;
+{
+    int code, first, index, count, l;
+    unsigned e;
+
+    if (need(z, FASTBITS) || z->bitcnt > 0) {
+        e = h->fast[z->bitbuf & ((1 << FASTBITS) - 1)];
+        if (e && (e >> 9) <= z->bitcnt) {
+            bits(z, e >> 9);
+            return e & 511;
+        }
+    }
+    /* Long code, or too near the end of the input for the table */
+    code = first = index = 0;
+    for (l = 1; l <= MAXBITS; l++) {
+        if (!need(z, l))
+            return -2;
+        code |= z->bitbuf >> (l - 1) & 1;
+        count = h->count[l];
+        if (code - count < first) {
+            bits(z, l);
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static void fixed(z)
+struct inflate *z;
+{
+    unsigned char len[288];
+    int s;
+
+    for (s = 0; s < 144; s++)
+        len[s] = 8;
+    for (; s < 256; s++)
+        len[s] = 9;
+    for (; s < 280; s++)
+        len[s] = 7;
+    for (; s < 288; s++)
+        len[s] = 8;
+    build(&z->lencode, len, 288);
+    for (s = 0; s < 30; s++)
+        len[s] = 5;
+    build(&z->distcode, len, 30);
+}
+
+/* Read a dynamic block's code tables; returns 0, -1 on error, -2 for no input */
+static int dynamic(z)
+struct inflate *z;
+{
+    unsigned char len[320];
+    int nlen, ndist, ncode, i, s, rep, fill;
+
+    if (!need(z, 14))
+        return -2;
+    nlen = bits(z, 5) + 257;
+    ndist = bits(z, 5) + 1;
+    ncode = bits(z, 4) + 4;
+    if (nlen > 286 || ndist > 30)
+        return -1;
+    bzero((char *)len, 19);
+    for (i = 0; i < ncode; i++) {
+        if (!need(z, 3))
+            return -2;
+        len[clorder[i]] = bits(z, 3);
+    }
+    if (build(&z->lenlen, len, 19) < 0)
+        return -1;
+
+    for (i = 0; i < nlen + ndist; ) {
+        if ((s = decode(z, &z->lenlen)) < 0)
+            return s;
+        if (s < 16) {
+            len[i++] = s;
+            continue;
+        }
+        fill = 0;
+        if (s == 16) {
+            if (i == 0)
+                return -1;
+            fill = len[i - 1];
+            if (!need(z, 2))
+                return -2;
+            rep = 3 + bits(z, 2);
+        } else if (s == 17) {
+            if (!need(z, 3))
+                return -2;
+            rep = 3 + bits(z, 3);
+        } else {
+            if (!need(z, 7))
+                return -2;
+            rep = 11 + bits(z, 7);
+        }
+        if (i + rep > nlen + ndist)
+            return -1;
+        while (rep--)
+            len[i++] = fill;
+    }
+    if (len[256] == 0)
+        return -1;
+    if (build(&z->lencode, len, nlen) < 0 ||
+        build(&z->distcode, len + nlen, ndist) < 0)
+        return -1;
+    return 0;
+}
+
+/* One literal, match or end of block; returns 0, -1 on error, -2 for no input */
+static int symbol(z)
+struct inflate *z;
+{
+    unsigned char *w;
+    unsigned from;
+    int s, n, d;
+
+    if ((s = decode(z, &z->lencode)) < 0)
+        return s;
+    if (s < 256) {
+        PUTBYTE(z, s);
+        z->total++;
+        return 0;
+    }
+    if (s == 256) {
+        z->state = z->last ? Z_TRAIL : Z_BLOCK;
+        return 0;
+    }
+    s -= 257;
+    if (s >= 29 || !need(z, lext[s]))
+        return s >= 29 ? -1 : -2;
+    n = lbase[s] + bits(z, lext[s]);
+    if ((d = decode(z, &z->distcode)) < 0)
+        return d;
+    if (d >= 30 || !need(z, dext[d]))
+        return d >= 30 ? -1 : -2;
+    d = dbase[d] + bits(z, dext[d]);
+    if (d > z->total)
+        return -1;
+    z->total += n;
+
+    from = (z->wpos - d) & (WSIZE - 1);
+    w = z->win;
+    while (n--) {
+        PUTBYTE(z, w[from]);
+        from = (from + 1) & (WSIZE - 1);
+    }
+    return 0;
+}
+
+/* The gzip header field just read is done: go on to the next one present */
+static void nextfield(z)
+struct inflate *z;
+{
+    for (;;) {
+        switch (++z->state) {
+        case Z_XLEN:
+            z->count = 0;
+            if (z->flags & F_EXTRA)
+                return;
+            break;
+        case Z_EXTRA:
+            if (z->count > 0)
+                return;
+            break;
+        case Z_NAME:
+            if (z->flags & F_NAME)
+                return;
+            break;
+        case Z_COMMENT:
+            if (z->flags & F_COMMENT)
+                return;
+            break;
+        case Z_HCRC:
+            z->count = 2;
+            if (z->flags & F_HCRC)
+                return;
+            break;
+        default:
+            z->count = 0;
+            return;
+        }
+    }
+}
+
+/* Read through the gzip header; returns 0, -1 on error, -2 for no input */
+static int header(z)
+struct inflate *z;
+{
+    int c;
+
+    while (z->state < Z_BLOCK) {
+        if (!need(z, 8))
+            return -2;
+        c = bits(z, 8);
+        switch (z->state) {
+        case Z_ID:
+            z->hdr[z->count++] = c;
+            if (z->count < 10)
+                break;
+            if (z->hdr[0] != 0x1f || z->hdr[1] != 0x8b || z->hdr[2] != 8 ||
+                (z->hdr[3] & 0xe0))
+                return -1;
+            z->flags = z->hdr[3];
+            nextfield(z);
+            break;
+        case Z_XLEN:
+            z->hdr[z->count++] = c;
+            if (z->count < 2)
+                break;
+            z->count = z->hdr[0] | z->hdr[1] << 8;
+            nextfield(z);
+            break;
+        case Z_EXTRA:
+        case Z_HCRC:
+            if (--z->count == 0)
+                nextfield(z);
+            break;
+        case Z_NAME:
+        case Z_COMMENT:
+            if (c == 0)
+                nextfield(z);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* A deflate block header; returns 0, -1 on error, -2 for no input */
+static int block(z)
+struct inflate *z;
+{
+    int type;
+
+    if (!need(z, 3))
+        return -2;
+    z->last = bits(z, 1);
+    type = bits(z, 2);
+    if (type == 0) {
+        /* Stored: LEN and NLEN start at the next byte */
+        bits(z, z->bitcnt & 7);
+        if (!need(z, 32))
+            return -2;
+        z->stored = bits(z, 16);
+        if ((bits(z, 16) ^ 0xffff) != z->stored)
+            return -1;
+        z->state = Z_STORED;
+    } else if (type == 1) {
+        fixed(z);
+        z->state = Z_DATA;
+    } else if (type == 2) {
+        if ((type = dynamic(z)) < 0)
+            return type;
+        z->state = Z_DATA;
+    } else
+        return -1;
+    return 0;
+}
+
+/* Copy stored block bytes; returns 0, or -1 if the sink failed */
+static int stored(z)
+struct inflate *z;
+{
+    int c;
+
+    while (z->stored > 0) {
+        if (!need(z, 8))
+            return 0;
+        c = bits(z, 8);
+        PUTBYTE(z, c);
+        z->total++;
+        z->stored--;
+    }
+    z->state = z->last ? Z_TRAIL : Z_BLOCK;
+    return 0;
+}
+
+/* The trailer: CRC-32 and length, both little endian */
+static int trailer(z)
+struct inflate *z;
+{
+    if (z->count == 0)
+        bits(z, z->bitcnt & 7);     /* to a byte boundary */
+    while (z->count < 8) {
+        if (!need(z, 8))
+            return -2;
+        z->trail[z->count >> 2] |= (unsigned long)bits(z, 8) <<
+                                   (z->count & 3) * 8;
+        z->count++;
+    }
+    if (zflush(z) < 0)
+        return -1;
+    if ((z->crc ^ 0xffffffffUL) != z->trail[0] ||
+        (z->size & 0xffffffffUL) != z->trail[1])
+        return -1;
+    z->state = Z_DONE;
+    return 0;
+}
+
+/*
+ * Decode n more bytes of the gzip stream, passing output to
+ * (*sink)(arg, p, len). Returns 0, or -1 if the data is corrupt or
+ * the sink fails. Bytes after the end of the stream are ignored.
+ */
+int zfeed(z, buf, n, sink, arg)
+struct inflate *z;
+char *buf;
+int n;
+int (*sink)();
+char *arg;
+{
+    unsigned char *sip, *siend, *snext;
+    unsigned long sbuf;
+    int scnt, r, k;
+
+    z->sink = sink;
+    z->arg = arg;
+    if (z->nhold > 0) {
+        z->ip = z->hold;
+        z->iend = z->hold + z->nhold;
+        z->next = (unsigned char *)buf;
+        z->nend = (unsigned char *)buf + n;
+    } else {
+        z->ip = (unsigned char *)buf;
+        z->iend = z->ip + n;
+        z->next = (unsigned char *)0;
+    }
+
+    r = 0;
+    for (;;) {
+        /* Where this unit starts, to back out to if input runs short */
+        sip = z->ip;
+        siend = z->iend;
+        snext = z->next;
+        sbuf = z->bitbuf;
+        scnt = z->bitcnt;
+
+        if (z->state == Z_DATA)
+            r = symbol(z);
+        else if (z->state < Z_BLOCK)
+            r = header(z);
+        else if (z->state == Z_BLOCK)
+            r = block(z);
+        else if (z->state == Z_STORED) {
+            if ((r = stored(z)) == 0 && z->state == Z_STORED)
+                r = -2;
+        } else if (z->state == Z_TRAIL)
+            r = trailer(z);
+        else
+            break;
+        if (r < 0)
+            break;
+    }
+    if (r == -1)
+        return -1;
+
+    if (r == -2 && (z->state == Z_BLOCK || z->state == Z_DATA)) {
+        /* Back out of the unfinished unit */
+        z->ip = sip;
+        z->iend = siend;
+        z->next = snext;
+        z->bitbuf = sbuf;
+        z->bitcnt = scnt;
+    }
+
+    /* Keep what is left of the input for next time */
+    k = z->iend - z->ip + (z->next ? z->nend - z->next : 0);
+    if (z->state != Z_DONE && k > 0) {
+        if (k > HOLDSIZE)
+            return -1;
+        if (z->ip != z->hold)
+            bcopy((char *)z->ip, (char *)z->hold,
+                  (int)(z->iend - z->ip));
+        if (z->next)
+            bcopy((char *)z->next, (char *)z->hold + (z->iend - z->ip),
+                  (int)(z->nend - z->next));
+    }
+    z->nhold = z->state == Z_DONE ? 0 : k;
+    return zflush(z);
+}
+
+/* Returns 0 if the whole stream has been decoded and checked */
+int zdone(z)
+struct inflate *z;
+{
+    return z->state == Z_DONE ? 0 : -1;
+}
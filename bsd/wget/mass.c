@@ -0,0 +1,840 @@
+/*
+ * mass.c - event driven engine for fetching thousands of URLs
+ *
+ * Up to maxconn non-blocking connections run at once from a single
+ * loop, at most perhost of them to any one host. Each host is looked up
+ * once and its address kept, so a manifest of many URLs on a few
+ * mirrors costs a few gethostbyname() calls, not one per URL. A
+ * connection that finishes a response with keep-alive goes straight on
+ * to the next URL queued for its host. Once past the header, a plain
+ * body is spliced from the socket into its file (see sink.c); others
+ * are gathered in a large per-transfer buffer and written out in big
+ * blocks.
+ *
+ * The loop waits in epoll on Linux and in select() elsewhere. At the
+ * end a summary reports throughput, failures and the mean time spent
+ * in each phase of a transfer.
+ *
+ * URLs may also be added while the engine runs, and hooks see each
+ * page as it arrives; the recursive crawler (crawl.c) is built this
+ * way. To be polite to a site, hostwait spaces out the requests to
+ * each host; a kept-alive connection waiting out the gap is parked
+ * rather than closed.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
+#include "wget.h"
+
+#define NHASH    256        /* host table buckets */
+#define WBUFSIZE 32768      /* per transfer output buffer */
+#define RBUFSIZE 16384
+#define MAXTRY   3          /* attempts per URL */
+#define IDLEMS   30000L     /* drop a connection silent this long */
+
+#define EV_R 1
+#define EV_W 2
+
+/* Connection states */
+#define M_FREE 0
+#define M_CONN 1            /* connect in progress */
+#define M_SEND 2            /* writing the request */
+#define M_RECV 3            /* reading the response */
+#define M_IDLE 4            /* kept alive, waiting for its host's turn */
+
+struct job {
+    struct url *u;
+    struct job *next;
+    int tries;
+};
+
+struct host {
+    char *name;
+    int port;
+    struct sockaddr_in sa;
+    int resolved;           /* 0 not yet, 1 ok, -1 lookup failed */
+    int active;             /* connections open to it */
+    long due;               /* no request before this time (ms) */
+    struct job *head;       /* URLs waiting for a connection */
+    struct job *tail;
+    struct host *next;      /* hash chain */
+};
+
+struct mconn {
+    int sock;
+    int state;
+    int ev;                 /* events we are waiting for */
+    struct host *h;
+    struct job *j;
+    int reused;             /* carried an earlier response */
+    int gotbytes;           /* any of this response seen yet */
+    int hdone;              /* header handled */
+    int fd;                 /* output file, -1 to discard */
+    int failed;             /* HTTP error: count but do not retry */
+    int nosplice;           /* splice() does not work here */
+    char *wbuf;
+    int wlen;
+    char req[REQSIZE];
+    int qlen, qpos;
+    struct timing tm;
+    struct cksum ck;
+    long last;              /* msnow() of the last progress */
+    struct hparse hp;
+};
+
+static struct host *htab[NHASH];
+static struct host **hostv;     /* hosts in order of first use */
+static int nhost, maxhost, rr;
+static struct mconn *conns;
+static int nconn, perhostmax;
+static double tbase;
+static long tzero;
+
+long hostwait;                  /* ms between requests to one host */
+
+/* Set by the crawler to see pages as they arrive and finish */
+void (*mbody) P((struct url *u, struct resp *r, char *buf, int n));
+void (*mredir) P((struct url *u, char *loc));
+void (*mdone) P((struct url *u, int st));
+
+/* Totals for the summary */
+static long nok, nfail, nbytes, nopen, nreuse, ndns;
+static double tdns, tconn, tfirst, tbody;
+static long nfirst;
+
+#ifdef USE_EPOLL
+static int epfd;
+#endif
+
+/* Milliseconds since the engine started */
+static long msnow()
+{
+    return (long)(tmnow() - tbase);
+}
+
+/* Wait for events want (0: none) on c's socket */
+static void evset(c, want)
+struct mconn *c;
+int want;
+{
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+
+    if (want == c->ev)
+        return;
+    ev.events = (want & EV_R ? EPOLLIN : 0) | (want & EV_W ? EPOLLOUT : 0);
+    ev.data.ptr = (void *)c;
+    epoll_ctl(epfd, !c->ev ? EPOLL_CTL_ADD : !want ? EPOLL_CTL_DEL :
+              EPOLL_CTL_MOD, c->sock, &ev);
+#endif
+    c->ev = want;
+}
+
+/*
+ * Wait up to ms for events. Ready connections are stored in rdy[] and
+ * their events in evs[]; returns how many.
+ */
+static int evwait(rdy, evs, ms)
+struct mconn **rdy;
+int *evs;
+int ms;
+{
+    int i, n;
+#ifdef USE_EPOLL
+    struct epoll_event ev[64];
+
+    n = epoll_wait(epfd, ev, nconn < 64 ? nconn : 64, ms);
+    for (i = 0; i < n; i++) {
+        rdy[i] = (struct mconn *)ev[i].data.ptr;
+        evs[i] = (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) ? EV_R : 0) |
+                 (ev[i].events & EPOLLOUT ? EV_W : 0);
+    }
+    return n < 0 ? 0 : n;
+#else
+    fd_set rset, wset;
+    struct timeval tv;
+    struct mconn *c;
+    int maxfd;
+
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    maxfd = -1;
+    for (c = conns; c < conns + nconn; c++) {
+        if (c->state == M_FREE || !c->ev)
+            continue;
+        if (c->ev & EV_R)
+            FD_SET(c->sock, &rset);
+        if (c->ev & EV_W)
+            FD_SET(c->sock, &wset);
+        if (c->sock > maxfd)
+            maxfd = c->sock;
+    }
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = ms % 1000 * 1000;
+    if (select(maxfd + 1, &rset, &wset, (fd_set *)0, &tv) <= 0)
+        return 0;
+    n = 0;
+    for (c = conns; c < conns + nconn; c++) {
+        if (c->state == M_FREE || !c->ev)
+            continue;
+        i = (FD_ISSET(c->sock, &rset) ? EV_R : 0) |
+            (FD_ISSET(c->sock, &wset) ? EV_W : 0);
+        if (i) {
+            rdy[n] = c;
+            evs[n++] = i;
+        }
+    }
+    return n;
+#endif
+}
+
+/* Host table entry for name:port, created on first use */
+static struct host *gethost(name, port)
+char *name;
+int port;
+{
+    struct host *h;
+    unsigned i;
+    char *p;
+
+    i = port;
+    for (p = name; *p; p++)
+        i = i * 31 + (*p | 0x20);
+    i %= NHASH;
+    for (h = htab[i]; h; h = h->next)
+        if (h->port == port && !strcasecmp(h->name, name))
+            return h;
+
+    h = (struct host *)calloc(1, sizeof(struct host));
+    if (nhost == maxhost) {
+        maxhost = maxhost ? maxhost * 2 : 64;
+        hostv = (struct host **)realloc((char *)hostv,
+                                        maxhost * sizeof(struct host *));
+    }
+    if (!h || !hostv) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    h->name = name;
+    h->port = port;
+    h->next = htab[i];
+    htab[i] = h;
+    hostv[nhost++] = h;
+    return h;
+}
+
+static void enqueue(h, j, front)
+struct host *h;
+struct job *j;
+int front;
+{
+    if (front) {
+        j->next = h->head;
+        h->head = j;
+        if (!h->tail)
+            h->tail = j;
+        return;
+    }
+    j->next = (struct job *)0;
+    if (h->tail)
+        h->tail->next = j;
+    else
+        h->head = j;
+    h->tail = j;
+}
+
+static struct job *dequeue(h)
+struct host *h;
+{
+    struct job *j;
+
+    j = h->head;
+    if (j) {
+        h->head = j->next;
+        if (!h->head)
+            h->tail = (struct job *)0;
+    }
+    return j;
+}
+
+static int wflush(c)
+struct mconn *c;
+{
+    int n;
+
+    n = c->wlen;
+    c->wlen = 0;
+    if (c->fd >= 0 && n > 0 && writeall(c->fd, c->wbuf, n) < 0) {
+        perror(c->j->u->file ? c->j->u->file : c->j->u->path);
+        return -1;
+    }
+    return 0;
+}
+
+/* The header is in: check the status and open the output file */
+static int jhead(c)
+struct mconn *c;
+{
+    struct url *u;
+    char name[PATHSIZE], *file;
+
+    c->hdone = 1;
+    u = c->j->u;
+    if (mredir && c->hp.r.status / 100 == 3 && c->hp.r.loc[0]) {
+        (*mredir)(u, c->hp.r.loc);
+        return 0;
+    }
+    file = urlfile(u, name);
+    c->fd = rsopen(file, &c->hp.r, u->have, u->path);
+    if (c->fd == RS_DONE) {
+        c->fd = -1;
+        if (ckprep(&c->ck, file, -1L) && ckdone(&c->ck, file) < 0)
+            c->failed = 1;
+    } else if (c->fd < 0)
+        c->failed = 1;
+    else
+        c->hp.ck = ckprep(&c->ck, file, c->hp.r.status == 206 ? u->have :
+                          0L);
+    return 0;
+}
+
+/* Body bytes from the parser */
+static int jsink(arg, buf, n)
+char *arg;
+char *buf;
+int n;
+{
+    struct mconn *c;
+
+    c = (struct mconn *)arg;
+    if (!c->hdone && jhead(c) < 0)
+        return -1;
+    if (c->fd < 0)
+        return 0;
+    if (mbody)
+        (*mbody)(c->j->u, &c->hp.r, buf, n);
+    if (c->wlen + n > WBUFSIZE && wflush(c) < 0)
+        return -1;
+    if (n >= WBUFSIZE)
+        return writeall(c->fd, buf, n);
+    bcopy(buf, c->wbuf + c->wlen, n);
+    c->wlen += n;
+    return 0;
+}
+
+/* Drop the connection of slot c */
+static void mclose(c)
+struct mconn *c;
+{
+    evset(c, 0);
+    close(c->sock);
+    c->state = M_FREE;
+    c->h->active--;
+}
+
+/* Finish the job on c; ok is set if the whole response arrived */
+static void jdone(c, ok)
+struct mconn *c;
+int ok;
+{
+    struct job *j;
+    struct url *u;
+    char name[PATHSIZE], key[BUFSIZE];
+    int st;
+
+    j = c->j;
+    u = j->u;
+    tmlog(&c->tm, u->host, u->port, u->path, c->hp.r.status, c->hp.body);
+    if (ok && wflush(c) < 0)
+        ok = 0;
+    if (c->fd >= 0) {
+        if (close(c->fd) < 0)
+            ok = 0;
+        else if (ok && c->hp.ck && ckdone(c->hp.ck, urlfile(u, name)) < 0)
+            c->failed = 1;
+        else if (ok) {
+            chkey(key, u->host, u->port, u->path);
+            rsdone(urlfile(u, name), key, &c->hp.r);
+        }
+    }
+    c->fd = -1;
+
+    if (ok && !c->failed) {
+        nok++;
+        nbytes += c->hp.body;
+        tbody += c->tm.end - c->tm.first;
+        free((char *)j);
+        st = 1;
+    } else if (ok || c->failed || ++j->tries >= MAXTRY) {
+        if (!c->failed)
+            fprintf(stderr, "Error: %s: giving up after %d attempts\n",
+                    u->path, j->tries);
+        nfail++;
+        free((char *)j);
+        st = 0;
+    } else {
+        /* Try again, ahead of the rest of its host's queue */
+        enqueue(c->h, j, 1);
+        st = -1;
+    }
+    c->j = (struct job *)0;
+    if (mdone)
+        (*mdone)(u, st);
+}
+
+/*
+ * Put job j on connection c and queue its request. Returns 0, or -1 if
+ * the request would not fit, and the job has failed.
+ */
+static int jstart(c, j)
+struct mconn *c;
+struct job *j;
+{
+    char name[PATHSIZE], key[BUFSIZE], extra[RSEXTRA];
+
+    c->j = j;
+    c->gotbytes = c->hdone = c->failed = 0;
+    c->fd = -1;
+    c->wlen = 0;
+    tmstart(&c->tm);
+    c->last = (long)(c->tm.start - tbase);
+    c->h->due = c->last + hostwait;
+    chkey(key, j->u->host, j->u->port, j->u->path);
+    j->u->have = rsprep(urlfile(j->u, name), key, extra);
+    hpinit(&c->hp);
+    c->qlen = mkreq(c->req, sizeof(c->req), "GET", c->h->name, j->u->path,
+                    j->u->have > 0 ? j->u->have : -1L, -1L, extra);
+    c->qpos = 0;
+    if (c->qlen < 0) {
+        fprintf(stderr, "Error: %s: request too long\n", j->u->path);
+        c->failed = 1;
+        jdone(c, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/* The connection failed under job c->j */
+static void mfail(c)
+struct mconn *c;
+{
+    /* A kept-alive connection the server had already closed is no
+       fault of the URL */
+    if (c->reused && !c->gotbytes) {
+        enqueue(c->h, c->j, 1);
+        c->j = (struct job *)0;
+    } else
+        jdone(c, 0);
+    mclose(c);
+}
+
+/* Open a connection on free slot c for the next URL of host h */
+static void mopen(c, h)
+struct mconn *c;
+struct host *h;
+{
+    double t;
+
+    t = tmnow();
+    if (!h->resolved) {
+        h->resolved = lookup(h->name, h->port, &h->sa) < 0 ? -1 : 1;
+        tdns += tmnow() - t;
+        ndns++;
+    }
+    if (h->resolved < 0) {
+        /* Every URL on a host that does not resolve fails */
+        while ((c->j = dequeue(h))) {
+            nfail++;
+            if (mdone)
+                (*mdone)(c->j->u, 0);
+            free((char *)c->j);
+        }
+        return;
+    }
+    c->h = h;
+    if (jstart(c, dequeue(h)) < 0)
+        return;
+    c->tm.start = t;        /* the lookup is part of this job */
+    c->reused = 0;
+    c->sock = dial(&h->sa, 1);
+    h->active++;
+    c->state = M_CONN;
+    c->ev = 0;
+    if (c->sock < 0) {
+        c->state = M_FREE;
+        h->active--;
+        jdone(c, 0);
+        return;
+    }
+    nopen++;
+    evset(c, EV_W);
+}
+
+/* Send the next URL of its host on kept-alive connection c */
+static void mreuse(c)
+struct mconn *c;
+{
+    if (jstart(c, dequeue(c->h)) < 0) {
+        /* Stay open for the next URL */
+        c->state = M_IDLE;
+        evset(c, EV_R);
+        return;
+    }
+    c->reused = 1;
+    nreuse++;
+    c->state = M_SEND;
+    evset(c, EV_W);
+}
+
+/* Start requests while there are free slots and eligible hosts */
+static void pump()
+{
+    struct mconn *c;
+    struct host *h;
+    long now;
+    int i;
+
+    now = msnow();
+    for (c = conns; c < conns + nconn; c++)
+        if (c->state == M_IDLE && c->h->head && now >= c->h->due)
+            mreuse(c);
+
+    h = (struct host *)0;
+    for (c = conns; c < conns + nconn; c++) {
+        if (c->state != M_FREE)
+            continue;
+        for (i = 0; i < nhost; i++) {
+            h = hostv[(rr + i) % nhost];
+            if (h->head && h->active < perhostmax && now >= h->due)
+                break;
+        }
+        if (i == nhost)
+            return;
+        rr = (rr + i + 1) % nhost;
+        mopen(c, h);
+    }
+}
+
+/* The response on c is complete; clean if nothing after it was read */
+static void mfinish(c, clean)
+struct mconn *c;
+int clean;
+{
+    if (!c->hdone)
+        jhead(c);
+    jdone(c, 1);
+
+    /* Reuse the connection for the next URL on this host */
+    if (c->hp.r.keep && clean && c->h->head) {
+        if (c->last >= c->h->due)
+            mreuse(c);
+        else {
+            c->state = M_IDLE;
+            evset(c, EV_R);
+        }
+        return;
+    }
+    mclose(c);
+}
+
+/*
+ * Readable in the middle of an identity body: splice what has come
+ * straight into the file. Returns 0 if splice() cannot be used.
+ */
+static int msplice(c)
+struct mconn *c;
+{
+    long n;
+
+    if (wflush(c) < 0) {
+        c->failed = 1;
+        jdone(c, 0);
+        mclose(c);
+        return 1;
+    }
+    n = sksplice(c->sock, c->fd, c->hp.left, 1);
+    if (n == SK_AGAIN)
+        return 1;
+    if (n == SK_NOTSUP) {
+        c->nosplice = 1;
+        return 0;
+    }
+    c->last = msnow();
+    if (n > 0) {
+        c->hp.body += n;
+        if (c->hp.left > 0 && (c->hp.left -= n) == 0) {
+            c->hp.state = HP_DONE;
+            mfinish(c, 1);
+        }
+    } else if (n == 0 && c->hp.left < 0) {
+        c->hp.state = HP_DONE;
+        jdone(c, 1);
+        mclose(c);
+    } else
+        mfail(c);
+    return 1;
+}
+
+/* Readable: feed the parser and finish the job when it is done */
+static void mread(c)
+struct mconn *c;
+{
+    char buf[RBUFSIZE];
+    int n, used;
+
+    if (c->hdone && c->fd >= 0 && c->hp.state == HP_BODY && !c->nosplice &&
+        !c->hp.r.gzip && !c->hp.ck && (!mbody || c->hp.r.html == 0) &&
+        msplice(c))
+        return;
+    n = read(c->sock, buf, sizeof(buf));
+    if (n < 0 && (errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    c->last = msnow();
+    if (n == 0) {
+        if (c->gotbytes && hpeof(&c->hp) == 0) {
+            if (!c->hdone)
+                jhead(c);
+            jdone(c, 1);
+            mclose(c);
+        } else
+            mfail(c);
+        return;
+    }
+    if (n < 0) {
+        mfail(c);
+        return;
+    }
+    if (!c->gotbytes) {
+        c->gotbytes = 1;
+        c->tm.first = tmnow();
+        tfirst += c->tm.first - c->tm.sent;
+        nfirst++;
+    }
+    used = hpfeed(&c->hp, buf, n, jsink, (char *)c);
+    if (used < 0) {
+        fprintf(stderr, "Error: %s: bad response\n", c->j->u->path);
+        c->failed = 1;
+        jdone(c, 0);
+        mclose(c);
+        return;
+    }
+    if (c->hp.state == HP_DONE)
+        mfinish(c, used == n);
+}
+
+/* Writable: finish connecting, then send the request */
+static void mwrite(c)
+struct mconn *c;
+{
+    int err, n;
+    socklen_t len;
+
+    if (c->state == M_CONN) {
+        len = sizeof(err);
+        if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, (char *)&err,
+                       &len) < 0 || err != 0) {
+            mfail(c);
+            return;
+        }
+        c->tm.conn = tmnow();
+        tconn += c->tm.conn - c->tm.dns;
+        c->state = M_SEND;
+    }
+    n = write(c->sock, c->req + c->qpos, c->qlen - c->qpos);
+    if (n < 0 && errno == EWOULDBLOCK)
+        return;
+    if (n <= 0) {
+        mfail(c);
+        return;
+    }
+    c->qpos += n;
+    if (c->qpos < c->qlen)
+        return;
+    c->tm.sent = tmnow();
+    c->last = (long)(c->tm.sent - tbase);
+    c->state = M_RECV;
+    evset(c, EV_R);
+}
+
+static void summary(ms)
+long ms;
+{
+    double secs;
+    FILE *fp;
+
+    secs = ms > 0 ? ms / 1000.0 : 0.001;
+    fprintf(stderr,
+        "%s: %ld ok, %ld failed, %ld bytes in %.2f s (%.1f KB/s)\n",
+        progname, nok, nfail, nbytes, secs, nbytes / 1024.0 / secs);
+    fprintf(stderr,
+        "%s: %ld connections (%ld reused), %ld lookups\n",
+        progname, nopen, nreuse, ndns);
+    fprintf(stderr,
+        "%s: mean ms: dns %.1f  connect %.1f  first byte %.1f  body %.1f\n",
+        progname, ndns ? tdns / ndns : 0.0,
+        nopen ? tconn / nopen : 0.0,
+        nfirst ? tfirst / nfirst : 0.0,
+        nok ? tbody / nok : 0.0);
+    if (!(fp = tmout()))
+        return;
+    fprintf(fp, "{\"summary\":{\"ok\":%ld,\"failed\":%ld,\"body_bytes\":%ld,"
+            "\"secs\":%.3f,\"connections\":%ld,\"reused\":%ld,"
+            "\"lookups\":%ld,\"mean_dns_ms\":%.3f,\"mean_connect_ms\":%.3f,"
+            "\"mean_ttfb_ms\":%.3f,\"mean_body_ms\":%.3f}}\n",
+            nok, nfail, nbytes, secs, nopen, nreuse, ndns,
+            ndns ? tdns / ndns : 0.0, nopen ? tconn / nopen : 0.0,
+            nfirst ? tfirst / nfirst : 0.0, nok ? tbody / nok : 0.0);
+}
+
+/*
+ * Set up the engine for at most maxconn connections, perhost of them
+ * per host. Returns 0, or -1 if out of memory.
+ */
+int massinit(maxconn, perhost)
+int maxconn, perhost;
+{
+    struct mconn *c;
+
+    tbase = tmnow();
+    tzero = msnow();
+    nconn = maxconn > 0 ? maxconn : 1;
+#ifndef USE_EPOLL
+    if (nconn > FD_SETSIZE - 8)
+        nconn = FD_SETSIZE - 8;
+#endif
+    perhostmax = perhost > 0 ? perhost : 1;
+    http11 = 1;
+
+    conns = (struct mconn *)calloc(nconn, sizeof(struct mconn));
+    if (!conns) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+    for (c = conns; c < conns + nconn; c++)
+        if (!(c->wbuf = (char *)malloc(WBUFSIZE))) {
+            fprintf(stderr, "Error: out of memory\n");
+            return -1;
+        }
+#ifdef USE_EPOLL
+    if ((epfd = epoll_create(nconn)) < 0) {
+        perror("epoll_create");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Queue u; it may be called before massrun() or from its hooks */
+void massadd(u)
+struct url *u;
+{
+    struct job *j;
+
+    j = (struct job *)calloc(1, sizeof(struct job));
+    if (!j) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    j->u = u;
+    enqueue(gethost(u->host, u->port), j, 0);
+}
+
+/* Run until every queued URL is done; returns how many failed */
+int massrun()
+{
+    struct mconn **rdy, *c;
+    int *evs;
+    int i, k, busy, queued;
+    long now;
+
+    rdy = (struct mconn **)calloc(nconn, sizeof(struct mconn *));
+    evs = (int *)calloc(nconn, sizeof(int));
+    if (!rdy || !evs) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+
+    for (;;) {
+        pump();
+        busy = 0;
+        for (c = conns; c < conns + nconn; c++)
+            busy += c->state != M_FREE && c->state != M_IDLE;
+        queued = 0;
+        for (i = 0; i < nhost && !queued; i++)
+            queued = hostv[i]->head != (struct job *)0;
+        if (!busy && !queued)
+            break;
+
+        k = evwait(rdy, evs, hostwait > 0 && hostwait < 1000 ?
+                   (int)hostwait : 1000);
+        for (i = 0; i < k; i++) {
+            c = rdy[i];
+            if (c->state == M_FREE)
+                continue;
+            if (c->state == M_IDLE)
+                mclose(c);  /* closed by the server while parked */
+            else if (evs[i] & EV_W)
+                mwrite(c);
+            else if (evs[i] & EV_R)
+                mread(c);
+        }
+
+        now = msnow();
+        for (c = conns; c < conns + nconn; c++) {
+            if (c->state == M_FREE || now - c->last <= IDLEMS)
+                continue;
+            if (c->state == M_IDLE)
+                mclose(c);
+            else {
+                fprintf(stderr, "Error: %s: timed out\n", c->j->u->path);
+                mfail(c);
+            }
+        }
+    }
+
+    summary(msnow() - tzero);
+    for (c = conns; c < conns + nconn; c++) {
+        if (c->state == M_IDLE)
+            mclose(c);
+        hpfree(&c->hp);
+        free(c->wbuf);
+    }
+#ifdef USE_EPOLL
+    close(epfd);
+#endif
+    free((char *)conns);
+    free((char *)rdy);
+    free((char *)evs);
+    return (int)nfail;
+}
+
+/*
+ * Fetch n URLs over at most maxconn connections, perhost of them per
+ * host. Returns the number of URLs that failed.
+ */
+int massfetch(urls, n, maxconn, perhost)
+struct url *urls;
+int n, maxconn, perhost;
+{
+    int i;
+
+    if (massinit(maxconn, perhost) < 0)
+        return n;
+    for (i = 0; i < n; i++)
+        massadd(&urls[i]);
+    i = massrun();
+    return i < 0 ? n : i;
+}
@@ -0,0 +1,284 @@
+/*
+ * multi.c - fetch a list of URLs over kept-alive connections
+ *
+ * URLs are grouped by host and port, and each group is fetched over a
+ * single HTTP/1.1 connection. With a pipeline depth above one, up to
+ * that many requests are written, in one write(), before the first
+ * response is read. Responses arrive in request order and are cut
+ * apart by cbody(). If the server closes the connection, it is
+ * reopened and the requests that got no answer are sent again.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wget.h"
+
+#define MAXDEPTH 16         /* most requests in flight per connection */
+#define MAXFAIL  3          /* attempts per URL */
+
+/*
+ * Split "http://host[:port][/path]" into u. Returns 0, or -1 if s is
+ * not an http URL.
+ */
+int parseurl(s, u)
+char *s;
+struct url *u;
+{
+    char *h, *p;
+    int n;
+
+    if (strncmp(s, "http://", 7))
+        return -1;
+    h = s + 7;
+    n = strcspn(h, ":/");
+    if (n == 0)
+        return -1;
+    u->host = (char *)malloc(n + 1);
+    if (!u->host)
+        return -1;
+    bcopy(h, u->host, n);
+    u->host[n] = '\0';
+    p = h + n;
+    u->port = 80;
+    if (*p == ':') {
+        u->port = atoi(p + 1);
+        p += 1 + strspn(p + 1, "0123456789");
+    }
+    u->path = *p ? p : "/";
+    u->file = (char *)0;
+    u->have = 0;
+    u->depth = 0;
+    u->scan = (char *)0;
+    if (strlen(u->host) + strlen(u->path) > BUFSIZE - 128)
+        return -1;
+    return 0;
+}
+
+/* Local file name for path: its last component, or index.html */
+void outname(path, name, size)
+char *path, *name;
+int size;
+{
+    char *p;
+    int n;
+
+    p = strrchr(path, '/');
+    p = p ? p + 1 : path;
+    n = strcspn(p, "?#");
+    if (n == 0) {
+        p = "index.html";
+        n = strlen(p);
+    }
+    if (n > size - 1)
+        n = size - 1;
+    bcopy(p, name, n);
+    name[n] = '\0';
+}
+
+/* Local file for u: the one given, else outname() of its path in name */
+char *urlfile(u, name)
+struct url *u;
+char *name;
+{
+    if (u->file)
+        return u->file;
+    outname(u->path, name, PATHSIZE);
+    return name;
+}
+
+/* Fetch the m URLs of u, all on one host, over one connection */
+static int hostfetch(u, m, depth)
+struct url **u;
+int m, depth;
+{
+    struct conn *c;
+    struct hparse *h;
+    struct resp *r;
+    struct timing t;
+    struct cksum ck;
+    char name[PATHSIZE], key[BUFSIZE], extra[RSEXTRA];
+    char *batch, *file;
+    int sent, recv, fails, nerr, len, n, fd, from, fresh;
+    double tsent[MAXDEPTH], cstart, cdns, cconn, now;
+
+    c = (struct conn *)malloc(sizeof(struct conn));
+    h = (struct hparse *)malloc(sizeof(struct hparse));
+    batch = (char *)malloc(MAXDEPTH * REQSIZE);
+    if (!c || !h || !batch) {
+        fprintf(stderr, "Error: out of memory\n");
+        return m;
+    }
+    c->sock = -1;
+    c->host = u[0]->host;
+    h->z = (struct inflate *)0;
+    r = &h->r;
+    cstart = tmnow();
+    len = lookup(u[0]->host, u[0]->port, &c->sa);
+    cdns = tmnow();
+    if (len < 0) {
+        free((char *)c);
+        free((char *)h);
+        free(batch);
+        return m;
+    }
+
+    sent = recv = fails = nerr = fresh = 0;
+    cconn = cdns;
+    while (recv < m) {
+        if (c->sock < 0) {
+            if (recv > 0 || fails > 0)
+                cstart = cdns = tmnow();
+            if (copen(c) < 0) {
+                nerr += m - recv;
+                break;
+            }
+            cconn = tmnow();
+            fresh = 1;
+            sent = recv;
+        }
+
+        /* Top up the pipeline with one write */
+        len = 0;
+        from = sent;
+        while (sent < m && sent - recv < depth) {
+            chkey(key, c->host, u[sent]->port, u[sent]->path);
+            u[sent]->have = rsprep(urlfile(u[sent], name), key, extra);
+            n = mkreq(batch + len, REQSIZE, "GET", c->host, u[sent]->path,
+                      u[sent]->have > 0 ? u[sent]->have : -1L, -1L, extra);
+            if (n < 0)
+                break;
+            len += n;
+            sent++;
+        }
+        if (sent == recv) {
+            /* Next in line and its request would not fit: skip it */
+            fprintf(stderr, "Error: %s: request too long\n", u[recv]->path);
+            nerr++;
+            sent = ++recv;
+            continue;
+        }
+        if (len > 0 && writeall(c->sock, batch, len) < 0) {
+            cclose(c);
+            if (++fails >= MAXFAIL)
+                goto failed;
+            continue;
+        }
+        for (now = tmnow(); from < sent; from++)
+            tsent[from % MAXDEPTH] = now;
+
+        hpinit(h);
+        if (cgethdr(c, h->hdr, HDRSIZE) <= 0 || parseresp(h->hdr, r) < 0) {
+            /* Closed under us: reconnect and resend what is unanswered */
+            cclose(c);
+            if (++fails >= MAXFAIL)
+                goto failed;
+            continue;
+        }
+
+        /* The first response on a connection pays for opening it */
+        t.first = tmnow();
+        t.start = t.dns = t.conn = t.sent = tsent[recv % MAXDEPTH];
+        if (fresh) {
+            t.start = cstart;
+            t.dns = cdns;
+            t.conn = cconn;
+            fresh = 0;
+        }
+
+        file = urlfile(u[recv], name);
+        fd = rsopen(file, r, u[recv]->have, u[recv]->path);
+        if (fd >= 0)
+            h->ck = ckprep(&ck, file, r->status == 206 ? u[recv]->have : 0L);
+        if (showhdr)
+            fputs(h->hdr, stderr);
+
+        if (hpbody(h) < 0 || cbody(c, h, fd < 0 ? -1 : fd) < 0) {
+            if (fd >= 0)
+                close(fd);
+            cclose(c);
+            if (++fails >= MAXFAIL)
+                goto failed;
+            continue;
+        }
+        if (fd == RS_DONE) {
+            if (ckprep(&ck, file, -1L) && ckdone(&ck, file) < 0)
+                nerr++;
+        } else if (fd < 0 || close(fd) < 0)
+            nerr++;
+        else if (h->ck && ckdone(h->ck, file) < 0)
+            nerr++;
+        else {
+            chkey(key, c->host, u[recv]->port, u[recv]->path);
+            rsdone(file, key, r);
+        }
+        tmlog(&t, c->host, u[recv]->port, u[recv]->path, r->status, h->body);
+        recv++;
+        fails = 0;
+        if (!r->keep)
+            cclose(c);
+        continue;
+
+    failed:
+        fprintf(stderr, "Error: %s: giving up after %d attempts\n",
+                u[recv]->path, fails);
+        nerr++;
+        recv++;
+        fails = 0;
+    }
+
+    cclose(c);
+    hpfree(h);
+    free((char *)c);
+    free((char *)h);
+    free(batch);
+    return nerr;
+}
+
+/*
+ * Fetch all n URLs, keeping one connection per host and up to depth
+ * requests in flight on it. Returns the number of URLs that failed.
+ */
+int multifetch(urls, n, depth)
+struct url *urls;
+int n, depth;
+{
+    struct url **grp;
+    char *done;
+    int i, j, m, nerr;
+
+    if (depth < 1)
+        depth = 1;
+    if (depth > MAXDEPTH)
+        depth = MAXDEPTH;
+    grp = (struct url **)malloc(n * sizeof(struct url *));
+    done = (char *)calloc(n, 1);
+    if (!grp || !done) {
+        fprintf(stderr, "Error: out of memory\n");
+        return n;
+    }
+
+    http11 = 1;
+    nerr = 0;
+    for (i = 0; i < n; i++) {
+        if (done[i])
+            continue;
+        m = 0;
+        for (j = i; j < n; j++)
+            if (!done[j] && urls[j].port == urls[i].port &&
+                !strcasecmp(urls[j].host, urls[i].host)) {
+                grp[m++] = &urls[j];
+                done[j] = 1;
+            }
+        nerr += hostfetch(grp, m, depth);
+    }
+
+    free((char *)grp);
+    free(done);
+    return nerr;
+}
@@ -0,0 +1,158 @@
+/*
+ * resume.c - continue interrupted downloads (-c)
+ *
+ * While a large body is being written to a file, the response's ETag
+ * and Last-Modified are kept beside it in "<file>.resume"; the note is
+ * removed once the body is complete. With -c an existing file is
+ * taken as a partial copy: the request asks for "Range: bytes=N-" and,
+ * if a note was left, adds "If-Range:" with the saved validator. The
+ * server then sends either the missing bytes (206), which are
+ * appended, or the whole file (200) if it changed or ignores ranges,
+ * which replaces the partial copy.
+ *
+ * A file that is not being resumed is instead looked up in the -C
+ * index (see cache.c), and a 304 answer leaves it as it is.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wget.h"
+
+#define RSMIN 1048576L      /* keep a note for bodies this big */
+
+int cont;                   /* -c: resume partial files */
+
+static void notename(file, buf)
+char *file, *buf;
+{
+    sprintf(buf, "%.*s.resume", PATHSIZE - 8, file);
+}
+
+/*
+ * Returns how many bytes of file, fetched from URL key, are already on
+ * disk (0 unless -c is set and the file exists) and puts the matching
+ * If-Range header, or else any conditional headers from the index,
+ * into extra, which must hold RSEXTRA bytes.
+ */
+long rsprep(file, key, extra)
+char *file, *key, *extra;
+{
+    struct stat st;
+    char note[PATHSIZE], line[RSEXTRA], *v;
+    FILE *fp;
+
+    extra[0] = '\0';
+    if (!cont || stat(file, &st) < 0 || st.st_size <= 0) {
+        chprep(key, file, extra);
+        return 0;
+    }
+
+    notename(file, note);
+    if ((fp = fopen(note, "r"))) {
+        /* First line ETag, second Last-Modified; a strong ETag wins */
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            v = strchr(line, ' ');
+            if (!v || !v[1] || extra[0] || !strncmp(v + 1, "W/", 2))
+                continue;
+            sprintf(extra, "If-Range: %.*s\r\n", RSEXTRA - 16, v + 1);
+        }
+        fclose(fp);
+    }
+    return (long)st.st_size;
+}
+
+/* Is a note kept while the body of r is written? */
+static int noted(r)
+struct resp *r;
+{
+    if (!r->etag[0] && !r->lastmod[0])
+        return 0;
+    return cont || r->clen < 0 || r->clen >= RSMIN;
+}
+
+/* Remember the validators of r in case the transfer is interrupted */
+static void rsnote(file, r)
+char *file;
+struct resp *r;
+{
+    char note[PATHSIZE];
+    FILE *fp;
+
+    if (!noted(r))
+        return;
+    notename(file, note);
+    if ((fp = fopen(note, "w"))) {
+        fprintf(fp, "ETag: %s\nLast-Modified: %s\n", r->etag, r->lastmod);
+        fclose(fp);
+    }
+}
+
+/*
+ * Open file for the body of response r to a request made when have
+ * bytes were already on disk. Returns the descriptor, RS_DONE if the
+ * file is already complete (discard the body), or -1 after printing
+ * an error.
+ */
+int rsopen(file, r, have, path)
+char *file;
+struct resp *r;
+long have;
+char *path;
+{
+    char note[PATHSIZE];
+    int fd;
+
+    if (r->status == 200) {
+        /* A fresh copy: the first fetch, or the server ignored Range */
+        fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else if (r->status == 206 && have > 0 && r->rstart == have) {
+        /* Not O_APPEND: splice() will not write to such a file */
+        if ((fd = open(file, O_WRONLY)) >= 0 &&
+            lseek(fd, (off_t)have, SEEK_SET) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else if (r->status == 304 && have == 0) {
+        /* Unchanged since the copy in the index */
+        return RS_DONE;
+    } else if (r->status == 416 && have > 0 &&
+               (r->rtotal < 0 || r->rtotal == have)) {
+        notename(file, note);
+        unlink(note);
+        return RS_DONE;
+    } else {
+        fprintf(stderr, "Error: %s: HTTP status %d\n", path, r->status);
+        return -1;
+    }
+    if (fd < 0) {
+        perror(file);
+        return -1;
+    }
+    rsnote(file, r);
+    if (!r->chunked && !r->gzip)
+        skalloc(fd, r->status == 206 ? have : 0L, r->clen);
+    return fd;
+}
+
+/* The body of r is complete in file: its note is no longer needed */
+void rsdone(file, key, r)
+char *file, *key;
+struct resp *r;
+{
+    char note[PATHSIZE];
+
+    chdone(key, file, r);
+    if (!noted(r))
+        return;
+    notename(file, note);
+    unlink(note);
+}
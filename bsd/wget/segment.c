@@ -0,0 +1,383 @@
+/*
+ * segment.c - fetch one file as byte ranges over parallel connections
+ *
+ * The first connection asks for "Range: bytes=0-". A 206 reply tells
+ * us the total size, so the file is preallocated and cut into nseg
+ * ranges; that first connection simply carries on as segment 0 and
+ * the others are opened with their own Range requests. A 200 reply
+ * means the server ignores ranges and the body is copied as it comes.
+ *
+ * All connections are non-blocking and driven from one select() loop,
+ * so nothing here needs threads. Each segment writes at its own offset
+ * with pwrite(). A segment that fails is reopened from the byte it had
+ * reached, up to MAXTRY times, waiting twice as long before each
+ * attempt as before the last, so that a host that is down is not
+ * dialled in a tight loop. A connection that finishes early steals
+ * the upper half of the largest range still outstanding; the victim is
+ * closed once it reaches the new end of its range.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wget.h"
+
+#define MAXSEG   32
+#define MINSEG   65536L     /* never split below this many bytes */
+#define MAXTRY   5          /* attempts per segment */
+#define IDLESECS 30         /* drop a connection silent this long */
+#define SEGBUF   16384
+
+/* Segment states */
+#define S_IDLE  0           /* nothing to do, or waiting to redial */
+#define S_CONN  1           /* connect in progress */
+#define S_HDR   2           /* request sent, collecting the header */
+#define S_BODY  3           /* writing body bytes */
+
+struct seg {
+    int sock;
+    int state;
+    long off;               /* next byte of the file to write */
+    long end;               /* one past the last byte wanted */
+    int tries;
+    int hlen;               /* header bytes collected */
+    char hdr[HDRSIZE];
+    long last;              /* time of last progress */
+    long due;               /* no redial before this time */
+};
+
+static struct sockaddr_in sa;
+static char *shost, *spath;
+static int sfd;
+static long total;
+
+/* Write n bytes of buf at offset off of the output file */
+static int putat(buf, n, off)
+char *buf;
+int n;
+long off;
+{
+    int w;
+
+    while (n > 0) {
+#ifdef NOPWRITE
+        lseek(sfd, off, SEEK_SET);
+        w = write(sfd, buf, n);
+#else
+        w = pwrite(sfd, buf, n, (off_t)off);
+#endif
+        if (w <= 0) {
+            perror("write");
+            return -1;
+        }
+        tmbytes((long)w);
+        buf += w;
+        n -= w;
+        off += w;
+    }
+    return 0;
+}
+
+/* Start (or restart) the request for segment s */
+static int segopen(s)
+struct seg *s;
+{
+    s->sock = dial(&sa, 1);
+    s->hlen = 0;
+    s->last = time((time_t *)0);
+    if (s->sock < 0) {
+        s->state = S_IDLE;
+        return -1;
+    }
+    s->state = S_CONN;
+    return 0;
+}
+
+/* The connect finished: send the Range request */
+static int segsend(s)
+struct seg *s;
+{
+    char buf[REQSIZE];
+    int err, n;
+    socklen_t len;
+
+    len = sizeof(err);
+    if (getsockopt(s->sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len) < 0 ||
+        err != 0)
+        return -1;
+    n = mkreq(buf, sizeof(buf), "GET", shost, spath, s->off, s->end - 1,
+              (char *)0);
+    /* The request is far smaller than any socket buffer */
+    if (n < 0 || write(s->sock, buf, n) != n)
+        return -1;
+    s->state = S_HDR;
+    return 0;
+}
+
+/* Store body bytes for s; anything past the end of its range is dropped */
+static int segdata(s, buf, n)
+struct seg *s;
+char *buf;
+int n;
+{
+    if (n > s->end - s->off)
+        n = s->end - s->off;
+    if (n > 0 && putat(buf, n, s->off) < 0)
+        return -1;
+    s->off += n;
+    return 0;
+}
+
+/* Collect header bytes; once complete, check the reply matches the range */
+static int seghdr(s)
+struct seg *s;
+{
+    struct resp r;
+    char *e;
+    int n;
+
+    n = read(s->sock, s->hdr + s->hlen, sizeof(s->hdr) - 1 - s->hlen);
+    if (n < 0 && errno == EWOULDBLOCK)
+        return 0;
+    if (n <= 0)
+        return -1;
+    s->hlen += n;
+    s->hdr[s->hlen] = '\0';
+    if (!(e = hdrend(s->hdr, s->hlen)))
+        return s->hlen < sizeof(s->hdr) - 1 ? 0 : -1;
+    if (parseresp(s->hdr, &r) < 0 || r.status != 206 || r.rstart != s->off) {
+        fprintf(stderr, "Error: %s: bad reply to range request\n", spath);
+        return -1;
+    }
+    s->state = S_BODY;
+    return segdata(s, e, s->hdr + s->hlen - e);
+}
+
+static void segclose(s)
+struct seg *s;
+{
+    if (s->sock >= 0)
+        close(s->sock);
+    s->sock = -1;
+    s->state = S_IDLE;
+    s->due = time((time_t *)0) + (1L << s->tries);
+}
+
+/*
+ * Give idle slot s the upper half of the largest outstanding range.
+ * Returns 0 if nothing was worth splitting.
+ */
+static int steal(segs, nseg, s)
+struct seg *segs;
+int nseg;
+struct seg *s;
+{
+    struct seg *v, *best;
+    long mid;
+
+    best = (struct seg *)0;
+    for (v = segs; v < segs + nseg; v++)
+        if (v != s && v->off < v->end &&
+            (!best || v->end - v->off > best->end - best->off))
+            best = v;
+    if (!best || best->end - best->off < 2 * MINSEG)
+        return 0;
+    mid = best->off + (best->end - best->off) / 2;
+    s->off = mid;
+    s->end = best->end;
+    s->tries = 0;
+    s->due = 0;
+    best->end = mid;
+    return 1;
+}
+
+/* Copy a body that is not being served in ranges */
+static int whole(sock, buf, n)
+int sock;
+char *buf;
+int n;
+{
+    if (copybody(sock, sfd, buf, n) < 0) {
+        fprintf(stderr, "Error: transfer of %s failed\n", spath);
+        return -1;
+    }
+    return 0;
+}
+
+int segfetch(host, port, path, file, nseg)
+char *host;
+int port;
+char *path, *file;
+int nseg;
+{
+    struct seg *segs, *s;
+    struct resp r;
+    fd_set rset, wset;
+    struct timeval tv;
+    char buf[SEGBUF];
+    int i, n, maxfd, hl, len;
+    long now, left;
+
+    shost = host;
+    spath = path;
+    if (nseg > MAXSEG)
+        nseg = MAXSEG;
+    if (lookup(host, port, &sa) < 0)
+        return -1;
+    sfd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sfd < 0) {
+        perror(file);
+        return -1;
+    }
+
+    segs = (struct seg *)calloc(nseg, sizeof(struct seg));
+    if (!segs) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+
+    /* Probe: the first request also becomes segment 0 */
+    s = &segs[0];
+    if ((s->sock = dial(&sa, 0)) < 0)
+        return -1;
+    n = mkreq(s->hdr, sizeof(s->hdr), "GET", host, path, 0L, -1L, (char *)0);
+    if (n < 0 || writeall(s->sock, s->hdr, n) < 0 ||
+        (hl = readhdr(s->sock, s->hdr, sizeof(s->hdr), &len)) < 0 ||
+        parseresp(s->hdr, &r) < 0) {
+        fprintf(stderr, "Error: no valid response from %s\n", host);
+        return -1;
+    }
+    if (r.status == 200) {
+        /* No ranges: plain single-stream download */
+        len -= hl;
+        if (len > 0)
+            bcopy(s->hdr + hl, buf, len);
+        n = whole(s->sock, buf, len);
+        close(s->sock);
+        close(sfd);
+        return n;
+    }
+    if (r.status != 206 || r.rstart != 0 || r.rtotal < 0) {
+        fprintf(stderr, "Error: %s: HTTP status %d\n", path, r.status);
+        return -1;
+    }
+
+    total = r.rtotal;
+    if (ftruncate(sfd, (off_t)total) < 0) {
+        perror(file);
+        return -1;
+    }
+    if (total < nseg * MINSEG)
+        nseg = total / MINSEG > 0 ? total / MINSEG : 1;
+
+    for (i = 0; i < nseg; i++) {
+        segs[i].off = total / nseg * i;
+        segs[i].end = i == nseg - 1 ? total : total / nseg * (i + 1);
+        if (i > 0)
+            segs[i].sock = -1;
+    }
+    fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL, 0) | O_NONBLOCK);
+    s->state = S_BODY;
+    s->last = time((time_t *)0);
+    if (segdata(s, s->hdr + hl, len - hl) < 0)
+        return -1;
+    for (i = 1; i < nseg; i++)
+        segopen(&segs[i]);
+
+    for (;;) {
+        now = time((time_t *)0);
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+        maxfd = -1;
+        left = 0;
+        for (s = segs; s < segs + nseg; s++) {
+            left += s->end - s->off;
+            if (s->state == S_BODY && s->off >= s->end)
+                segclose(s);
+            if (s->state == S_IDLE && s->off >= s->end &&
+                !steal(segs, nseg, s))
+                continue;
+            if (s->state == S_IDLE) {
+                if (now < s->due)
+                    continue;
+                if (++s->tries > MAXTRY) {
+                    fprintf(stderr, "Error: %s: giving up on bytes %ld-%ld\n",
+                            path, s->off, s->end - 1);
+                    return -1;
+                }
+                if (segopen(s) < 0) {
+                    s->due = now + (1L << s->tries);
+                    continue;
+                }
+            }
+            if (now - s->last > IDLESECS) {
+                fprintf(stderr, "Error: %s: segment at %ld timed out\n",
+                        path, s->off);
+                segclose(s);
+                continue;
+            }
+            FD_SET(s->sock, s->state == S_CONN ? &wset : &rset);
+            if (s->sock > maxfd)
+                maxfd = s->sock;
+        }
+        if (left == 0)
+            break;
+
+        /* With nothing busy this just waits for the next redial */
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        n = select(maxfd + 1, &rset, &wset, (fd_set *)0, &tv);
+        if (n < 0 && errno != EINTR) {
+            perror("select");
+            return -1;
+        }
+        if (n <= 0)
+            continue;
+
+        for (s = segs; s < segs + nseg; s++) {
+            if (s->sock < 0)
+                continue;
+            if (FD_ISSET(s->sock, &wset)) {
+                if (segsend(s) < 0)
+                    segclose(s);
+                continue;
+            }
+            if (!FD_ISSET(s->sock, &rset))
+                continue;
+            s->last = now;
+            if (s->state == S_HDR) {
+                if (seghdr(s) < 0)
+                    segclose(s);
+                continue;
+            }
+            n = read(s->sock, buf, sizeof(buf));
+            if (n < 0 && errno == EWOULDBLOCK)
+                continue;
+            if (n <= 0 || segdata(s, buf, n) < 0) {
+                /* Early EOF or error: reopen from where we got to */
+                segclose(s);
+                continue;
+            }
+            if (s->off >= s->end)
+                s->tries = 0;
+        }
+    }
+
+    for (s = segs; s < segs + nseg; s++)
+        segclose(s);
+    free((char *)segs);
+    if (close(sfd) < 0) {
+        perror(file);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * sink.c - moving body bytes from a socket to a file
+ *
+ * On Linux an identity body is spliced from the socket into a pipe
+ * and from the pipe into the file, so the data never passes through
+ * user space. Elsewhere, or where splice() will not take the file (a
+ * terminal, say), it is read into one large page aligned buffer,
+ * which is written out only when it is full or the body ends.
+ *
+ * When the length is known, the file's blocks are reserved first so
+ * that it is laid out in one piece. The reservation leaves the file
+ * size alone, so a partial file still says how much of it arrived.
+ *
+ * Build with -DNOSPLICE to use the buffered copy everywhere.
+ */
+
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "wget.h"
+
+#if defined(__linux__) && !defined(NOSPLICE)
+#define USE_SPLICE
+#endif
+
+#define BIGBUF  262144      /* the buffered copy's buffer */
+#define PIPESZ  1048576     /* pipe size to ask for */
+
+#ifdef USE_SPLICE
+static int pfd[2] = {-1, -1};
+static int pipesz;
+#endif
+static char *bigbuf;
+
+/* Reserve room for len more bytes of fd from offset off */
+void skalloc(fd, off, len)
+int fd;
+long off, len;
+{
+#ifdef __linux__
+    if (len > 0)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len);
+#endif
+}
+
+#ifdef USE_SPLICE
+/* The pipe everything is spliced through; -1 if there is none */
+static int skpipe()
+{
+    int n;
+
+    if (pfd[0] < 0) {
+        if (pipe(pfd) < 0)
+            return -1;
+        n = fcntl(pfd[1], F_SETPIPE_SZ, PIPESZ);
+        pipesz = n > 0 ? n : 65536;
+    }
+    return 0;
+}
+
+/* Copy the n bytes left in the pipe to fd with read and write */
+static int skdrain(fd, n)
+int fd;
+long n;
+{
+    char buf[8192];
+    int r;
+
+    while (n > 0) {
+        r = read(pfd[0], buf, n < sizeof(buf) ? (int)n : (int)sizeof(buf));
+        if (r <= 0 || writeall(fd, buf, r) < 0)
+            return -1;
+        n -= r;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Splice up to n bytes (n < 0: any number) from sock to fd. With
+ * nonblock set, return SK_AGAIN rather than wait for the socket.
+ * Returns the number moved, 0 at EOF, -1 on error, or SK_NOTSUP if
+ * splice() cannot be used here; fd has been written to only when the
+ * return is positive.
+ */
+long sksplice(sock, fd, n, nonblock)
+int sock, fd;
+long n;
+int nonblock;
+{
+#ifdef USE_SPLICE
+    ssize_t r, w;
+    size_t want;
+    long done;
+
+    if (skpipe() < 0)
+        return SK_NOTSUP;
+    want = n < 0 || n > pipesz ? pipesz : n;
+    r = splice(sock, (loff_t *)0, pfd[1], (loff_t *)0, want,
+               SPLICE_F_MOVE | (nonblock ? SPLICE_F_NONBLOCK : 0));
+    if (r < 0)
+        return errno == EAGAIN ? SK_AGAIN :
+               errno == EINVAL || errno == ENOSYS ? SK_NOTSUP : -1;
+    /* Empty the pipe again before going on */
+    for (done = 0; done < r; done += w) {
+        w = splice(pfd[0], (loff_t *)0, fd, (loff_t *)0, r - done,
+                   SPLICE_F_MOVE);
+        if (w <= 0) {
+            if (done == 0 && w < 0 && errno == EINVAL) {
+                /* fd cannot be spliced to: drain the pipe by hand */
+                if (skdrain(fd, r) < 0)
+                    return -1;
+                break;
+            }
+            return -1;
+        }
+    }
+    tmbytes((long)r);
+    return r;
+#else
+    return SK_NOTSUP;
+#endif
+}
+
+/* The buffered copy: fill a big buffer, then write it in one go */
+static long skbuf(sock, fd, n)
+int sock, fd;
+long n;
+{
+    long total;
+    int fill, r, want;
+
+    if (!bigbuf && !(bigbuf = pagealloc(BIGBUF)))
+        return -1;
+    total = 0;
+    r = 1;
+    while (r > 0 && (n < 0 || total < n)) {
+        fill = 0;
+        while (fill < BIGBUF && (n < 0 || total + fill < n)) {
+            want = BIGBUF - fill;
+            if (n >= 0 && n - total - fill < want)
+                want = n - total - fill;
+            r = read(sock, bigbuf + fill, want);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            fill += r;
+            tmbytes((long)r);
+        }
+        if (fill > 0 && writeall(fd, bigbuf, fill) < 0)
+            return -1;
+        total += fill;
+    }
+    return r < 0 ? -1 : total;
+}
+
+/*
+ * Copy n bytes (n < 0: all up to EOF) from the blocking socket sock to
+ * fd. Returns the number copied, which is short only if EOF came
+ * first, or -1 on error.
+ */
+long skcopy(sock, fd, n)
+int sock, fd;
+long n;
+{
+    long total, r;
+
+    total = 0;
+    while (n < 0 || total < n) {
+        r = sksplice(sock, fd, n < 0 ? -1L : n - total, 0);
+        if (r == SK_NOTSUP) {
+            r = skbuf(sock, fd, n < 0 ? -1L : n - total);
+            return r < 0 ? -1 : total + r;
+        }
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        total += r;
+    }
+    return total;
+}
+
+/* n bytes starting on a page boundary; never freed */
+char *pagealloc(n)
+int n;
+{
+    long pg;
+    char *p;
+
+    pg = getpagesize();
+    p = (char *)malloc(n + pg);
+    if (!p)
+        return p;
+    return p + (pg - (long)p % pg) % pg;
+}
@@ -0,0 +1,144 @@
+/*
+ * timing.c - per phase timing of transfers (-T, -R)
+ *
+ * Each transfer notes the monotonic clock as it passes its phases:
+ * start, host looked up, connected, request written, first byte of
+ * the response, end. With -T file, one JSON line per transfer goes to
+ * file ("-" for stderr), giving the time spent in each phase and the
+ * body bytes, so a slow fetch can be put down to DNS, the connect,
+ * the server or the network. The mass engine adds a summary line.
+ *
+ * Body bytes are also counted as they arrive, whatever the mode; with
+ * -R ms a sample of the bytes so far and the rate since the last
+ * sample is written every ms while data flows. Nothing but a clock
+ * read is done on the way unless a line is due.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "wget.h"
+
+char *tmfile;               /* -T: where the JSON lines go */
+long tmevery;               /* -R: ms between throughput samples */
+
+static FILE *tmfp;
+static long tmtotal, tmlast;
+static double tmzero, tmtick;
+
+/* Milliseconds on a clock that only goes forward */
+double tmnow()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, (struct timezone *)0);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#endif
+}
+
+/* The stream for -T output, or 0 if there is none */
+FILE *tmout()
+{
+    if (!tmfile)
+        return (FILE *)0;
+    if (!tmfp) {
+        tmfp = strcmp(tmfile, "-") ? fopen(tmfile, "a") : stderr;
+        if (!tmfp) {
+            perror(tmfile);
+            tmfile = (char *)0;
+        }
+    }
+    return tmfp;
+}
+
+/* A transfer begins now: every phase so far takes no time */
+void tmstart(t)
+struct timing *t;
+{
+    t->start = t->dns = t->conn = t->sent = t->first = t->end = tmnow();
+    if (tmzero == 0)
+        tmzero = tmtick = t->start;
+}
+
+/* Count n body bytes, and write a sample if one is due */
+void tmbytes(n)
+long n;
+{
+    double now, ms;
+    FILE *fp;
+
+    tmtotal += n;
+    if (tmevery <= 0)
+        return;
+    now = tmnow();
+    if (tmzero == 0)
+        tmzero = tmtick = now;
+    if ((ms = now - tmtick) < tmevery || !(fp = tmout()))
+        return;
+    fprintf(fp, "{\"sample_ms\":%.1f,\"bytes\":%ld,\"kbps\":%.1f}\n",
+            now - tmzero, tmtotal, (tmtotal - tmlast) / 1.024 / ms);
+    fflush(fp);
+    tmtick = now;
+    tmlast = tmtotal;
+}
+
+/* Write s as a JSON string */
+static void jstr(fp, s)
+FILE *fp;
+char *s;
+{
+    putc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < ' ')
+            fprintf(fp, "\\u%04x", *s);
+        else
+            putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+/*
+ * Transfer t of host:port/path, which got status (0: no response) and
+ * body bytes, ends now: write its line.
+ */
+void tmlog(t, host, port, path, status, body)
+struct timing *t;
+char *host;
+int port;
+char *path;
+int status;
+long body;
+{
+    char url[BUFSIZE];
+    double ms;
+    FILE *fp;
+
+    t->end = tmnow();
+    if (!(fp = tmout()))
+        return;
+    if (t->first < t->sent)
+        t->first = t->end;      /* no response */
+    sprintf(url, "http://%.255s:%d%.*s", host, port, BUFSIZE - 280, path);
+    ms = t->end - t->first;
+    fprintf(fp, "{\"url\":");
+    jstr(fp, url);
+    fprintf(fp, ",\"status\":%d,\"dns_ms\":%.3f,\"connect_ms\":%.3f,"
+            "\"ttfb_ms\":%.3f,\"body_ms\":%.3f,\"total_ms\":%.3f,"
+            "\"body_bytes\":%ld,\"kbps\":%.1f}\n",
+            status, t->dns - t->start, t->conn - t->dns,
+            t->first - t->sent, ms, t->end - t->start, body,
+            ms > 0 ? body / 1.024 / ms : 0.0);
+}
@@ -1,13 +1,39 @@
-/* 
+/*
  * minimal_wget.c
- * 
- * A (very) minimal single-file "wget-like" HTTP client in old K&R C.
- * 
+ *
+ * A (very) minimal "wget-like" HTTP client in old K&R C.
+ *
  * Example usage:
- *    cc minimal_wget.c -o minimal_wget
- *    ./minimal_wget example.com 80 /index.html
+ *    make
+ *    ./wget example.com 80 /index.html
+ *    ./wget -o big.iso -j 8 example.com 80 /big.iso
+ *    ./wget -c -o big.iso example.com 80 /big.iso
+ *    ./wget -C .wgetcache -i feeds.txt
+ *    ./wget -p 8 -i urls.txt
+ *    ./wget -m 200 -H 8 -i manifest.txt
+ *    ./wget -r -l 10 -w 50 http://docs.example.com/
  *
- * It will print the HTTP response (headers + body) to stdout.
+ * The body is written to stdout, or with -o to the named file; -S
+ * copies the response headers to stderr. -z asks for gzip compressed
+ * bodies, which are decoded as they arrive (see inflate.c). Adding -j N
+ * fetches the file as N byte ranges over parallel connections (see
+ * segment.c). With -c a file already on disk is taken as the start of
+ * the download and only the rest is fetched (see resume.c). With -C
+ * index, files fetched before are only fetched again if they changed
+ * on the server (see cache.c). -T file logs the time each transfer
+ * spent in each phase as JSON lines, and -R ms adds a throughput
+ * sample every ms (see timing.c). -V sum checks the body against a
+ * CRC-32 or SHA-256 as it streams in, and -M manifest does so for each
+ * file named in a sha256sum style manifest (see cksum.c).
+ *
+ * Given URLs instead (on the command line, or one per line from -i
+ * file, "-" for stdin), each body is saved under the last component of
+ * its path. Requests to one host share a kept-alive HTTP/1.1
+ * connection; -p N pipelines up to N requests on it (see multi.c).
+ * For big manifests, -m N instead runs up to N connections at once
+ * from one event loop, no more than -H of them per host (see mass.c),
+ * and -w N waits N ms between requests to a host. -r mirrors whole
+ * sites, following links up to -l levels deep (see crawl.c).
  *
  * Written to be as close to K&R as possible to compile on very old UNIX.
  * You may have to tweak headers or linking on 2.11BSD or other vintage OSes.
@@ -18,27 +44,31 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 
 /* If your 2.11BSD system does not have <unistd.h> or <string.h>, remove them
-   and use more traditional declarations (e.g. declare exit(), read(), etc. 
-   manually). Also, <arpa/inet.h> might need to be replaced or removed 
+   and use more traditional declarations (e.g. declare exit(), read(), etc.
+   manually). Also, <arpa/inet.h> might need to be replaced or removed
    depending on what's available. Adjust as necessary. */
 
-/* Buffer size for read/write operations */
-#define BUFSIZE 1024
+#include "wget.h"
 
-/* Function to connect to a given host+port; returns socket fd or -1 on error. */
-int connect_to_host(host, port)
+char *progname;
+int http11;             /* send HTTP/1.1 requests */
+int zaccept;            /* -z: ask for gzip bodies */
+
+/* Resolve host+port into sa; returns 0, or -1 on error. */
+int lookup(host, port, sa)
 char *host;
 int port;
+struct sockaddr_in *sa;
 {
     struct hostent *he;
-    struct sockaddr_in sa;
-    int sock;
 
     /* Look up host by name */
     he = gethostbyname(host);
@@ -47,23 +77,40 @@ int port;
         return -1;
     }
 
+    /* Zero out sockaddr_in */
+    memset((char *)sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    /* Convert hostent->h_addr to in_addr (for IPv4) */
+    memcpy((char *)&sa->sin_addr, (char *)he->h_addr, he->h_length);
+    /* Convert port from host byte order to network byte order */
+    sa->sin_port = htons((unsigned short)port);
+    return 0;
+}
+
+/*
+ * Open a TCP connection to sa; returns socket fd or -1 on error.
+ * With nonblock set the socket is non-blocking and the connect may
+ * still be in progress when this returns; wait for it to become
+ * writable.
+ */
+int dial(sa, nonblock)
+struct sockaddr_in *sa;
+int nonblock;
+{
+    int sock;
+
     /* Create a socket */
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         fprintf(stderr, "Error: socket creation failed.\n");
         return -1;
     }
-
-    /* Zero out sockaddr_in */
-    memset((char *)&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    /* Convert hostent->h_addr to in_addr (for IPv4) */
-    memcpy((char *)&sa.sin_addr, (char *)he->h_addr, he->h_length);
-    /* Convert port from host byte order to network byte order */
-    sa.sin_port = htons((unsigned short)port);
+    if (nonblock)
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
 
     /* Attempt to connect */
-    if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    if (connect(sock, (struct sockaddr *)sa, sizeof(*sa)) < 0 &&
+        !(nonblock && errno == EINPROGRESS)) {
         fprintf(stderr, "Error: connect failed.\n");
         close(sock);
         return -1;
@@ -72,56 +119,529 @@ int port;
     return sock;
 }
 
-/* 
+/* Function to connect to a given host+port; returns socket fd or -1 on error. */
+int connect_to_host(host, port)
+char *host;
+int port;
+{
+    struct sockaddr_in sa;
+
+    if (lookup(host, port, &sa) < 0)
+        return -1;
+    return dial(&sa, 0);
+}
+
+/*
+ * Format a request into buf, which holds size bytes, and return its
+ * length, or -1 if it would not fit. When from is not negative a Range
+ * header asks for bytes from..to (to < 0: to the end).
+ * extra, if not 0, holds more header lines, each ending in "\r\n".
+ * With -z a whole body may come gzip compressed; a range never is.
+ * HTTP/1.1 (and so a kept-alive connection) is used when http11 is set.
+ */
+int mkreq(buf, size, method, host, path, from, to, extra)
+char *buf;
+int size;
+char *method, *host, *path;
+long from, to;
+char *extra;
+{
+    char range[64];
+    int n;
+
+    range[0] = '\0';
+    if (from >= 0 && to >= 0)
+        sprintf(range, "Range: bytes=%ld-%ld\r\n", from, to);
+    else if (from >= 0)
+        sprintf(range, "Range: bytes=%ld-\r\n", from);
+    else if (zaccept)
+        strcpy(range, "Accept-Encoding: gzip\r\n");
+
+    /* The fixed text below comes to 37 bytes, the NUL included */
+    n = strlen(method) + strlen(path) + strlen(host) + strlen(USERAGENT) +
+        strlen(range) + (extra ? strlen(extra) : 0) + 37;
+    if (n > size)
+        return -1;
+    sprintf(buf,
+        "%s %s HTTP/1.%d\r\n"
+        "Host: %s\r\n"
+        "User-Agent: %s\r\n"
+        "%s%s\r\n",
+        method, path, http11, host, USERAGENT, range, extra ? extra : "");
+    return strlen(buf);
+}
+
+/* Write all n bytes; returns 0, or -1 on error. */
+int writeall(fd, buf, n)
+int fd;
+char *buf;
+int n;
+{
+    int w;
+
+    while (n > 0) {
+        w = write(fd, buf, n);
+        if (w <= 0)
+            return -1;
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* Return a pointer just past the blank line ending a header, or 0. */
+char *hdrend(buf, n)
+char *buf;
+int n;
+{
+    int i;
+
+    for (i = 3; i < n; i++)
+        if (buf[i] == '\n' && buf[i - 1] == '\r' &&
+            buf[i - 2] == '\n' && buf[i - 3] == '\r')
+            return buf + i + 1;
+    return (char *)0;
+}
+
+/*
+ * Read a response header from sock into buf. Returns the header length;
+ * *len is set to the number of bytes in buf, which may include the start
+ * of the body, and buf[*len] is set to NUL. Returns -1 on error or if the header does not fit.
+ */
+int readhdr(sock, buf, size, len)
+int sock;
+char *buf;
+int size;
+int *len;
+{
+    int n;
+    char *e;
+
+    *len = 0;
+    while (*len < size - 1) {
+        n = read(sock, buf + *len, size - 1 - *len);
+        if (n <= 0)
+            return -1;
+        *len += n;
+        buf[*len] = '\0';
+        if ((e = hdrend(buf, *len)))
+            return e - buf;
+    }
+    return -1;
+}
+
+/*
+ * Value of header field name in hdr, or 0; the value ends at "\r\n".
+ * The search stops at the blank line, so body bytes are never examined.
+ */
+static char *hdrval(hdr, name)
+char *hdr, *name;
+{
+    int n;
+
+    n = strlen(name);
+    while ((hdr = strchr(hdr, '\n'))) {
+        hdr++;
+        if (*hdr == '\r' || *hdr == '\n')
+            break;
+        if (!strncasecmp(hdr, name, n) && hdr[n] == ':') {
+            hdr += n + 1;
+            while (*hdr == ' ' || *hdr == '\t')
+                hdr++;
+            return hdr;
+        }
+    }
+    return (char *)0;
+}
+
+/* Copy the header value v, up to its "\r\n", into buf */
+static void hdrcopy(v, buf, size)
+char *v, *buf;
+int size;
+{
+    int n;
+
+    n = strcspn(v, "\r\n");
+    if (n > size - 1)
+        n = size - 1;
+    bcopy(v, buf, n);
+    buf[n] = '\0';
+}
+
+/* Fill in r from the response header hdr; returns -1 if it is garbled. */
+int parseresp(hdr, r)
+char *hdr;
+struct resp *r;
+{
+    char *v;
+
+    r->status = 0;
+    r->clen = -1;
+    r->rstart = r->rend = r->rtotal = -1;
+    r->ranges = 0;
+    r->chunked = 0;
+    r->etag[0] = r->lastmod[0] = r->loc[0] = '\0';
+    r->html = -1;
+    r->gzip = 0;
+
+    if (strncmp(hdr, "HTTP/", 5) || !(v = strchr(hdr, ' ')))
+        return -1;
+    r->status = atoi(v + 1);
+    /* HTTP/1.1 keeps the connection unless told otherwise; 1.0 the reverse */
+    r->keep = strncmp(hdr, "HTTP/1.0", 8) != 0;
+    if ((v = hdrval(hdr, "Connection")))
+        r->keep = !strncasecmp(v, "keep-alive", 10) ||
+                  (r->keep && strncasecmp(v, "close", 5));
+    if ((v = hdrval(hdr, "Transfer-Encoding")))
+        r->chunked = !strncasecmp(v, "chunked", 7);
+
+    if ((v = hdrval(hdr, "Content-Length")))
+        r->clen = atol(v);
+    if ((v = hdrval(hdr, "Accept-Ranges")))
+        r->ranges = !strncasecmp(v, "bytes", 5);
+    if ((v = hdrval(hdr, "Content-Range")) && !strncasecmp(v, "bytes ", 6)) {
+        r->rstart = atol(v + 6);
+        if ((v = strchr(v, '-')))
+            r->rend = atol(v + 1);
+        if (v && (v = strchr(v, '/')) && v[1] != '*')
+            r->rtotal = atol(v + 1);
+        r->ranges = 1;
+    }
+    if ((v = hdrval(hdr, "ETag")))
+        hdrcopy(v, r->etag, sizeof(r->etag));
+    if ((v = hdrval(hdr, "Last-Modified")))
+        hdrcopy(v, r->lastmod, sizeof(r->lastmod));
+    if ((v = hdrval(hdr, "Content-Type")))
+        r->html = !strncasecmp(v, "text/html", 9);
+    if ((v = hdrval(hdr, "Content-Encoding")))
+        r->gzip = !strncasecmp(v, "gzip", 4) || !strncasecmp(v, "x-gzip", 6);
+    if ((v = hdrval(hdr, "Location")))
+        hdrcopy(v, r->loc, sizeof(r->loc));
+    return 0;
+}
+
+/*
+ * Copy a response body to fd: first the n bytes already in buf (which
+ * must hold BUFSIZE), then the rest of the socket until EOF. Returns the
+ * number of bytes copied, or -1 on error.
+ */
+int copybody(sock, fd, buf, n)
+int sock, fd;
+char *buf;
+int n;
+{
+    long rest;
+
+    tmbytes((long)n);
+    if (writeall(fd, buf, n) < 0 || (rest = skcopy(sock, fd, -1L)) < 0)
+        return -1;
+    return n + rest;
+}
+
+/*
+ * Fetch path and write its body, headers stripped, to file, or to
+ * stdout if file is 0. With -c a partial file is completed rather than
+ * fetched again (see resume.c). Returns 0 or -1.
+ */
+static int getfile(host, port, path, file)
+char *host;
+int port;
+char *path, *file;
+{
+    char buf[REQSIZE], key[BUFSIZE], extra[RSEXTRA];
+    struct conn *c;
+    struct hparse *h;
+    struct timing t;
+    struct cksum ck;
+    int fd, len, ret;
+    long have;
+
+    c = (struct conn *)malloc(sizeof(struct conn));
+    h = (struct hparse *)malloc(sizeof(struct hparse));
+    if (!c || !h) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+    h->z = (struct inflate *)0;
+    hpinit(h);
+    c->host = host;
+    tmstart(&t);
+    len = lookup(host, port, &c->sa);
+    t.dns = tmnow();
+    if (len < 0 || copen(c) < 0) {
+        free((char *)c);
+        free((char *)h);
+        return -1;
+    }
+    t.conn = tmnow();
+
+    have = 0;
+    extra[0] = '\0';
+    chkey(key, host, port, path);
+    if (file)
+        have = rsprep(file, key, extra);
+    len = mkreq(buf, sizeof(buf), "GET", host, path, have > 0 ? have : -1L,
+                -1L, extra);
+    ret = -1;
+    if (len < 0) {
+        fprintf(stderr, "Error: %s: request too long\n", path);
+        goto out;
+    }
+    len = writeall(c->sock, buf, len);
+    t.sent = tmnow();
+    if (len < 0 || cgethdr(c, h->hdr, HDRSIZE) <= 0 ||
+        parseresp(h->hdr, &h->r) < 0) {
+        fprintf(stderr, "Error: no valid response from %s\n", host);
+        goto out;
+    }
+    t.first = tmnow();
+    if (showhdr)
+        fputs(h->hdr, stderr);
+    if (!file) {
+        fd = 1;
+        if (h->r.status >= 400)
+            fprintf(stderr, "Error: %s: HTTP status %d\n", path,
+                    h->r.status);
+    } else if ((fd = rsopen(file, &h->r, have, path)) < 0) {
+        /* Already complete: check the copy on disk, if asked to */
+        if (fd == RS_DONE)
+            ret = ckprep(&ck, file, -1L) && ckdone(&ck, file) < 0 ? -1 : 0;
+        goto out;
+    }
+    if (h->r.status < 300)
+        h->ck = ckprep(&ck, file, h->r.status == 206 ? have : 0L);
+
+    len = hpbody(h) < 0 || cbody(c, h, fd) < 0 ? -1 : 0;
+    if (file && close(fd) < 0) {
+        perror(file);
+        len = -1;
+    }
+    if (len < 0)
+        /* With -c, running again picks up where this stopped */
+        fprintf(stderr, "Error: transfer of %s failed\n", path);
+    else if (!h->ck || ckdone(h->ck, file) == 0) {
+        if (file)
+            rsdone(file, key, &h->r);
+        ret = h->r.status < 400 ? 0 : -1;
+    }
+
+out:
+    tmlog(&t, host, port, path, h->r.status, h->body);
+    cclose(c);
+    hpfree(h);
+    free((char *)c);
+    free((char *)h);
+    return ret;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: %s [-czS] [-C index] [-o file [-j segments]] <host> <port> <path>\n",
+        progname);
+    fprintf(stderr,
+        "       %s [-czS] [-C index] [-p depth | -m maxconn [-H perhost]] [-i listfile] [url ...]\n",
+        progname);
+    fprintf(stderr,
+        "       %s -r [-l depth] [-B bloomkb] [-m maxconn] [-H perhost] [-w ms] url ...\n",
+        progname);
+    fprintf(stderr,
+        "       (each also takes [-T timinglog] [-R ms]; all but -j also\n"
+        "        [-M manifest], and a single file [-V sum])\n");
+    exit(1);
+}
+
+/* Add URL s to the list; returns -1 if it cannot be parsed */
+static int addurl(s, urls, n, max)
+char *s;
+struct url **urls;
+int *n, *max;
+{
+    if (*n == *max) {
+        *max = *max ? *max * 2 : 64;
+        *urls = (struct url *)realloc((char *)*urls,
+                                      *max * sizeof(struct url));
+        if (!*urls) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+    }
+    if (parseurl(s, &(*urls)[*n]) < 0) {
+        fprintf(stderr, "Error: bad URL %s\n", s);
+        return -1;
+    }
+    (*n)++;
+    return 0;
+}
+
+/* Read URLs, one per line, from file ("-" is stdin) */
+static void readlist(file, urls, n, max)
+char *file;
+struct url **urls;
+int *n, *max;
+{
+    char line[BUFSIZE];
+    FILE *fp;
+    char *s;
+
+    fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
+    if (!fp) {
+        perror(file);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        s = line + strspn(line, " \t");
+        if (*s == '\0' || *s == '#')
+            continue;
+        s = strdup(s);
+        if (s)
+            addurl(s, urls, n, max);
+    }
+    if (fp != stdin)
+        fclose(fp);
+}
+
+/*
  * Minimal main: usage:
- *   minimal_wget <host> <port> <path>
+ *   minimal_wget [-czS] [-C index] [-o file [-j segments]] <host> <port> <path>
+ *   minimal_wget [-czS] [-C index] [-p depth | -m maxconn [-H perhost]] [-i listfile] [url ...]
+ *   minimal_wget -r [-l depth] [-B bloomkb] [-m maxconn] [-H perhost] [-w ms] url ...
+ *   (each also takes [-T timinglog] [-R ms]; all but -j also
+ *    [-M manifest], and a single file [-V sum])
  * Example:
  *   minimal_wget example.com 80 /index.html
+ *   minimal_wget -p 8 http://example.com/a.html http://example.com/b.html
  */
 int main(argc, argv)
 int argc;
 char **argv;
 {
-    int sock, n;
-    char sendbuf[BUFSIZE];
-    char recvbuf[BUFSIZE];
+    int n, c;
     char *host;
     int port;
     char *path;
+    char *file;
+    char *list;
+    int nseg, depth, maxconn, perhost, recurse, level;
+    int vsum;           /* 1: -V, 2: -M */
+    long bloomkb;
+    struct url *urls;
+    int nurl, maxurl;
+    extern char *optarg;
+    extern int optind;
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <host> <port> <path>\n", argv[0]);
-        exit(1);
+    progname = argv[0];
+    file = list = (char *)0;
+    nseg = depth = 1;
+    maxconn = 0;
+    perhost = 4;
+    recurse = vsum = 0;
+    level = 5;
+    bloomkb = 0;
+    while ((c = getopt(argc, argv, "cC:o:j:p:i:m:H:rl:B:w:zST:R:V:M:")) != EOF) {
+        switch (c) {
+        case 'c':
+            cont = 1;
+            break;
+        case 'C':
+            cachefile = optarg;
+            break;
+        case 'o':
+            file = optarg;
+            break;
+        case 'j':
+            nseg = atoi(optarg);
+            break;
+        case 'p':
+            depth = atoi(optarg);
+            break;
+        case 'i':
+            list = optarg;
+            break;
+        case 'm':
+            maxconn = atoi(optarg);
+            break;
+        case 'H':
+            perhost = atoi(optarg);
+            break;
+        case 'r':
+            recurse = 1;
+            break;
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'B':
+            bloomkb = atol(optarg);
+            break;
+        case 'w':
+            hostwait = atol(optarg);
+            break;
+        case 'z':
+            zaccept = 1;
+            break;
+        case 'S':
+            showhdr = 1;
+            break;
+        case 'T':
+            tmfile = optarg;
+            break;
+        case 'R':
+            tmevery = atol(optarg);
+            break;
+        case 'V':
+            if (ckset(optarg) < 0)
+                usage();
+            vsum |= 1;
+            break;
+        case 'M':
+            if (ckload(optarg) < 0)
+                exit(1);
+            vsum |= 2;
+            break;
+        default:
+            usage();
+        }
     }
 
-    host = argv[1];
-    port = atoi(argv[2]);
-    path = argv[3];
-
-    /* Connect to the server */
-    sock = connect_to_host(host, port);
-    if (sock < 0) {
-        fprintf(stderr, "Failed to connect.\n");
-        exit(1);
+    /* URL list mode: one kept-alive connection per host */
+    if (list || (optind < argc && strstr(argv[optind], "://"))) {
+        if (file || (vsum & 1) || (recurse && cachefile))
+            usage();
+        urls = (struct url *)0;
+        nurl = maxurl = 0;
+        for (; optind < argc; optind++)
+            if (addurl(argv[optind], &urls, &nurl, &maxurl) < 0)
+                exit(1);
+        if (list)
+            readlist(list, &urls, &nurl, &maxurl);
+        if (nurl == 0)
+            usage();
+        if (recurse)
+            exit(crawl(urls, nurl, maxconn > 0 ? maxconn : 16, perhost,
+                       level, bloomkb) ? 1 : 0);
+        if (maxconn > 0)
+            n = massfetch(urls, nurl, maxconn, perhost);
+        else
+            n = multifetch(urls, nurl, depth);
+        exit(chsave() < 0 || n ? 1 : 0);
     }
 
-    /* Construct a minimal HTTP/1.0 GET request */
-    /* We do NOT handle Host: header or anything beyond basics. */
-    sprintf(sendbuf,
-        "GET %s HTTP/1.0\r\n"
-        "User-Agent: minimal-wget/0.1 (K&R)\r\n"
-        "\r\n",
-        path);
-
-    /* Write request to the socket */
-    write(sock, sendbuf, strlen(sendbuf));
+    if (argc - optind != 3 || (nseg > 1 && !file) || recurse ||
+        ((cont || cachefile) && (!file || nseg > 1)) || (vsum && nseg > 1))
+        usage();
 
-    /* Read the response and print to stdout */
-    while ((n = read(sock, recvbuf, BUFSIZE)) > 0) {
-        write(1, recvbuf, n); /* write to file descriptor 1 (stdout) */
+    host = argv[optind];
+    port = atoi(argv[optind + 1]);
+    path = argv[optind + 2];
+    if (strlen(host) + strlen(path) > BUFSIZE - 128) {
+        fprintf(stderr, "Error: host or path too long.\n");
+        exit(1);
     }
 
-    close(sock);
-    return 0;
+    if (nseg > 1)
+        n = segfetch(host, port, path, file, nseg);
+    else
+        n = getfile(host, port, path, file);
+    return chsave() < 0 || n < 0 ? 1 : 0;
 }
-
@@ -0,0 +1,228 @@
+/*
+ * wget.h - definitions shared by the wget modules
+ */
+
+#ifdef __STDC__
+#define P(args) args
+#else
+#define P(args) ()
+#endif
+
+#ifndef O_NONBLOCK
+#define O_NONBLOCK O_NDELAY
+#endif
+
+/* Buffer size for read/write operations */
+#define BUFSIZE 1024
+
+/* Largest response header we are willing to collect */
+#define HDRSIZE 4096
+
+#define USERAGENT "minimal-wget/0.1 (K&R)"
+
+/* Read buffer of a kept-alive connection */
+#define CONNBUF 16384
+
+/* Local file names, and their ".resume" notes */
+#define PATHSIZE 256
+
+/* Room for the If-Range or conditional lines rsprep() builds */
+#define RSEXTRA 320
+
+/*
+ * A request: host and path take up to BUFSIZE - 128, the request line,
+ * Host, User-Agent and Range the rest, and then RSEXTRA of extra lines
+ */
+#define REQSIZE (BUFSIZE + RSEXTRA + 128)
+
+/* rsopen(): the file was already complete */
+#define RS_DONE (-2)
+
+/* sksplice(): nothing to read yet; splice() not usable */
+#define SK_AGAIN  (-2)
+#define SK_NOTSUP (-3)
+
+/* The parts of a response header the fetch modes care about */
+struct resp {
+    int status;         /* e.g. 200 */
+    long clen;          /* Content-Length, -1 if absent */
+    long rstart;        /* Content-Range: bytes rstart-rend/rtotal */
+    long rend;
+    long rtotal;        /* -1 if absent or "*" */
+    int ranges;         /* Accept-Ranges: bytes */
+    int chunked;        /* Transfer-Encoding: chunked */
+    int keep;           /* connection stays open after this response */
+    char etag[128];     /* ETag, "" if absent */
+    char lastmod[64];   /* Last-Modified, "" if absent */
+    int html;           /* Content-Type: text/html; -1 if absent */
+    int gzip;           /* Content-Encoding: gzip */
+    char loc[256];      /* Location, "" if absent */
+};
+
+/* A checksum being worked out over a body (see cksum.c) */
+#define CK_CRC 1
+#define CK_SHA 2
+
+struct cksum {
+    int type;
+    char *want;         /* expected sum, or "crc32" or "sha256" */
+    unsigned long crc;
+    unsigned long h[8]; /* SHA-256 state */
+    unsigned long lo;   /* bytes summed, low and high 32 bits */
+    unsigned long hi;
+    unsigned char blk[64];
+    int nblk;
+};
+
+/* A buffered connection that can carry several responses */
+struct conn {
+    int sock;           /* -1 when closed */
+    struct sockaddr_in sa;
+    char *host;         /* for the Host: header */
+    int rpos;           /* next unread byte in buf */
+    int rlen;           /* bytes in buf */
+    char buf[CONNBUF];
+};
+
+/* One URL to fetch */
+struct url {
+    char *host;
+    int port;
+    char *path;
+    char *file;         /* where the body goes */
+    long have;          /* bytes already on disk when requested (-c) */
+    int depth;          /* links followed to reach it (-r) */
+    char *scan;         /* the crawler's link scanner, while fetched */
+};
+
+/* Incremental response parser states */
+#define HP_HDR   0      /* collecting the header */
+#define HP_BODY  1      /* Content-Length body, or to EOF if left < 0 */
+#define HP_CSIZE 2      /* chunk-size line */
+#define HP_CDATA 3      /* chunk data */
+#define HP_CEND  4      /* CR LF after chunk data */
+#define HP_TRAIL 5      /* trailer fields */
+#define HP_DONE  6
+
+struct inflate;
+
+struct hparse {
+    int state;
+    struct resp r;      /* valid once past HP_HDR */
+    long left;          /* body or chunk bytes still to come */
+    long body;          /* body bytes delivered so far */
+    int hlen;
+    int llen;
+    char line[64];      /* chunk-size or trailer line */
+    struct inflate *z;  /* for a gzip body */
+    struct cksum *ck;   /* sum of the decoded body, or 0 */
+    int (*sink)();      /* where hpfeed() was to send it */
+    char *sarg;
+    char hdr[HDRSIZE];  /* a header that came in pieces */
+};
+
+/* When a transfer passed each phase, in tmnow() milliseconds */
+struct timing {
+    double start;
+    double dns;         /* host looked up */
+    double conn;        /* connected */
+    double sent;        /* request written */
+    double first;       /* first byte of the response */
+    double end;
+};
+
+extern char *progname;
+extern int http11;
+extern int zaccept;
+extern int showhdr;
+extern int cont;
+
+/* wget.c */
+int lookup P((char *host, int port, struct sockaddr_in *sa));
+int dial P((struct sockaddr_in *sa, int nonblock));
+int connect_to_host P((char *host, int port));
+int mkreq P((char *buf, int size, char *method, char *host, char *path,
+             long from, long to, char *extra));
+int writeall P((int fd, char *buf, int n));
+char *hdrend P((char *buf, int n));
+int readhdr P((int sock, char *buf, int size, int *len));
+int parseresp P((char *hdr, struct resp *r));
+int copybody P((int sock, int fd, char *buf, int n));
+
+/* segment.c */
+int segfetch P((char *host, int port, char *path, char *file, int nseg));
+
+/* conn.c */
+int copen P((struct conn *c));
+void cclose P((struct conn *c));
+int cgethdr P((struct conn *c, char *hdr, int size));
+long cbody P((struct conn *c, struct hparse *h, int fd));
+
+/* multi.c */
+int parseurl P((char *s, struct url *u));
+void outname P((char *path, char *name, int size));
+char *urlfile P((struct url *u, char *name));
+int multifetch P((struct url *urls, int n, int depth));
+
+/* http.c */
+void hpinit P((struct hparse *h));
+void hpfree P((struct hparse *h));
+int hpbody P((struct hparse *h));
+int hpfeed P((struct hparse *h, char *buf, int n, int (*sink)(), char *arg));
+int hpeof P((struct hparse *h));
+
+/* mass.c */
+extern long hostwait;
+extern void (*mbody) P((struct url *u, struct resp *r, char *buf, int n));
+extern void (*mredir) P((struct url *u, char *loc));
+extern void (*mdone) P((struct url *u, int st));
+int massinit P((int maxconn, int perhost));
+void massadd P((struct url *u));
+int massrun P((void));
+int massfetch P((struct url *urls, int n, int maxconn, int perhost));
+
+/* resume.c */
+long rsprep P((char *file, char *key, char *extra));
+int rsopen P((char *file, struct resp *r, long have, char *path));
+void rsdone P((char *file, char *key, struct resp *r));
+
+/* cache.c */
+extern char *cachefile;
+void chkey P((char *key, char *host, int port, char *path));
+void chprep P((char *url, char *file, char *extra));
+void chdone P((char *url, char *file, struct resp *r));
+int chsave P((void));
+
+/* crawl.c */
+int crawl P((struct url *urls, int n, int maxconn, int perhost,
+             int maxdepth, long bloom));
+
+/* inflate.c */
+struct inflate *zopen P((void));
+void zreset P((struct inflate *z));
+int zfeed P((struct inflate *z, char *buf, int n, int (*sink)(), char *arg));
+int zdone P((struct inflate *z));
+unsigned long zcrc P((unsigned long crc, char *buf, int n));
+
+/* cksum.c */
+int ckset P((char *s));
+int ckload P((char *file));
+struct cksum *ckprep P((struct cksum *k, char *name, long have));
+void ckfeed P((struct cksum *k, char *buf, int n));
+int ckdone P((struct cksum *k, char *name));
+
+/* timing.c */
+extern char *tmfile;
+extern long tmevery;
+double tmnow P((void));
+FILE *tmout P((void));
+void tmstart P((struct timing *t));
+void tmbytes P((long n));
+void tmlog P((struct timing *t, char *host, int port, char *path,
+              int status, long body));
+
+/* sink.c */
+void skalloc P((int fd, long off, long len));
+long sksplice P((int sock, int fd, long n, int nonblock));
+long skcopy P((int sock, int fd, long n));
+char *pagealloc P((int n));